@@ -0,0 +1,87 @@
+#ifndef BATCHED_H
+#define BATCHED_H
+
+#include <stddef.h>
+#include <omp.h>
+#include "FixedMatrix.h"
+#include "Transpose.h"
+
+// | ------------------------------------------------------ |
+// | Batched Small-Matrix Multiplication					|
+// | ------------------------------------------------------ |
+// Multiplies many small matrices in one call. A 10 x 10 product is only 1000 multiply-adds, far too little to split between threads, so
+// the threads share out the batch instead and each one multiplies whole matrices on its own. The matrices of a batch are stored back to
+// back in one array (matrix b starts at b * n * n, row-major), so a thread streams through its share of the memory in order.
+//
+// The common sizes (4, 8, 10, 16, 32) use the compile-time sized kernel from FixedMatrix.h, so the compiler unrolls the loops and keeps a
+// row of the result in registers. Other sizes use the same loops with the size read at run time.
+
+// Batches with fewer multiply-adds than this in total are run on the calling thread, as starting the threads would cost more
+#define BATCH_MIN_WORK 100000
+
+// This function sets C = A x B for one N x N matrix stored row-major, by viewing the arrays as matrices for the fixed-size kernel (A and
+// B are only read)
+template <int N>
+inline void MultiplySmall(const int *A, const int *B, int *C)
+{
+	FlatMatrix matrixC = { C, N };
+	MultiplyKernel<int, N, N, N>(FlatMatrix{ const_cast<int *>(A), N }, FlatMatrix{ const_cast<int *>(B), N }, matrixC);
+}
+
+// This function sets C = A x B for one n x n matrix of any size
+inline void MultiplySmall(const int *A, const int *B, int *C, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		int *row = C + ((size_t)i * n);
+		for (int j = 0; j < n; j++)
+			row[j] = 0;
+		for (int k = 0; k < n; k++)
+		{
+			const int a = A[((size_t)i * n) + k];
+			const int *rowB = B + ((size_t)k * n);
+			for (int j = 0; j < n; j++)
+				row[j] += a * rowB[j];
+		}
+	}
+}
+
+// This function runs a fixed-size kernel over a batch, splitting the batch between the OpenMP threads
+template <int N>
+inline void MultiplyBatch(const int *A, const int *B, int *C, int count)
+{
+	const size_t stride = (size_t)N * N;
+	#pragma omp parallel for schedule(static) if ((long long)count * N * N * N >= BATCH_MIN_WORK)
+	for (int b = 0; b < count; b++)
+		MultiplySmall<N>(A + (b * stride), B + (b * stride), C + (b * stride));
+}
+
+// This function sets C[b] = A[b] x B[b] for 'count' n x n matrices stored back to back in A, B and C
+inline void MultiplyBatched(const int *A, const int *B, int *C, int n, int count)
+{
+	switch (n)
+	{
+	case 4:
+		MultiplyBatch<4>(A, B, C, count);
+		return;
+	case 8:
+		MultiplyBatch<8>(A, B, C, count);
+		return;
+	case 10:
+		MultiplyBatch<10>(A, B, C, count);
+		return;
+	case 16:
+		MultiplyBatch<16>(A, B, C, count);
+		return;
+	case 32:
+		MultiplyBatch<32>(A, B, C, count);
+		return;
+	}
+
+	const size_t stride = (size_t)n * n;
+	#pragma omp parallel for schedule(static) if ((long long)count * n * n * n >= BATCH_MIN_WORK)
+	for (int b = 0; b < count; b++)
+		MultiplySmall(A + (b * stride), B + (b * stride), C + (b * stride), n);
+}
+
+#endif
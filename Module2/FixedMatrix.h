@@ -0,0 +1,119 @@
+#ifndef FIXED_MATRIX_H
+#define FIXED_MATRIX_H
+
+#include "Strassen.h"
+
+// | ------------------------------------------------------ |
+// | Compile-Time Sized Matrices							|
+// | ------------------------------------------------------ |
+// Kernels with the matrix dimensions as template parameters rather than run-time ints. With the loop counts known the compiler can unroll
+// them and vectorise the inner loop without a remainder loop, which matters most for small matrices where loop overhead is a large part of
+// the work. Matrix<T, Rows, Cols> holds a fixed-size matrix by value, and MultiplyDispatch picks the kernel built for the size of an int**
+// matrix at run time (from the sizes listed in FixedKernels), falling back to the generic blocked kernel for any other size. The same
+// kernel multiplies the small matrices of the batched multiply (Batched.h).
+
+// Sizes from which MultiplyFixed splits the rows of a multiply between the OpenMP threads (smaller ones are too little work to share)
+#define FIXED_PARALLEL_MIN 64
+
+template <typename T, int Rows, int Cols>
+struct Matrix
+{
+	T data[Rows][Cols];
+
+	T *operator[](int i) { return data[i]; }
+	const T *operator[](int i) const { return data[i]; }
+};
+
+// This function sets C = A x B where A is R x K and B is K x C. A, B and C can be anything indexed as X[i][j] (Matrix, row pointers or a
+// FlatMatrix). The loops run i-k-j, so the innermost loop walks along rows of B and C, and with C known it is unrolled into whole-row
+// vector operations
+template <typename T, int R, int K, int C, typename MatrixA, typename MatrixB, typename MatrixC>
+inline void MultiplyKernel(const MatrixA &A, const MatrixB &B, MatrixC &Cm)
+{
+	for (int i = 0; i < R; i++)
+	{
+		T row[C] = {};
+		for (int k = 0; k < K; k++)
+		{
+			const T a = A[i][k];
+			#pragma GCC unroll 32
+			for (int j = 0; j < C; j++)
+				row[j] += a * B[k][j];
+		}
+		for (int j = 0; j < C; j++)
+			Cm[i][j] = row[j];
+	}
+}
+
+template <typename T, int R, int K, int C>
+inline void Multiply(const Matrix<T, R, K> &A, const Matrix<T, K, C> &B, Matrix<T, R, C> &Cm)
+{
+	MultiplyKernel<T, R, K, C>(A, B, Cm);
+}
+
+// This function sets C = A x B for N x N int** matrices, one row of A and C at a time, with the rows shared between the OpenMP threads
+// for the larger sizes
+template <int N>
+inline void MultiplyFixed(int **A, int **B, int **C)
+{
+	#pragma omp parallel for if (N >= FIXED_PARALLEL_MIN)
+	for (int i = 0; i < N; i++)
+	{
+		int **rowC = C + i;
+		MultiplyKernel<int, 1, N, N>(A + i, B, rowC);
+	}
+}
+
+// | ------------------------------------------------------ |
+// | Dispatch Table											|
+// | ------------------------------------------------------ |
+
+struct FixedKernel
+{
+	int size;
+	void (*multiply)(int **, int **, int **);
+};
+
+// Table of kernels built for each size in Sizes
+template <int... Sizes>
+struct FixedKernelTable
+{
+	static const FixedKernel *Kernels(int &count)
+	{
+		static const FixedKernel kernels[] = { { Sizes, MultiplyFixed<Sizes> }... };
+		count = sizeof...(Sizes);
+		return kernels;
+	}
+};
+
+// Sizes with their own kernel: the small sizes used by the batched multiply plus the sizes of the drivers that fit in cache
+typedef FixedKernelTable<4, 8, 10, 16, 32, 64, 100> FixedKernels;
+
+// This function returns the kernel built for an n x n multiply, or NULL if there isn't one
+inline void (*FindFixedKernel(int n))(int **, int **, int **)
+{
+	int count;
+	const FixedKernel *kernels = FixedKernels::Kernels(count);
+	for (int i = 0; i < count; i++)
+	{
+		if (kernels[i].size == n)
+			return kernels[i].multiply;
+	}
+	return NULL;
+}
+
+// This function multiplies two n x n matrices with the kernel built for that size if there is one, or the fallback multiply otherwise. It
+// returns true if a fixed-size kernel was used
+inline bool MultiplyDispatch(int **A, int **B, int **C, int n, void (*fallback)(int **, int **, int **, int) = BlockedMultiply)
+{
+	void (*kernel)(int **, int **, int **) = FindFixedKernel(n);
+	if (kernel == NULL)
+	{
+		fallback(A, B, C, n);
+		return false;
+	}
+	kernel(A, B, C);
+	return true;
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <omp.h>
+
+// | ------------------------------------------------------ |
+// | Out-of-Core Multiplication								|
+// | ------------------------------------------------------ |
+// Multiply for matrices too large to hold in memory (a 100k x 100k int matrix is 40 GB). Each matrix lives in a file as square tiles, and
+// the files are memory-mapped, so a tile is read from disk the first time it is touched and can be dropped again once it is no longer
+// needed. C is built one panel of tile rows at a time: the panel's tiles of A stay resident while B is streamed through one column of
+// tiles after another, and a read-ahead thread pages in the next column of B (and the next panel of A) while the current one is
+// multiplied. The number of tile rows per panel is chosen so the resident tiles stay within a memory budget.
+//
+// File layout: a one-page header, then the tiles in row-major order of tiles, each tile row-major with the edges padded with zeros (every
+// tile starts on a page boundary, since a tile is a multiple of 1024 ints).
+
+// Side of the square tiles the matrices are stored as (512 x 512 ints is 1 MB, so the three tiles being multiplied fit in L2/L3)
+#define OOC_TILE 512
+// Size of the file header
+#define OOC_HEADER 4096
+
+struct TiledHeader
+{
+	char magic[8];
+	int n;
+	int tile;
+};
+
+// An n x n matrix stored as tiles in a memory-mapped file
+struct TiledMatrix
+{
+	int fd;
+	int n;
+	int tile;
+	// Tiles along each side
+	int tiles;
+	char *base;
+	size_t mapSize;
+
+	// Returns the first element of tile (ti, tj)
+	int *Tile(int ti, int tj) const
+	{
+		return (int *)(base + OOC_HEADER + ((((size_t)ti * tiles) + tj) * TileBytes()));
+	}
+
+	size_t TileBytes() const { return (size_t)tile * tile * sizeof(int); }
+
+	// Returns element (i, j)
+	int At(int i, int j) const
+	{
+		return Tile(i / tile, j / tile)[((i % tile) * tile) + (j % tile)];
+	}
+};
+
+// This function maps a tiled matrix file. With create set it makes a new file of zeros for an n x n matrix, otherwise it opens an
+// existing one (n and tile are then read from its header). It returns false and prints the reason if the file cannot be used
+inline bool OpenTiled(TiledMatrix &matrix, const char *path, bool create, int n = 0, int tile = OOC_TILE)
+{
+	matrix.fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+	if (matrix.fd < 0)
+	{
+		perror(path);
+		return false;
+	}
+
+	TiledHeader header;
+	if (create)
+	{
+		memcpy(header.magic, "TILEDMAT", 8);
+		header.n = n;
+		header.tile = tile;
+	}
+	else if (pread(matrix.fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || memcmp(header.magic, "TILEDMAT", 8) != 0)
+	{
+		fprintf(stderr, "%s: not a tiled matrix file\n", path);
+		close(matrix.fd);
+		return false;
+	}
+
+	matrix.n = header.n;
+	matrix.tile = header.tile;
+	matrix.tiles = (header.n + header.tile - 1) / header.tile;
+	matrix.mapSize = OOC_HEADER + ((size_t)matrix.tiles * matrix.tiles * matrix.TileBytes());
+
+	// A new file is extended to full size without writing it, so it takes no disk space until tiles are written (and reads as zeros)
+	if (create && (ftruncate(matrix.fd, (off_t)matrix.mapSize) != 0 || pwrite(matrix.fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)))
+	{
+		perror(path);
+		close(matrix.fd);
+		return false;
+	}
+
+	matrix.base = (char *)mmap(NULL, matrix.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, matrix.fd, 0);
+	if (matrix.base == MAP_FAILED)
+	{
+		perror(path);
+		close(matrix.fd);
+		return false;
+	}
+	return true;
+}
+
+// This function writes any changed tiles back to the file and unmaps it
+inline void CloseTiled(TiledMatrix &matrix)
+{
+	msync(matrix.base, matrix.mapSize, MS_SYNC);
+	munmap(matrix.base, matrix.mapSize);
+	close(matrix.fd);
+}
+
+// This function drops tile (ti, tj) from memory once it is no longer needed (changed tiles are written back first, and the tile is read
+// back from the file if it is touched again)
+inline void ReleaseTile(const TiledMatrix &matrix, int ti, int tj, bool written)
+{
+	if (written)
+		msync(matrix.Tile(ti, tj), matrix.TileBytes(), MS_SYNC);
+	madvise(matrix.Tile(ti, tj), matrix.TileBytes(), MADV_DONTNEED);
+}
+
+// | ------------------------------------------------------ |
+// | Read-Ahead Thread										|
+// | ------------------------------------------------------ |
+// Pages in ranges of mapped memory on a separate thread, so the disk reads overlap with multiplying tiles that are already resident. The
+// multiply never waits for it: touching a tile that hasn't been read yet simply reads it there and then.
+class ReadAhead
+{
+public:
+	ReadAhead() : stop(false), pageSize((size_t)sysconf(_SC_PAGESIZE)), worker(&ReadAhead::Run, this) {}
+
+	~ReadAhead()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+
+	// Queues a tile to be paged in
+	void Request(const TiledMatrix &matrix, int ti, int tj)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			ranges.push_back(Range{ (const char *)matrix.Tile(ti, tj), matrix.TileBytes() });
+		}
+		wake.notify_one();
+	}
+
+private:
+	struct Range
+	{
+		const char *start;
+		size_t length;
+	};
+
+	void Run()
+	{
+		while (true)
+		{
+			Range range;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return stop || !ranges.empty(); });
+				if (stop)
+					return;
+				range = ranges.front();
+				ranges.pop_front();
+			}
+
+			// Ask the kernel to start reading the whole range, then touch every page so it is resident before the multiply gets to it
+			madvise((void *)range.start, range.length, MADV_WILLNEED);
+			volatile char sink = 0;
+			for (size_t offset = 0; offset < range.length; offset += pageSize)
+				sink += range.start[offset];
+			(void)sink;
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<Range> ranges;
+	bool stop;
+	size_t pageSize;
+	std::thread worker;
+};
+
+// | ------------------------------------------------------ |
+// | Tiled Multiplication									|
+// | ------------------------------------------------------ |
+
+// This function adds the product of two tiles to a tile of C, splitting the rows of C between the OpenMP threads. The loops run i-k-j so
+// the innermost loop walks along rows of B and C
+inline void MultiplyAddTile(const int *A, const int *B, int *C, int tile)
+{
+	#pragma omp parallel for
+	for (int i = 0; i < tile; i++)
+	{
+		int *rowC = C + ((size_t)i * tile);
+		for (int k = 0; k < tile; k++)
+		{
+			const int a = A[((size_t)i * tile) + k];
+			const int *rowB = B + ((size_t)k * tile);
+			for (int j = 0; j < tile; j++)
+				rowC[j] += a * rowB[j];
+		}
+	}
+}
+
+// This function returns how many tile rows of C to build per panel so that the panel of A, its tiles of C, and two columns of B (the one
+// being multiplied and the one being read ahead) fit in budgetBytes (at least one)
+inline int PanelTileRows(const TiledMatrix &A, size_t budgetBytes)
+{
+	size_t columnB = (size_t)A.tiles * A.TileBytes();
+	size_t perRow = ((size_t)A.tiles + 1) * A.TileBytes();
+	if (budgetBytes <= 2 * columnB + perRow)
+		return 1;
+	size_t rows = (budgetBytes - (2 * columnB)) / perRow;
+	return (rows > (size_t)A.tiles) ? A.tiles : (int)rows;
+}
+
+// This function sets C = A x B for tiled matrices of the same size and tile (C must start as zeros, as a newly created file does) while
+// keeping roughly budgetBytes of the matrices in memory. It returns false if the matrices don't match
+inline bool MultiplyOutOfCore(const TiledMatrix &A, const TiledMatrix &B, const TiledMatrix &C, size_t budgetBytes)
+{
+	if (A.n != B.n || A.n != C.n || A.tile != B.tile || A.tile != C.tile)
+	{
+		fprintf(stderr, "Out-of-core multiply: matrices must have the same size and tile\n");
+		return false;
+	}
+
+	int tiles = A.tiles;
+	int panelRows = PanelTileRows(A, budgetBytes);
+	ReadAhead readAhead;
+
+	for (int ti = 0; ti < tiles; ti += panelRows)
+	{
+		int tiEnd = (ti + panelRows < tiles) ? ti + panelRows : tiles;
+
+		// Read this panel of A and the first column of B ahead of the multiply
+		for (int i = ti; i < tiEnd; i++)
+		{
+			for (int tk = 0; tk < tiles; tk++)
+				readAhead.Request(A, i, tk);
+		}
+		for (int tk = 0; tk < tiles; tk++)
+			readAhead.Request(B, tk, 0);
+
+		for (int tj = 0; tj < tiles; tj++)
+		{
+			// Read the next column of B (or the first tiles of the next panel of A) while this column is multiplied
+			if (tj + 1 < tiles)
+			{
+				for (int tk = 0; tk < tiles; tk++)
+					readAhead.Request(B, tk, tj + 1);
+			}
+			else if (tiEnd < tiles)
+				readAhead.Request(A, tiEnd, 0);
+
+			for (int i = ti; i < tiEnd; i++)
+			{
+				for (int tk = 0; tk < tiles; tk++)
+					MultiplyAddTile(A.Tile(i, tk), B.Tile(tk, tj), C.Tile(i, tj), A.tile);
+
+				// This tile of C is finished, so write it out and drop it
+				ReleaseTile(C, i, tj, true);
+			}
+
+			// Drop this column of B until the next panel needs it again
+			for (int tk = 0; tk < tiles; tk++)
+				ReleaseTile(B, tk, tj, false);
+		}
+
+		for (int i = ti; i < tiEnd; i++)
+		{
+			for (int tk = 0; tk < tiles; tk++)
+				ReleaseTile(A, i, tk, false);
+		}
+	}
+	return true;
+}
+
+#endif
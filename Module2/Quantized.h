@@ -0,0 +1,287 @@
+#ifndef QUANTIZED_H
+#define QUANTIZED_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <omp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANTIZED_X86 1
+#else
+#define QUANTIZED_X86 0
+#endif
+
+// | ------------------------------------------------------ |
+// | Low-Precision Integer Multiplication					|
+// | ------------------------------------------------------ |
+// Multiply for matrices whose values fit in a small range (PopulateMatrix only produces 0 to 9). The inputs are packed as 8-bit values
+// (one side unsigned, the other signed) or 16-bit values instead of 32-bit ones, so four (or two) times as many values are read per
+// memory access and per instruction, and the products are summed in 32-bit integers. A range check picks the narrowest type for which
+// every intermediate sum is exact, so the result is bit-for-bit the same as the int32 multiply.
+//
+// On x86 the 8-bit path uses AVX2's vpmaddubsw (unsigned x signed bytes, adding pairs into 16 bits) then vpmaddwd (adding pairs of those
+// into 32 bits), or a single vpdpbusd when the CPU has AVX-512 VNNI, and the 16-bit path uses vpmaddwd directly. The instruction set is
+// checked when the program runs, and plain loops over the packed values are used when it is missing.
+
+// Precision the inputs were packed to
+enum QuantizedPrecision { PRECISION_INT32, PRECISION_INT16, PRECISION_INT8 };
+
+// Smallest and largest values in a matrix
+struct ValueRange
+{
+	int min, max;
+};
+
+// This function scans a matrix for its smallest and largest values
+inline ValueRange FindRange(int **matrix, int n)
+{
+	int low = 0, high = 0;
+	if (n > 0)
+		low = high = matrix[0][0];
+
+	#pragma omp parallel for reduction(min:low) reduction(max:high)
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			low = (matrix[i][j] < low) ? matrix[i][j] : low;
+			high = (matrix[i][j] > high) ? matrix[i][j] : high;
+		}
+	}
+	return ValueRange{ low, high };
+}
+
+// This function returns the largest magnitude in a range
+inline long long Magnitude(ValueRange range)
+{
+	long long low = (range.min < 0) ? -(long long)range.min : range.min;
+	long long high = (range.max < 0) ? -(long long)range.max : range.max;
+	return (low > high) ? low : high;
+}
+
+// | ------------------------------------------------------ |
+// | Dot Product Kernels									|
+// | ------------------------------------------------------ |
+// Each kernel computes the dot products of one packed row u with four packed rows s (stride values apart), over k values (a multiple of 32
+// bytes, padded with zeros)
+
+inline void DotU8S8x4Scalar(const uint8_t *u, const int8_t *s, size_t stride, int k, int *out)
+{
+	for (int r = 0; r < 4; r++)
+	{
+		int sum = 0;
+		for (int p = 0; p < k; p++)
+			sum += (int)u[p] * (int)s[(r * stride) + p];
+		out[r] = sum;
+	}
+}
+
+inline void DotS16x4Scalar(const int16_t *u, const int16_t *s, size_t stride, int k, int *out)
+{
+	for (int r = 0; r < 4; r++)
+	{
+		int sum = 0;
+		for (int p = 0; p < k; p++)
+			sum += (int)u[p] * (int)s[(r * stride) + p];
+		out[r] = sum;
+	}
+}
+
+#if QUANTIZED_X86
+// This function adds the eight 32-bit lanes of a register together
+__attribute__((target("avx2"))) inline int HorizontalSum(__m256i v)
+{
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(sum);
+}
+
+// vpmaddubsw saturates each pair sum at 16 bits, so this is only used when two products can never exceed 32767 (see ChoosePrecision)
+__attribute__((target("avx2"))) inline void DotU8S8x4AVX2(const uint8_t *u, const int8_t *s, size_t stride, int k, int *out)
+{
+	const __m256i ones = _mm256_set1_epi16(1);
+	__m256i acc[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+	for (int p = 0; p < k; p += 32)
+	{
+		__m256i a = _mm256_load_si256((const __m256i *)(u + p));
+		for (int r = 0; r < 4; r++)
+		{
+			__m256i b = _mm256_load_si256((const __m256i *)(s + (r * stride) + p));
+			acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(_mm256_maddubs_epi16(a, b), ones));
+		}
+	}
+	for (int r = 0; r < 4; r++)
+		out[r] = HorizontalSum(acc[r]);
+}
+
+// vpdpbusd sums four products straight into 32 bits, so nothing can saturate
+__attribute__((target("avx2,avx512vnni,avx512vl"))) inline void DotU8S8x4VNNI(const uint8_t *u, const int8_t *s, size_t stride, int k, int *out)
+{
+	__m256i acc[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+	for (int p = 0; p < k; p += 32)
+	{
+		__m256i a = _mm256_load_si256((const __m256i *)(u + p));
+		for (int r = 0; r < 4; r++)
+			acc[r] = _mm256_dpbusd_epi32(acc[r], a, _mm256_load_si256((const __m256i *)(s + (r * stride) + p)));
+	}
+	for (int r = 0; r < 4; r++)
+		out[r] = HorizontalSum(acc[r]);
+}
+
+__attribute__((target("avx2"))) inline void DotS16x4AVX2(const int16_t *u, const int16_t *s, size_t stride, int k, int *out)
+{
+	__m256i acc[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+	for (int p = 0; p < k; p += 16)
+	{
+		__m256i a = _mm256_load_si256((const __m256i *)(u + p));
+		for (int r = 0; r < 4; r++)
+			acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(a, _mm256_load_si256((const __m256i *)(s + (r * stride) + p))));
+	}
+	for (int r = 0; r < 4; r++)
+		out[r] = HorizontalSum(acc[r]);
+}
+#endif
+
+// Instruction sets available on the CPU running the program
+inline bool HasAVX2()
+{
+#if QUANTIZED_X86
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+inline bool HasVNNI()
+{
+#if QUANTIZED_X86
+	return HasAVX2() && __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl");
+#else
+	return false;
+#endif
+}
+
+// | ------------------------------------------------------ |
+// | Packing and Multiplication								|
+// | ------------------------------------------------------ |
+
+// This function picks the narrowest precision that gives exact results for values in the given ranges. 8 bits needs one matrix to fit
+// in unsigned bytes and the other in signed bytes (swapped is set if it is m1 that is signed), plus, without VNNI, every pair of products
+// to fit in 16 bits. 16 bits needs both to fit in signed 16 bits (excluding -32768, so a pair of products always fits in 32 bits)
+inline QuantizedPrecision ChoosePrecision(ValueRange range1, ValueRange range2, bool vnni, bool &swapped)
+{
+	bool unsigned1 = range1.min >= 0 && range1.max <= 255, signed1 = range1.min >= -128 && range1.max <= 127;
+	bool unsigned2 = range2.min >= 0 && range2.max <= 255, signed2 = range2.min >= -128 && range2.max <= 127;
+	bool pairsFit = vnni || 2 * Magnitude(range1) * Magnitude(range2) <= 32767;
+
+	swapped = false;
+	if (pairsFit && unsigned1 && signed2)
+		return PRECISION_INT8;
+	if (pairsFit && unsigned2 && signed1)
+	{
+		swapped = true;
+		return PRECISION_INT8;
+	}
+	if (range1.min > -32768 && range1.max < 32768 && range2.min > -32768 && range2.max < 32768)
+		return PRECISION_INT16;
+	return PRECISION_INT32;
+}
+
+// This function packs n rows of a matrix (or of its transpose, if transposed is set) into 'rows' rows of k values of type T, aligned to 32
+// bytes and padded with zeros (released with free)
+template <typename T>
+T *PackRows(int **matrix, int n, bool transposed, int rows, int k)
+{
+	size_t bytes = (size_t)rows * k * sizeof(T);
+	T *packed = (T *)aligned_alloc(32, bytes);
+	memset(packed, 0, bytes);
+
+	#pragma omp parallel for
+	for (int r = 0; r < n; r++)
+	{
+		for (int c = 0; c < n; c++)
+			packed[((size_t)r * k) + c] = (T)(transposed ? matrix[c][r] : matrix[r][c]);
+	}
+	return packed;
+}
+
+// This function fills every element of the product from the dot products of packed rows: u row a with s rows b to b + 3 gives C[a][b..]
+// (or C[b..][a] if swapped)
+template <typename U, typename S>
+void MultiplyPacked(const U *u, const S *s, int **matrix3, int n, int k, bool swapped, void (*dot)(const U *, const S *, size_t, int, int *))
+{
+	#pragma omp parallel for
+	for (int a = 0; a < n; a++)
+	{
+		int out[4];
+		for (int b = 0; b < n; b += 4)
+		{
+			dot(u + ((size_t)a * k), s + ((size_t)b * k), (size_t)k, k, out);
+			for (int r = 0; r < 4 && b + r < n; r++)
+			{
+				if (swapped)
+					matrix3[b + r][a] = out[r];
+				else
+					matrix3[a][b + r] = out[r];
+			}
+		}
+	}
+}
+
+// This function multiplies two n x n matrices at the narrowest exact precision and returns the precision used. The value ranges can be
+// passed in if they are already known (e.g. straight after PopulateMatrix), otherwise the matrices are scanned for them. If neither 8 nor
+// 16 bits is exact it falls back to the given int32 multiply
+inline QuantizedPrecision MultiplyQuantized(int **m1, int **m2, int **m3, int n, void (*int32Multiply)(int **, int **, int **, int),
+											const ValueRange *range1 = NULL, const ValueRange *range2 = NULL)
+{
+	ValueRange r1 = (range1 != NULL) ? *range1 : FindRange(m1, n);
+	ValueRange r2 = (range2 != NULL) ? *range2 : FindRange(m2, n);
+	bool vnni = HasVNNI(), avx2 = HasAVX2();
+	bool swapped;
+	QuantizedPrecision precision = ChoosePrecision(r1, r2, vnni, swapped);
+
+	if (precision == PRECISION_INT32 || n == 0)
+	{
+		int32Multiply(m1, m2, m3, n);
+		return PRECISION_INT32;
+	}
+
+	// Rows of m1 and columns of m2 (rows of its transpose) both run along the shared dimension, padded to whole 32-byte registers, and the
+	// side read four rows at a time is padded to a multiple of four rows
+	int n4 = ((n + 3) / 4) * 4;
+	if (precision == PRECISION_INT8)
+	{
+		int k = ((n + 31) / 32) * 32;
+		uint8_t *u = swapped ? PackRows<uint8_t>(m2, n, true, n, k) : PackRows<uint8_t>(m1, n, false, n, k);
+		int8_t *s = swapped ? PackRows<int8_t>(m1, n, false, n4, k) : PackRows<int8_t>(m2, n, true, n4, k);
+		void (*dot)(const uint8_t *, const int8_t *, size_t, int, int *) = DotU8S8x4Scalar;
+#if QUANTIZED_X86
+		if (vnni)
+			dot = DotU8S8x4VNNI;
+		else if (avx2)
+			dot = DotU8S8x4AVX2;
+#endif
+		MultiplyPacked(u, s, m3, n, k, swapped, dot);
+		free(u);
+		free(s);
+	}
+	else
+	{
+		int k = ((n + 15) / 16) * 16;
+		int16_t *u = PackRows<int16_t>(m1, n, false, n, k);
+		int16_t *s = PackRows<int16_t>(m2, n, true, n4, k);
+		void (*dot)(const int16_t *, const int16_t *, size_t, int, int *) = DotS16x4Scalar;
+#if QUANTIZED_X86
+		if (avx2)
+			dot = DotS16x4AVX2;
+#endif
+		MultiplyPacked(u, s, m3, n, k, false, dot);
+		free(u);
+		free(s);
+	}
+	return precision;
+}
+
+#endif
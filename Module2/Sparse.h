@@ -0,0 +1,279 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stdlib.h>
+#include <vector>
+#include <omp.h>
+
+// | ------------------------------------------------------ |
+// | Sparse Matrices										|
+// | ------------------------------------------------------ |
+// Compressed storage for matrices that are mostly zeros, so multiplying them only touches the nonzeros. CSR (compressed sparse row)
+// keeps the nonzeros of each row together: row i's columns and values are colIdx/values[rowPtr[i]] to [rowPtr[i + 1] - 1]. CSC is the
+// same by column. MultiplyAuto measures how dense the inputs are and only takes the sparse path when it does less work than the dense
+// multiply.
+
+// The sparse multiply does about this many times more work per multiply-add than the dense loop (indexing and accumulating), so it is used
+// when density(m1) x density(m2) x SPARSE_OVERHEAD < 1
+#define SPARSE_OVERHEAD 16
+// A row whose product has fewer possible columns than (columns / HASH_RATIO) is accumulated in a small hash table rather than a dense row
+#define HASH_RATIO 16
+
+struct CSR
+{
+	int rows, cols;
+	std::vector<int> rowPtr;
+	std::vector<int> colIdx;
+	std::vector<int> values;
+};
+
+struct CSC
+{
+	int rows, cols;
+	std::vector<int> colPtr;
+	std::vector<int> rowIdx;
+	std::vector<int> values;
+};
+
+// This function returns the fraction of entries of an n x n matrix that are nonzero
+inline double Density(int **matrix, int n)
+{
+	long long nonzeros = 0;
+	#pragma omp parallel for reduction(+:nonzeros)
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+			nonzeros += (matrix[i][j] != 0);
+	}
+	return (n > 0) ? (double)nonzeros / ((double)n * n) : 0;
+}
+
+// This function compresses an n x n dense matrix into CSR
+inline CSR ToCSR(int **matrix, int n)
+{
+	CSR csr;
+	csr.rows = n;
+	csr.cols = n;
+	csr.rowPtr.assign(n + 1, 0);
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			if (matrix[i][j] != 0)
+			{
+				csr.colIdx.push_back(j);
+				csr.values.push_back(matrix[i][j]);
+			}
+		}
+		csr.rowPtr[i + 1] = (int)csr.colIdx.size();
+	}
+	return csr;
+}
+
+// This function converts CSR to CSC (a counting sort of the nonzeros by column, which keeps each column's rows in order)
+inline CSC ToCSC(const CSR &csr)
+{
+	CSC csc;
+	csc.rows = csr.rows;
+	csc.cols = csr.cols;
+	csc.colPtr.assign(csr.cols + 1, 0);
+	csc.rowIdx.resize(csr.colIdx.size());
+	csc.values.resize(csr.values.size());
+
+	for (int col : csr.colIdx)
+		csc.colPtr[col + 1]++;
+	for (int j = 0; j < csr.cols; j++)
+		csc.colPtr[j + 1] += csc.colPtr[j];
+
+	std::vector<int> next(csc.colPtr.begin(), csc.colPtr.end() - 1);
+	for (int i = 0; i < csr.rows; i++)
+	{
+		for (int p = csr.rowPtr[i]; p < csr.rowPtr[i + 1]; p++)
+		{
+			int dest = next[csr.colIdx[p]]++;
+			csc.rowIdx[dest] = i;
+			csc.values[dest] = csr.values[p];
+		}
+	}
+	return csc;
+}
+
+// This function expands CSR back into an existing dense matrix
+inline void ToDense(const CSR &csr, int **matrix)
+{
+	#pragma omp parallel for
+	for (int i = 0; i < csr.rows; i++)
+	{
+		for (int j = 0; j < csr.cols; j++)
+			matrix[i][j] = 0;
+		for (int p = csr.rowPtr[i]; p < csr.rowPtr[i + 1]; p++)
+			matrix[i][csr.colIdx[p]] = csr.values[p];
+	}
+}
+
+// This function computes y = A x with A in CSR. Each row is one dot product, so rows are shared between threads in small dynamic chunks
+// (rows can hold very different numbers of nonzeros)
+inline void SpMV(const CSR &A, const int *x, int *y)
+{
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = 0; i < A.rows; i++)
+	{
+		int sum = 0;
+		for (int p = A.rowPtr[i]; p < A.rowPtr[i + 1]; p++)
+			sum += A.values[p] * x[A.colIdx[p]];
+		y[i] = sum;
+	}
+}
+
+// This function computes y = A x with A in CSC. Each column scatters into y, so every thread sums its columns into its own copy of y and
+// the copies are added together at the end
+inline void SpMV(const CSC &A, const int *x, int *y)
+{
+	for (int i = 0; i < A.rows; i++)
+		y[i] = 0;
+
+	#pragma omp parallel
+	{
+		std::vector<int> local(A.rows, 0);
+		#pragma omp for schedule(dynamic, 64) nowait
+		for (int j = 0; j < A.cols; j++)
+		{
+			for (int p = A.colPtr[j]; p < A.colPtr[j + 1]; p++)
+				local[A.rowIdx[p]] += A.values[p] * x[j];
+		}
+
+		#pragma omp critical
+		for (int i = 0; i < A.rows; i++)
+			y[i] += local[i];
+	}
+}
+
+// This function computes C = A x B with all three in CSR, one row of C at a time (Gustavson's algorithm): row i of C is the sum of the
+// rows of B picked out by row i of A, scaled by A's values. Each thread accumulates its rows in its own accumulator, either a dense row
+// (marking which columns were touched) or, for rows that can only reach a few columns, a small open-addressing hash table
+inline CSR SpGEMM(const CSR &A, const CSR &B)
+{
+	CSR C;
+	C.rows = A.rows;
+	C.cols = B.cols;
+	C.rowPtr.assign(A.rows + 1, 0);
+	std::vector<std::vector<int>> rowCols(A.rows), rowValues(A.rows);
+
+	#pragma omp parallel
+	{
+		// Dense accumulator: a value per column, the position of each column in this row's output (-1 if untouched)
+		std::vector<int> denseValues(B.cols, 0);
+		std::vector<int> densePos(B.cols, -1);
+		// Hash accumulator: keys (column + 1, 0 if empty) and values, resized to fit each row
+		std::vector<int> hashKeys, hashValues;
+
+		#pragma omp for schedule(dynamic, 16)
+		for (int i = 0; i < A.rows; i++)
+		{
+			std::vector<int> &cols = rowCols[i];
+			std::vector<int> &vals = rowValues[i];
+
+			// Upper bound on the nonzeros of this row of C
+			int bound = 0;
+			for (int p = A.rowPtr[i]; p < A.rowPtr[i + 1]; p++)
+				bound += B.rowPtr[A.colIdx[p] + 1] - B.rowPtr[A.colIdx[p]];
+
+			if (bound < B.cols / HASH_RATIO)
+			{
+				int capacity = 1;
+				while (capacity < 2 * bound)
+					capacity *= 2;
+				hashKeys.assign(capacity, 0);
+				hashValues.assign(capacity, 0);
+
+				for (int p = A.rowPtr[i]; p < A.rowPtr[i + 1]; p++)
+				{
+					int a = A.values[p];
+					int k = A.colIdx[p];
+					for (int q = B.rowPtr[k]; q < B.rowPtr[k + 1]; q++)
+					{
+						int col = B.colIdx[q];
+						int slot = (col * 2654435761u) & (capacity - 1);
+						while (hashKeys[slot] != 0 && hashKeys[slot] != col + 1)
+							slot = (slot + 1) & (capacity - 1);
+						hashKeys[slot] = col + 1;
+						hashValues[slot] += a * B.values[q];
+					}
+				}
+
+				for (int slot = 0; slot < capacity; slot++)
+				{
+					if (hashKeys[slot] != 0 && hashValues[slot] != 0)
+					{
+						cols.push_back(hashKeys[slot] - 1);
+						vals.push_back(hashValues[slot]);
+					}
+				}
+			}
+			else
+			{
+				for (int p = A.rowPtr[i]; p < A.rowPtr[i + 1]; p++)
+				{
+					int a = A.values[p];
+					int k = A.colIdx[p];
+					for (int q = B.rowPtr[k]; q < B.rowPtr[k + 1]; q++)
+					{
+						int col = B.colIdx[q];
+						if (densePos[col] < 0)
+						{
+							densePos[col] = (int)cols.size();
+							cols.push_back(col);
+						}
+						denseValues[col] += a * B.values[q];
+					}
+				}
+
+				// Copy out the touched columns and reset only those for the next row
+				int touched = (int)cols.size();
+				int kept = 0;
+				for (int t = 0; t < touched; t++)
+				{
+					int col = cols[t];
+					if (denseValues[col] != 0)
+					{
+						cols[kept++] = col;
+						vals.push_back(denseValues[col]);
+					}
+					denseValues[col] = 0;
+					densePos[col] = -1;
+				}
+				cols.resize(kept);
+			}
+			C.rowPtr[i + 1] = (int)cols.size();
+		}
+	}
+
+	// Join the rows together (columns within a row are left in the order they were found)
+	for (int i = 0; i < A.rows; i++)
+		C.rowPtr[i + 1] += C.rowPtr[i];
+	C.colIdx.reserve(C.rowPtr[A.rows]);
+	C.values.reserve(C.rowPtr[A.rows]);
+	for (int i = 0; i < A.rows; i++)
+	{
+		C.colIdx.insert(C.colIdx.end(), rowCols[i].begin(), rowCols[i].end());
+		C.values.insert(C.values.end(), rowValues[i].begin(), rowValues[i].end());
+	}
+	return C;
+}
+
+// This function multiplies two n x n dense matrices with the given dense multiply, or compresses them, multiplies them with SpGEMM and
+// expands the result if they are sparse enough for that to be less work. It returns true if the sparse path was taken
+inline bool MultiplyAuto(int **m1, int **m2, int **m3, int n, void (*denseMultiply)(int **, int **, int **, int))
+{
+	if (Density(m1, n) * Density(m2, n) * SPARSE_OVERHEAD >= 1)
+	{
+		denseMultiply(m1, m2, m3, n);
+		return false;
+	}
+
+	CSR product = SpGEMM(ToCSR(m1, n), ToCSR(m2, n));
+	ToDense(product, m3);
+	return true;
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef STRASSEN_H
+#define STRASSEN_H
+
+#include <stdlib.h>
+#include <chrono>
+#include <omp.h>
+
+// | ------------------------------------------------------ |
+// | Strassen-Winograd Multiplication						|
+// | ------------------------------------------------------ |
+// Recursive multiply for large square matrices. Each level splits the matrices into quadrants and forms the product from 7 quadrant
+// products (instead of 8) plus 15 additions (Winograd's ordering of Strassen's method), so the work grows as n^2.81 rather than n^3.
+// Integer arithmetic is exact, so the extra additions cost nothing in accuracy. Once a quadrant is at or below the cutoff the blocked
+// kernel is faster, so it is used for the leaves. The 7 products of each level run as OpenMP tasks.
+//
+// Matrices are passed as row pointers (like the int** matrices of the drivers), so a quadrant is just a new set of row pointers into
+// the same memory and nothing is copied to split a matrix.
+
+// Side of the square blocks the blocked kernel works through at a time (3 int blocks of 64 x 64 fit comfortably in L2)
+#define STRASSEN_BLOCK 64
+// Default size at or below which the recursion switches to the blocked kernel (TuneStrassenCutoff picks one for the machine)
+#define STRASSEN_CUTOFF 128
+
+// Size at or below which the recursion switches to the blocked kernel (inline, so every file including this header shares it)
+inline int strassenCutoff = STRASSEN_CUTOFF;
+
+// This function allocates an n x n matrix as one contiguous block of zeros plus its row pointers (released with FreeBlock)
+inline int **AllocateBlock(int n)
+{
+	int **rows = (int **)malloc(n * sizeof(int *));
+	int *data = (int *)calloc((size_t)n * n, sizeof(int));
+	for (int i = 0; i < n; i++)
+		rows[i] = data + ((size_t)i * n);
+	return rows;
+}
+
+inline void FreeBlock(int **rows)
+{
+	free(rows[0]);
+	free(rows);
+}
+
+// This function returns row pointers to one quadrant (qi, qj) of a matrix whose quadrants have 'half' rows and columns (released with free)
+inline int **Quadrant(int **matrix, int half, int qi, int qj)
+{
+	int **rows = (int **)malloc(half * sizeof(int *));
+	for (int i = 0; i < half; i++)
+		rows[i] = matrix[(qi * half) + i] + (qj * half);
+	return rows;
+}
+
+// This function sets C = A + B (sign 1) or C = A - B (sign -1) for n x n matrices
+inline void AddBlock(int **A, int **B, int **C, int n, int sign)
+{
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+			C[i][j] = A[i][j] + (sign * B[i][j]);
+	}
+}
+
+// This function sets C = A x B for n x n matrices, working through STRASSEN_BLOCK blocks so each block of A, B and C stays in cache while
+// it is used. Within a block the loops run i-k-j, so the innermost loop walks along rows of B and C
+inline void BlockedMultiply(int **A, int **B, int **C, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+			C[i][j] = 0;
+	}
+
+	for (int ii = 0; ii < n; ii += STRASSEN_BLOCK)
+	{
+		int iEnd = (ii + STRASSEN_BLOCK < n) ? ii + STRASSEN_BLOCK : n;
+		for (int kk = 0; kk < n; kk += STRASSEN_BLOCK)
+		{
+			int kEnd = (kk + STRASSEN_BLOCK < n) ? kk + STRASSEN_BLOCK : n;
+			for (int jj = 0; jj < n; jj += STRASSEN_BLOCK)
+			{
+				int jEnd = (jj + STRASSEN_BLOCK < n) ? jj + STRASSEN_BLOCK : n;
+				for (int i = ii; i < iEnd; i++)
+				{
+					int *rowC = C[i];
+					for (int k = kk; k < kEnd; k++)
+					{
+						const int a = A[i][k];
+						const int *rowB = B[k];
+						for (int j = jj; j < jEnd; j++)
+							rowC[j] += a * rowB[j];
+					}
+				}
+			}
+		}
+	}
+}
+
+// This function sets C = A x B for n x n matrices with one Strassen-Winograd level, recursing on the 7 quadrant products (n must be
+// even above the cutoff, StrassenMultiply pads the matrices so it always is)
+inline void StrassenWinograd(int **A, int **B, int **C, int n, int cutoff)
+{
+	if (n <= cutoff || (n % 2) != 0)
+	{
+		BlockedMultiply(A, B, C, n);
+		return;
+	}
+
+	int half = n / 2;
+	int **A11 = Quadrant(A, half, 0, 0), **A12 = Quadrant(A, half, 0, 1), **A21 = Quadrant(A, half, 1, 0), **A22 = Quadrant(A, half, 1, 1);
+	int **B11 = Quadrant(B, half, 0, 0), **B12 = Quadrant(B, half, 0, 1), **B21 = Quadrant(B, half, 1, 0), **B22 = Quadrant(B, half, 1, 1);
+	int **C11 = Quadrant(C, half, 0, 0), **C12 = Quadrant(C, half, 0, 1), **C21 = Quadrant(C, half, 1, 0), **C22 = Quadrant(C, half, 1, 1);
+
+	// Sums of the quadrants of A (S) and B (T) that feed the products
+	int **S1 = AllocateBlock(half), **S2 = AllocateBlock(half), **S3 = AllocateBlock(half), **S4 = AllocateBlock(half);
+	int **T1 = AllocateBlock(half), **T2 = AllocateBlock(half), **T3 = AllocateBlock(half), **T4 = AllocateBlock(half);
+	AddBlock(A21, A22, S1, half, 1);
+	AddBlock(S1, A11, S2, half, -1);
+	AddBlock(A11, A21, S3, half, -1);
+	AddBlock(A12, S2, S4, half, -1);
+	AddBlock(B12, B11, T1, half, -1);
+	AddBlock(B22, T1, T2, half, -1);
+	AddBlock(B22, B12, T3, half, -1);
+	AddBlock(T2, B21, T4, half, -1);
+
+	// The 7 products are independent, so each one is a task (P1 and P2 are written straight into C11, which no other product reads)
+	int **P1 = AllocateBlock(half), **P2 = C11, **P3 = AllocateBlock(half), **P4 = AllocateBlock(half);
+	int **P5 = AllocateBlock(half), **P6 = AllocateBlock(half), **P7 = AllocateBlock(half);
+	#pragma omp task
+	StrassenWinograd(A11, B11, P1, half, cutoff);
+	#pragma omp task
+	StrassenWinograd(A12, B21, P2, half, cutoff);
+	#pragma omp task
+	StrassenWinograd(S4, B22, P3, half, cutoff);
+	#pragma omp task
+	StrassenWinograd(A22, T4, P4, half, cutoff);
+	#pragma omp task
+	StrassenWinograd(S1, T1, P5, half, cutoff);
+	#pragma omp task
+	StrassenWinograd(S2, T2, P6, half, cutoff);
+	#pragma omp task
+	StrassenWinograd(S3, T3, P7, half, cutoff);
+	#pragma omp taskwait
+
+	// Combine the products: C11 = P1 + P2, C12 = P1 + P6 + P5 + P3, C21 = P1 + P6 + P7 - P4, C22 = P1 + P6 + P7 + P5 (U holds P1 + P6)
+	int **U = P6;
+	AddBlock(P1, P6, U, half, 1);
+	AddBlock(C11, P1, C11, half, 1);
+	AddBlock(U, P5, C12, half, 1);
+	AddBlock(C12, P3, C12, half, 1);
+	AddBlock(U, P7, U, half, 1);
+	AddBlock(U, P4, C21, half, -1);
+	AddBlock(U, P5, C22, half, 1);
+
+	int **blocks[] = { S1, S2, S3, S4, T1, T2, T3, T4, P1, P3, P4, P5, P6, P7 };
+	for (int **block : blocks)
+		FreeBlock(block);
+	int **quadrants[] = { A11, A12, A21, A22, B11, B12, B21, B22, C11, C12, C21, C22 };
+	for (int **quadrant : quadrants)
+		free(quadrant);
+}
+
+// This function sets C = A x B for n x n matrices using Strassen-Winograd down to the cutoff, run by the current OpenMP threads. The
+// matrices are padded with zeros to the nearest size that halves evenly down to the cutoff (e.g. 1000 = 125 x 2^3 needs no padding)
+inline void StrassenMultiply(int **A, int **B, int **C, int n)
+{
+	int levels = 0;
+	while ((n >> levels) > strassenCutoff)
+		levels++;
+	int padded = ((n + (1 << levels) - 1) >> levels) << levels;
+
+	int **a = A, **b = B, **c = C;
+	if (padded != n)
+	{
+		a = AllocateBlock(padded);
+		b = AllocateBlock(padded);
+		c = AllocateBlock(padded);
+		for (int i = 0; i < n; i++)
+		{
+			for (int j = 0; j < n; j++)
+			{
+				a[i][j] = A[i][j];
+				b[i][j] = B[i][j];
+			}
+		}
+	}
+
+	#pragma omp parallel
+	{
+		#pragma omp single
+		StrassenWinograd(a, b, c, padded, strassenCutoff);
+	}
+
+	if (padded != n)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			for (int j = 0; j < n; j++)
+				C[i][j] = c[i][j];
+		}
+		FreeBlock(a);
+		FreeBlock(b);
+		FreeBlock(c);
+	}
+}
+
+// This function picks the cutoff for this machine: the smallest size where one Strassen-Winograd level over blocked leaves of that size
+// beats multiplying the whole (twice as large) matrix with the blocked kernel. Both run on a single thread so only the kernels are compared
+inline int TuneStrassenCutoff()
+{
+	int candidates[] = { 32, 64, 128, 256 };
+	for (int cutoff : candidates)
+	{
+		int n = cutoff * 2;
+		int **A = AllocateBlock(n), **B = AllocateBlock(n), **C = AllocateBlock(n);
+		for (int i = 0; i < n; i++)
+		{
+			for (int j = 0; j < n; j++)
+			{
+				A[i][j] = rand() % 10;
+				B[i][j] = rand() % 10;
+			}
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		BlockedMultiply(A, B, C, n);
+		auto middle = std::chrono::high_resolution_clock::now();
+		StrassenWinograd(A, B, C, n, cutoff);
+		auto stop = std::chrono::high_resolution_clock::now();
+
+		FreeBlock(A);
+		FreeBlock(B);
+		FreeBlock(C);
+		if (stop - middle < middle - start)
+			return cutoff;
+	}
+	return candidates[3] * 2;
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+// | ------------------------------------------------------ |
+// | Task Graph Runtime										|
+// | ------------------------------------------------------ |
+// Runs a set of tasks on a pool of pthreads in whatever order their dependencies allow. Each task is a function and argument in the same
+// form pthread_create takes, and counts how many of the tasks it depends on haven't finished yet. Tasks with nothing left to wait for sit
+// in a ready queue the threads take from, and finishing a task releases any of its dependents that were only waiting on it. So instead
+// of every thread finishing one stage before any starts the next, each task starts as soon as its own inputs are done.
+
+struct GraphTask
+{
+	void *(*function)(void *);
+	void *args;
+	// Tasks that depend on this one, and how many tasks this one is still waiting for
+	std::vector<int> dependents;
+	int waiting;
+};
+
+class TaskGraph
+{
+public:
+	TaskGraph() : remaining(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&wake, NULL);
+	}
+
+	~TaskGraph()
+	{
+		pthread_mutex_destroy(&mutex);
+		pthread_cond_destroy(&wake);
+	}
+
+	// Adds a task and returns its id
+	int AddTask(void *(*function)(void *), void *args)
+	{
+		GraphTask task;
+		task.function = function;
+		task.args = args;
+		task.waiting = 0;
+		tasks.push_back(task);
+		return (int)tasks.size() - 1;
+	}
+
+	// Makes task 'after' wait until task 'before' has finished
+	void AddDependency(int before, int after)
+	{
+		tasks[before].dependents.push_back(after);
+		tasks[after].waiting++;
+	}
+
+	// Runs every task on the given number of threads and returns once they have all finished
+	void Run(int threads)
+	{
+		remaining = (int)tasks.size();
+		for (int id = 0; id < (int)tasks.size(); id++)
+		{
+			if (tasks[id].waiting == 0)
+				ready.push_back(id);
+		}
+
+		pthread_t workers[threads];
+		for (int i = 0; i < threads; i++)
+			pthread_create(&workers[i], NULL, Worker, (void *)this);
+		for (int i = 0; i < threads; i++)
+			pthread_join(workers[i], NULL);
+	}
+
+private:
+	// Each thread takes ready tasks until every task has finished
+	static void *Worker(void *args)
+	{
+		TaskGraph *graph = (TaskGraph *)args;
+		pthread_mutex_lock(&graph->mutex);
+		while (true)
+		{
+			while (graph->ready.empty() && graph->remaining > 0)
+				pthread_cond_wait(&graph->wake, &graph->mutex);
+			if (graph->remaining == 0)
+				break;
+
+			int id = graph->ready.front();
+			graph->ready.pop_front();
+			pthread_mutex_unlock(&graph->mutex);
+
+			GraphTask &task = graph->tasks[id];
+			task.function(task.args);
+
+			// Release the dependents that were only waiting on this task (and every thread once the last task is done)
+			pthread_mutex_lock(&graph->mutex);
+			graph->remaining--;
+			for (int dependent : task.dependents)
+			{
+				if (--graph->tasks[dependent].waiting == 0)
+				{
+					graph->ready.push_back(dependent);
+					pthread_cond_signal(&graph->wake);
+				}
+			}
+			if (graph->remaining == 0)
+				pthread_cond_broadcast(&graph->wake);
+		}
+		pthread_mutex_unlock(&graph->mutex);
+		return NULL;
+	}
+
+	std::vector<GraphTask> tasks;
+	std::deque<int> ready;
+	int remaining;
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+};
+
+#endif
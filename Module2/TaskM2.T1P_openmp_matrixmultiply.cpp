@@ -6,10 +6,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <omp.h>
+#include <string>
+#include "Strassen.h"
+#include "Sparse.h"
+#include "Quantized.h"
+#include "Batched.h"
+#include "FixedMatrix.h"
+#include "OutOfCore.h"
+#include "Transpose.h"
 
 using namespace std::chrono;
 using namespace std;
 
+// Define the fraction of entries that are nonzero in the matrices of the sparse mode
+#define SPARSE_FILL 0.02
+// Define the number of matrix entries in each batch of the batched mode (so smaller matrices come in larger batches)
+#define BATCH_ELEMENTS (1 << 22)
+// Define the default matrix size and memory budget (in MB) of the out-of-core mode, and how many entries of its result are spot-checked
+#define OUT_OF_CORE_SIZE 4096
+#define OUT_OF_CORE_BUDGET_MB 1024
+#define OUT_OF_CORE_CHECKS 16
+
 void PrintRow(int* array, int size)
 {
 	cout << "|  ";
@@ -67,6 +84,18 @@ void PopulateMatrix(int** matrix, int size)
 	}
 }
 
+// This function populates a matrix where only about SPARSE_FILL of the entries are nonzero (random integers from 1 to 9)
+void PopulateSparseMatrix(int** matrix, int size)
+{
+	for (int i = 0; i < size; i++)
+	{
+		for (int j = 0; j < size; j++)
+		{
+			matrix[i][j] = (rand() < SPARSE_FILL * RAND_MAX) ? (rand() % 9) + 1 : 0;
+		}
+	}
+}
+
 void MultiplyMatrices(int** matrix1, int** matrix2, int** matrix3, int size)
 {
 	#pragma omp parallel
@@ -86,19 +115,224 @@ void MultiplyMatrices(int** matrix1, int** matrix2, int** matrix3, int size)
 	}
 }
 
-int main()
+// This function returns how many entries of matrix3 differ from the product MultiplyMatrices gives for matrix1 and matrix2, so the
+// faster multiplies can be checked against it
+long long CountMismatches(int** matrix1, int** matrix2, int** matrix3, int size)
+{
+	int** expected = (int**) malloc(size * sizeof(int*));
+	for (int i = 0; i < size; i++)
+		expected[i] = (int*) malloc(size * sizeof(int));
+	MultiplyMatrices(matrix1, matrix2, expected, size);
+
+	long long mismatches = 0;
+	for (int i = 0; i < size; i++)
+	{
+		for (int j = 0; j < size; j++)
+			mismatches += (matrix3[i][j] != expected[i][j]);
+		free(expected[i]);
+	}
+	free(expected);
+	return mismatches;
+}
+
+// This function returns how many entries of a batch of products C differ from multiplying each pair of matrices with the run-time sized
+// kernel, so the fixed-size kernels of the batched multiply can be checked against it
+long long CountBatchMismatches(const int* a, const int* b, const int* c, int size, int count)
+{
+	const size_t stride = (size_t)size * size;
+	int* expected = (int*) malloc(stride * sizeof(int));
+	long long mismatches = 0;
+	for (int m = 0; m < count; m++)
+	{
+		MultiplySmall(a + (m * stride), b + (m * stride), expected, size);
+		for (size_t i = 0; i < stride; i++)
+			mismatches += (c[(m * stride) + i] != expected[i]);
+	}
+	free(expected);
+	return mismatches;
+}
+
+// This function times multiplying a batch of small matrices with the batched multiply for each fixed-size kernel and thread count
+void RunBatched(string resultsFile)
 {
+	int batch_sizes[] = { 4, 8, 10, 16, 32 };
+	int n_threads[] = { 2, 8, 16, 24 };
+
+	for (int size : batch_sizes)
+	{
+		int count = BATCH_ELEMENTS / (size * size);
+		size_t elements = (size_t)count * size * size;
+		int* a = (int*) malloc(elements * sizeof(int));
+		int* b = (int*) malloc(elements * sizeof(int));
+		int* c = (int*) malloc(elements * sizeof(int));
+
+		srand(time(NULL) * size);
+		for (size_t i = 0; i < elements; i++)
+		{
+			a[i] = rand() % 10;
+			b[i] = rand() % 10;
+		}
+
+		for (int numThreads : n_threads)
+		{
+			omp_set_num_threads(numThreads);
+
+			auto startMultiply = high_resolution_clock::now();
+			MultiplyBatched(a, b, c, size, count);
+			auto stop = high_resolution_clock::now();
+			auto durationMultiply = duration_cast<microseconds>(stop - startMultiply);
+
+			// Check the batch against the run-time sized kernel once per size (outside the timing, on the first thread count)
+			bool check = (numThreads == n_threads[0]);
+			long long mismatches = check ? CountBatchMismatches(a, b, c, size, count) : 0;
+
+			cout << "MATRIX SIZE: " << size << ", BATCH: " << count << ", THREADS: " << numThreads << endl;
+			if (check)
+				cout << "Mismatches against MultiplySmall: " << mismatches << " of " << (long long)elements << endl;
+			cout << "Time taken to multiply batch: " << durationMultiply.count() << " microseconds\n" << endl;
+
+			freopen(resultsFile.c_str(), "a", stdout);
+			cout << "MATRIX SIZE: " << size << ", BATCH: " << count << ", THREADS: " << numThreads << endl;
+			if (check)
+				cout << "Mismatches against MultiplySmall: " << mismatches << " of " << (long long)elements << endl;
+			cout << "Time taken to multiply batch: " << durationMultiply.count() << " microseconds\n" << endl;
+			freopen("CON", "w", stdout);
+		}
+
+		free(a);
+		free(b);
+		free(c);
+	}
+}
+
+// This function populates a tiled matrix file one tile at a time (random integers from 0 to 9, zeros past the edge), writing each tile
+// out before moving on so the whole matrix is never in memory
+void PopulateTiled(const TiledMatrix& matrix)
+{
+	for (int ti = 0; ti < matrix.tiles; ti++)
+	{
+		for (int tj = 0; tj < matrix.tiles; tj++)
+		{
+			int* tile = matrix.Tile(ti, tj);
+			for (int i = 0; i < matrix.tile; i++)
+			{
+				for (int j = 0; j < matrix.tile; j++)
+				{
+					bool inside = (ti * matrix.tile) + i < matrix.n && (tj * matrix.tile) + j < matrix.n;
+					tile[(i * matrix.tile) + j] = inside ? rand() % 10 : 0;
+				}
+			}
+			ReleaseTile(matrix, ti, tj, true);
+		}
+	}
+}
+
+// This function times multiplying two matrices held in tiled files within a memory budget, then spot-checks entries of the result
+// against dot products of the inputs
+void RunOutOfCore(string resultsFile, int size, size_t budgetMB)
+{
+	TiledMatrix a, b, c;
+	if (!OpenTiled(a, "ooc_m1.bin", true, size) || !OpenTiled(b, "ooc_m2.bin", true, size) || !OpenTiled(c, "ooc_m3.bin", true, size))
+		exit(1);
+
+	srand(time(NULL) * size);
+	auto startPopulate = high_resolution_clock::now();
+	PopulateTiled(a);
+	PopulateTiled(b);
+	auto startMultiply = high_resolution_clock::now();
+	MultiplyOutOfCore(a, b, c, budgetMB << 20);
+	auto stop = high_resolution_clock::now();
+
+	auto durationPopulate = duration_cast<microseconds>(startMultiply - startPopulate);
+	auto durationMultiply = duration_cast<microseconds>(stop - startMultiply);
+
+	int failedChecks = 0;
+	for (int check = 0; check < OUT_OF_CORE_CHECKS; check++)
+	{
+		int i = rand() % size;
+		int j = rand() % size;
+		int sum = 0;
+		for (int k = 0; k < size; k++)
+			sum += a.At(i, k) * b.At(k, j);
+		failedChecks += (sum != c.At(i, j));
+	}
+
+	CloseTiled(a);
+	CloseTiled(b);
+	CloseTiled(c);
+	remove("ooc_m1.bin");
+	remove("ooc_m2.bin");
+	remove("ooc_m3.bin");
+
+	cout << "MATRIX SIZE: " << size << ", MEMORY BUDGET: " << budgetMB << " MB" << endl;
+	cout << "Spot checks failed: " << failedChecks << " of " << OUT_OF_CORE_CHECKS << endl;
+	cout << "Time taken to populate square matrices: " << durationPopulate.count() << " microseconds" << endl;
+	cout << "Time taken to multiply square matrices: " << durationMultiply.count() << " microseconds\n" << endl;
+
+	freopen(resultsFile.c_str(), "a", stdout);
+	cout << "MATRIX SIZE: " << size << ", MEMORY BUDGET: " << budgetMB << " MB" << endl;
+	cout << "Spot checks failed: " << failedChecks << " of " << OUT_OF_CORE_CHECKS << endl;
+	cout << "Time taken to populate square matrices: " << durationPopulate.count() << " microseconds" << endl;
+	cout << "Time taken to multiply square matrices: " << durationMultiply.count() << " microseconds\n" << endl;
+	freopen("CON", "w", stdout);
+}
+
+int main(int argc, char** argv)
+{
+	// Read which mode to run in ("strassen" uses Strassen-Winograd, "sparse" multiplies mostly-zero matrices as sparse or dense depending
+	// on their density, "quantized" packs the values as 8 or 16-bit integers, "batched" multiplies batches of small matrices, "fixed" uses a
+	// kernel built for the matrix size when there is one, "outofcore" multiplies matrices kept in tiled files (optionally followed by the
+	// size and the memory budget in MB), "transposed" transposes m2 first so every product reads along rows, anything else the straightforward
+	// multiply), each with its own results file
+	string mode = (argc > 1) ? argv[1] : "dense";
+	bool strassen = (mode == "strassen");
+	bool sparse = (mode == "sparse");
+	bool quantized = (mode == "quantized");
+	bool batched = (mode == "batched");
+	bool fixed = (mode == "fixed");
+	bool outOfCore = (mode == "outofcore");
+	bool transposed = (mode == "transposed");
+	string resultsFile = (strassen || sparse || quantized || batched || fixed || outOfCore || transposed) ? "results_openmp_" + mode + ".txt" : "results_openmp.txt";
+
+	// PopulateMatrix only produces 0 to 9, so the quantized mode is told the range rather than scanning for it
+	ValueRange populateRange = { 0, 9 };
+	const char *precisionNames[] = { "int32", "int16", "int8" };
+
 	// Delete any existing results file
-	remove("results_openmp.txt");
+	remove(resultsFile.c_str());
+
+	if (batched)
+	{
+		RunBatched(resultsFile);
+		return 0;
+	}
+	if (outOfCore)
+	{
+		int size = (argc > 2) ? atoi(argv[2]) : OUT_OF_CORE_SIZE;
+		size_t budgetMB = (argc > 3) ? (size_t)atol(argv[3]) : OUT_OF_CORE_BUDGET_MB;
+		RunOutOfCore(resultsFile, size, budgetMB);
+		return 0;
+	}
 
-	// Define sizes of matrices
-	int n_sizes[] = { 10, 100, 1000 };
+	// Define sizes of matrices (Strassen-Winograd only pays off on large matrices, so its mode also runs 2048, as do the sparse and
+	// quantized modes)
+	int n_sizes[] = { 10, 100, 1000, 2048 };
+	int numSizes = (strassen || sparse || quantized) ? 4 : 3;
 
 	// Different varying thread counts
 	int n_threads[] = { 2, 8, 16, 24 };
 
-	for (int size : n_sizes)
+	// Pick the size at which the recursion hands over to the blocked kernel on this machine
+	if (strassen)
 	{
+		strassenCutoff = TuneStrassenCutoff();
+		cout << "Strassen-Winograd cutoff: " << strassenCutoff << endl;
+	}
+
+	for (int s = 0; s < numSizes; s++)
+	{
+		int size = n_sizes[s];
+
 		for (int threads : n_threads)
 		{
 			// Define matrix size
@@ -130,14 +364,36 @@ int main()
 			auto startPopulate = high_resolution_clock::now();
 
 			// Populate first two with random variables
-			PopulateMatrix(m1, matrixSize);
-			PopulateMatrix(m2, matrixSize);
+			if (sparse)
+			{
+				PopulateSparseMatrix(m1, matrixSize);
+				PopulateSparseMatrix(m2, matrixSize);
+			}
+			else
+			{
+				PopulateMatrix(m1, matrixSize);
+				PopulateMatrix(m2, matrixSize);
+			}
 			
 			// Take current time before multiplication
 			auto startMultiply = high_resolution_clock::now();
 
 			// Multiply first two to produce third matrix
-			MultiplyMatrices(m1, m2, m3, matrixSize);
+			bool sparsePath = false;
+			QuantizedPrecision precision = PRECISION_INT32;
+			bool fixedKernel = false;
+			if (strassen)
+				StrassenMultiply(m1, m2, m3, matrixSize);
+			else if (sparse)
+				sparsePath = MultiplyAuto(m1, m2, m3, matrixSize, MultiplyMatrices);
+			else if (quantized)
+				precision = MultiplyQuantized(m1, m2, m3, matrixSize, MultiplyMatrices, &populateRange, &populateRange);
+			else if (fixed)
+				fixedKernel = MultiplyDispatch(m1, m2, m3, matrixSize, MultiplyMatrices);
+			else if (transposed)
+				MultiplyTransposed(m1, m2, m3, matrixSize);
+			else
+				MultiplyMatrices(m1, m2, m3, matrixSize);
 
 			// Take current time before multiplication
 			auto stop = high_resolution_clock::now();
@@ -146,16 +402,36 @@ int main()
 			auto durationPopulate = duration_cast<microseconds>(startMultiply - startPopulate);
 			auto durationMultiply = duration_cast<microseconds>(stop - startMultiply);
 
+			// Check the other multiplies against MultiplyMatrices once per size (outside the timing, on the first thread count)
+			bool check = (strassen || sparse || quantized || fixed || transposed) && (threads == n_threads[0]);
+			long long mismatches = check ? CountMismatches(m1, m2, m3, matrixSize) : 0;
+
 			// Print equation (switched to false - only needed for verify) and time taken
 			if (matrixSize <= 10)
 				PrintEquation(m1, m2, m3, matrixSize, false);
 			cout << "MATRIX SIZE: " << size << ", THREADS: " << numThreads << endl;
+			if (sparse)
+				cout << "Multiplied as: " << (sparsePath ? "sparse" : "dense") << endl;
+			if (quantized)
+				cout << "Precision: " << precisionNames[precision] << endl;
+			if (fixed)
+				cout << "Kernel: " << (fixedKernel ? "fixed size" : "generic") << endl;
+			if (check)
+				cout << "Mismatches against MultiplyMatrices: " << mismatches << " of " << (long long)matrixSize * matrixSize << endl;
 			cout << "Time taken to populate square matrices: " << durationPopulate.count() << " microseconds" << endl;
 			cout << "Time taken to multiply square matrices: " << durationMultiply.count() << " microseconds\n" << endl;
 
 			// Redirect stdout to file and call above again
-			freopen("results_openmp.txt", "a", stdout);
+			freopen(resultsFile.c_str(), "a", stdout);
 			cout << "MATRIX SIZE: " << size << ", THREADS: " << numThreads << endl;
+			if (sparse)
+				cout << "Multiplied as: " << (sparsePath ? "sparse" : "dense") << endl;
+			if (quantized)
+				cout << "Precision: " << precisionNames[precision] << endl;
+			if (fixed)
+				cout << "Kernel: " << (fixedKernel ? "fixed size" : "generic") << endl;
+			if (check)
+				cout << "Mismatches against MultiplyMatrices: " << mismatches << " of " << (long long)matrixSize * matrixSize << endl;
 			cout << "Time taken to populate square matrices: " << durationPopulate.count() << " microseconds" << endl;
 			cout << "Time taken to multiply square matrices: " << durationMultiply.count() << " microseconds\n" << endl;
 
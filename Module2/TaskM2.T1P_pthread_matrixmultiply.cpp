@@ -5,6 +5,9 @@
 #include <chrono>
 #include <stdio.h>
 #include <pthread.h>
+#include <string>
+#include <vector>
+#include "TaskGraph.h"
 
 using namespace std::chrono;
 using namespace std;
@@ -30,6 +33,26 @@ struct MulTask
 	int end;
 };
 
+// Define the rows (and columns) of each tile the task graph mode generates and multiplies at a time
+#define GRAPH_TILE 64
+
+// Define struct to hold the tile each task of the task graph mode works on (populating rows of m1 or columns of m2, multiplying a block
+// of m3, or reading out rows of m3)
+struct TileTask
+{
+	int **m1;
+	int **m2;
+	int **m3;
+	int size;
+	int rowStart;
+	int rowEnd;
+	int colStart;
+	int colEnd;
+	unsigned int seed;
+	// Sum of the rows read out by an output task
+	long long checksum;
+};
+
 void PrintRow(int* array, int size)
 {
 	cout << "|  ";
@@ -152,10 +175,153 @@ void p_MultiplyMatrices(int** matrix1, int** matrix2, int** matrix3, int totalSi
 	}
 }
 
-int main()
+// This function populates rows rowStart to rowEnd - 1 of m1 with random integers less than 10 (rand_r keeps each task's sequence separate)
+void *PopulateRowTile(void *args)
+{
+	TileTask *task = (TileTask *)args;
+	for (int i = task -> rowStart; i < task -> rowEnd; i++)
+	{
+		for (int j = 0; j < task -> size; j++)
+		{
+			task -> m1[i][j] = rand_r(&task -> seed) % 10;
+		}
+	}
+	return NULL;
+}
+
+// This function populates columns colStart to colEnd - 1 of m2 with random integers less than 10 (a block of m3 reads whole columns of m2,
+// so m2 is generated by columns)
+void *PopulateColumnTile(void *args)
+{
+	TileTask *task = (TileTask *)args;
+	for (int i = 0; i < task -> size; i++)
+	{
+		for (int j = task -> colStart; j < task -> colEnd; j++)
+		{
+			task -> m2[i][j] = rand_r(&task -> seed) % 10;
+		}
+	}
+	return NULL;
+}
+
+// This function computes one block of m3 from the rows of m1 and the columns of m2 it covers
+void *MultiplyTile(void *args)
+{
+	TileTask *task = (TileTask *)args;
+	for (int i = task -> rowStart; i < task -> rowEnd; i++)
+	{
+		for (int j = task -> colStart; j < task -> colEnd; j++)
+		{
+			int sum = 0;
+			for (int k = 0; k < task -> size; k++)
+			{
+				sum += task -> m1[i][k] * task -> m2[k][j];
+			}
+			task -> m3[i][j] = sum;
+		}
+	}
+	return NULL;
+}
+
+// This function reads out finished rows of m3 (summing them stands in for writing them out)
+void *OutputRowTile(void *args)
+{
+	TileTask *task = (TileTask *)args;
+	task -> checksum = 0;
+	for (int i = task -> rowStart; i < task -> rowEnd; i++)
+	{
+		for (int j = 0; j < task -> size; j++)
+		{
+			task -> checksum += task -> m3[i][j];
+		}
+	}
+	return NULL;
+}
+
+// This function populates m1 and m2, multiplies them and reads out m3 as one task graph: each block of m3 waits only for the rows of m1 and
+// columns of m2 it reads, and each band of rows of m3 is read out as soon as its blocks are done, so all three stages overlap. It returns
+// the sum of m3
+long long p_TaskGraphMultiply(int** matrix1, int** matrix2, int** matrix3, int totalSize, int seed, int threads)
+{
+	int tiles = (totalSize + GRAPH_TILE - 1) / GRAPH_TILE;
+
+	// One argument struct per task (sized up front so the pointers handed to the graph stay valid)
+	vector<TileTask> rowTasks(tiles), columnTasks(tiles), outputTasks(tiles), multiplyTasks(tiles * tiles);
+	vector<int> rowIds(tiles), columnIds(tiles), outputIds(tiles);
+	TaskGraph graph;
+
+	for (int t = 0; t < tiles; t++)
+	{
+		TileTask tile = { matrix1, matrix2, matrix3, totalSize, t * GRAPH_TILE, min((t + 1) * GRAPH_TILE, totalSize),
+						  t * GRAPH_TILE, min((t + 1) * GRAPH_TILE, totalSize), 0, 0 };
+		rowTasks[t] = tile;
+		rowTasks[t].seed = (unsigned int)(time(NULL) * (seed + (2 * t) + 1));
+		columnTasks[t] = tile;
+		columnTasks[t].seed = (unsigned int)(time(NULL) * (seed + (2 * t) + 2));
+		outputTasks[t] = tile;
+
+		// The populate tasks are added first (tile by tile), so they are also the first taken from the ready queue
+		rowIds[t] = graph.AddTask(PopulateRowTile, &rowTasks[t]);
+		columnIds[t] = graph.AddTask(PopulateColumnTile, &columnTasks[t]);
+	}
+	for (int t = 0; t < tiles; t++)
+		outputIds[t] = graph.AddTask(OutputRowTile, &outputTasks[t]);
+
+	for (int ti = 0; ti < tiles; ti++)
+	{
+		for (int tj = 0; tj < tiles; tj++)
+		{
+			TileTask &tile = multiplyTasks[(ti * tiles) + tj];
+			tile = rowTasks[ti];
+			tile.colStart = columnTasks[tj].colStart;
+			tile.colEnd = columnTasks[tj].colEnd;
+
+			int id = graph.AddTask(MultiplyTile, &tile);
+			graph.AddDependency(rowIds[ti], id);
+			graph.AddDependency(columnIds[tj], id);
+			graph.AddDependency(id, outputIds[ti]);
+		}
+	}
+
+	graph.Run(threads);
+
+	long long checksum = 0;
+	for (int t = 0; t < tiles; t++)
+		checksum += outputTasks[t].checksum;
+	return checksum;
+}
+
+// This function returns how many entries of matrix3 differ from a plain multiply of matrix1 and matrix2 (run on the calling thread), so
+// the task graph mode can be checked against it
+long long CountMismatches(int** matrix1, int** matrix2, int** matrix3, int size)
 {
+	int** expected = (int**) malloc(size * sizeof(int*));
+	for (int i = 0; i < size; i++)
+		expected[i] = (int*) malloc(size * sizeof(int));
+	MulTask task = { matrix1, matrix2, expected, size, 0, size };
+	MultiplyMatrices((void *)&task);
+
+	long long mismatches = 0;
+	for (int i = 0; i < size; i++)
+	{
+		for (int j = 0; j < size; j++)
+			mismatches += (matrix3[i][j] != expected[i][j]);
+		free(expected[i]);
+	}
+	free(expected);
+	return mismatches;
+}
+
+int main(int argc, char** argv)
+{
+	// Read which mode to run in ("taskgraph" overlaps populating, multiplying and reading out the result as one task graph, anything else
+	// populates both matrices completely before multiplying), each with its own results file
+	string mode = (argc > 1) ? argv[1] : "stages";
+	bool taskGraph = (mode == "taskgraph");
+	string resultsFile = taskGraph ? "results_pthread_taskgraph.txt" : "results_pthread.txt";
+
 	// Delete any existing results file
-	remove("results_pthread.txt");
+	remove(resultsFile.c_str());
 
 	// Define sizes of matrices
 	int n_sizes[] = { 10, 100, 1000 };
@@ -194,6 +360,35 @@ int main()
 			// Create thread array for matrix multiplication
 			pthread_t threads_mulTask[numThreads];
 
+			// In the task graph mode the stages overlap, so only the total time of all of them is measured
+			if (taskGraph)
+			{
+				auto start = high_resolution_clock::now();
+				long long checksum = p_TaskGraphMultiply(m1, m2, m3, matrixSize, threads, numThreads);
+				auto duration = duration_cast<microseconds>(high_resolution_clock::now() - start);
+
+				// Check the product against a plain multiply of the same m1 and m2 once per size (outside the timing, on the first thread count)
+				bool check = (threads == n_threads[0]);
+				long long mismatches = check ? CountMismatches(m1, m2, m3, matrixSize) : 0;
+
+				if (matrixSize <= 10)
+					PrintEquation(m1, m2, m3, matrixSize, false);
+				cout << "MATRIX SIZE: " << size << ", THREADS: " << numThreads << endl;
+				cout << "Sum of result: " << checksum << endl;
+				if (check)
+					cout << "Mismatches against MultiplyMatrices: " << mismatches << " of " << (long long)matrixSize * matrixSize << endl;
+				cout << "Time taken to populate, multiply and read out square matrices: " << duration.count() << " microseconds\n" << endl;
+
+				freopen(resultsFile.c_str(), "a", stdout);
+				cout << "MATRIX SIZE: " << size << ", THREADS: " << numThreads << endl;
+				cout << "Sum of result: " << checksum << endl;
+				if (check)
+					cout << "Mismatches against MultiplyMatrices: " << mismatches << " of " << (long long)matrixSize * matrixSize << endl;
+				cout << "Time taken to populate, multiply and read out square matrices: " << duration.count() << " microseconds\n" << endl;
+				freopen("CON", "w", stdout);
+				continue;
+			}
+
 			// Take current time before populating
 			auto startPopulate = high_resolution_clock::now();
 
@@ -240,7 +435,7 @@ int main()
 			cout << "Time taken to multiply square matrices: " << durationMultiply.count() << " microseconds\n" << endl;
 
 			// Redirect stdout to file and call above again
-			freopen("results_pthread.txt", "a", stdout);
+			freopen(resultsFile.c_str(), "a", stdout);
 			cout << "MATRIX SIZE: " << size << ", THREADS: " << numThreads << endl;
 			cout << "Time taken to populate square matrices: " << durationPopulate.count() << " microseconds" << endl;
 			cout << "Time taken to multiply square matrices: " << durationMultiply.count() << " microseconds\n" << endl;
@@ -0,0 +1,111 @@
+#ifndef TRANSPOSE_H
+#define TRANSPOSE_H
+
+#include <stddef.h>
+#include <omp.h>
+#include "Strassen.h"
+
+// | ------------------------------------------------------ |
+// | Cache-Oblivious Transpose								|
+// | ------------------------------------------------------ |
+// Transposes by repeatedly halving the longer side of the block until it is small enough to copy directly. The source rows and destination
+// rows of a small block both fit in cache whatever the cache sizes are, so neither side is read down a column one cache line per element.
+// The halves write to separate parts of the destination, so the first few levels of halving run as OpenMP tasks.
+//
+// The matrices can be row pointers (int**) or one contiguous row-major array wrapped in a FlatMatrix, so the same routine converts the
+// layouts used by the Module 3 programs.
+
+// Blocks with at most this many rows and columns are copied directly (32 x 32 ints is 4 KB per side)
+#define TRANSPOSE_LEAF 32
+// Halvings below this depth run as tasks (2^depth tasks at most)
+#define TRANSPOSE_TASK_DEPTH 6
+
+// A contiguous row-major matrix indexed like row pointers (matrix[i][j])
+struct FlatMatrix
+{
+	int *data;
+	size_t stride;
+
+	int *operator[](int i) const { return data + ((size_t)i * stride); }
+};
+
+// This function sets dst[j][i] = src[i][j] for rows r0 to r1 - 1 and columns c0 to c1 - 1 of src
+template <typename Src, typename Dst>
+void TransposeRange(const Src &src, const Dst &dst, int r0, int r1, int c0, int c1, int depth)
+{
+	int rows = r1 - r0, cols = c1 - c0;
+	if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF)
+	{
+		for (int i = r0; i < r1; i++)
+		{
+			for (int j = c0; j < c1; j++)
+				dst[j][i] = src[i][j];
+		}
+		return;
+	}
+
+	bool task = depth < TRANSPOSE_TASK_DEPTH;
+	if (rows >= cols)
+	{
+		int mid = r0 + (rows / 2);
+		#pragma omp task if (task)
+		TransposeRange(src, dst, r0, mid, c0, c1, depth + 1);
+		TransposeRange(src, dst, mid, r1, c0, c1, depth + 1);
+	}
+	else
+	{
+		int mid = c0 + (cols / 2);
+		#pragma omp task if (task)
+		TransposeRange(src, dst, r0, r1, c0, mid, depth + 1);
+		TransposeRange(src, dst, r0, r1, mid, c1, depth + 1);
+	}
+	#pragma omp taskwait
+}
+
+// This function transposes a rows x cols matrix src into a cols x rows matrix dst, run by the current OpenMP threads
+template <typename Src, typename Dst>
+void TransposeMatrix(const Src &src, const Dst &dst, int rows, int cols)
+{
+	#pragma omp parallel
+	{
+		#pragma omp single
+		TransposeRange(src, dst, 0, rows, 0, cols, 0);
+	}
+}
+
+inline void Transpose(int **src, int **dst, int rows, int cols)
+{
+	TransposeMatrix(src, dst, rows, cols);
+}
+
+// Contiguous row-major version (src is rows x cols, dst is cols x rows)
+inline void Transpose(int *src, int *dst, int rows, int cols)
+{
+	TransposeMatrix(FlatMatrix{ src, (size_t)cols }, FlatMatrix{ dst, (size_t)rows }, rows, cols);
+}
+
+// This function sets C = A x B for n x n matrices after transposing B once, so every element of C is the dot product of a row of A and a
+// row of B's transpose and both are read along memory
+inline void MultiplyTransposed(int **A, int **B, int **C, int n)
+{
+	int **BT = AllocateBlock(n);
+	Transpose(B, BT, n, n);
+
+	#pragma omp parallel for collapse(2)
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			const int *rowA = A[i];
+			const int *rowBT = BT[j];
+			int sum = 0;
+			for (int k = 0; k < n; k++)
+				sum += rowA[k] * rowBT[k];
+			C[i][j] = sum;
+		}
+	}
+
+	FreeBlock(BT);
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef DATA_POINT_H
+#define DATA_POINT_H
+
+#include <mpi.h>
+#include <cstddef>
+
+// | ------------------------------------------------------ |
+// | K-Means Data Points									|
+// | ------------------------------------------------------ |
+// Shared structs used by both K-means programs, plus the MPI datatypes they are sent as. Unlike raw MPI_BYTE blobs the datatypes let MPI
+// convert between nodes with different representations. Whole data points are never sent, only the column subsets (coordinates only,
+// label only), which keep the full DataPoint extent so they can be scattered into or gathered from an array of DataPoints while skipping
+// the other fields.
+
+// Define struct to hold coordinates of each data point
+struct DataPoint
+{
+	int x;
+	int y;
+	float curDistance;
+	int clusterId;
+};
+
+// Define struct to hold coordinates of each centroid point
+struct CentroidPoint
+{
+	float x;
+	float y;
+	int clusterId;
+};
+
+// Declare the MPI datatypes for a whole centroid and for the parts of a data point that are moved
+inline MPI_Datatype CentroidPointType, CoordinatesType, LabelType;
+
+// This function builds and commits the MPI datatypes above
+inline void CreateDataPointTypes()
+{
+	MPI_Datatype tempType;
+
+	// Full CentroidPoint: x, y, clusterId
+	int centroidLengths[3] = { 1, 1, 1 };
+	MPI_Aint centroidOffsets[3] = { offsetof(CentroidPoint, x), offsetof(CentroidPoint, y), offsetof(CentroidPoint, clusterId) };
+	MPI_Datatype centroidTypes[3] = { MPI_FLOAT, MPI_FLOAT, MPI_INT };
+	MPI_Type_create_struct(3, centroidLengths, centroidOffsets, centroidTypes, &tempType);
+	MPI_Type_create_resized(tempType, 0, sizeof(CentroidPoint), &CentroidPointType);
+	MPI_Type_free(&tempType);
+	MPI_Type_commit(&CentroidPointType);
+
+	// Coordinates only (x and y), used to distribute the data points once
+	int coordLengths[2] = { 1, 1 };
+	MPI_Aint coordOffsets[2] = { offsetof(DataPoint, x), offsetof(DataPoint, y) };
+	MPI_Datatype coordTypes[2] = { MPI_INT, MPI_INT };
+	MPI_Type_create_struct(2, coordLengths, coordOffsets, coordTypes, &tempType);
+	MPI_Type_create_resized(tempType, 0, sizeof(DataPoint), &CoordinatesType);
+	MPI_Type_free(&tempType);
+	MPI_Type_commit(&CoordinatesType);
+
+	// Label only (clusterId), used to collect the assignments
+	int labelLength = 1;
+	MPI_Aint labelOffset = offsetof(DataPoint, clusterId);
+	MPI_Datatype labelType = MPI_INT;
+	MPI_Type_create_struct(1, &labelLength, &labelOffset, &labelType, &tempType);
+	MPI_Type_create_resized(tempType, 0, sizeof(DataPoint), &LabelType);
+	MPI_Type_free(&tempType);
+	MPI_Type_commit(&LabelType);
+}
+
+// This function releases the MPI datatypes created by CreateDataPointTypes
+inline void FreeDataPointTypes()
+{
+	MPI_Type_free(&CentroidPointType);
+	MPI_Type_free(&CoordinatesType);
+	MPI_Type_free(&LabelType);
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef ELEMENT_TYPE_H
+#define ELEMENT_TYPE_H
+
+#include <mpi.h>
+#include <stdint.h>
+
+// | ------------------------------------------------------ |
+// | Matrix Element Types									|
+// | ------------------------------------------------------ |
+// Shared helpers that let every matrix program work on 32 or 64-bit integers or on single or double precision floats. The kernels are
+// templates over the element type, ElementTraits gives what else depends on it (the MPI datatype to send it as and the type the OpenCL
+// kernel is built for), and Element is the type the programs are compiled for, picked with -DELEMENT_TYPE=<0 to 3> (int32 by default, so
+// the results match the original programs; int64 stops large products overflowing).
+
+#define ELEMENT_INT32 0
+#define ELEMENT_INT64 1
+#define ELEMENT_FLOAT 2
+#define ELEMENT_DOUBLE 3
+
+#ifndef ELEMENT_TYPE
+#define ELEMENT_TYPE ELEMENT_INT32
+#endif
+
+template <typename T>
+struct ElementTraits;
+
+template <>
+struct ElementTraits<int32_t>
+{
+	static MPI_Datatype MPIType() { return MPI_INT32_T; }
+	static const char *Name() { return "int32"; }
+	// Build options that set the element type T of the OpenCL kernels
+	static const char *OpenCLOptions() { return "-DT=int"; }
+};
+
+template <>
+struct ElementTraits<int64_t>
+{
+	static MPI_Datatype MPIType() { return MPI_INT64_T; }
+	static const char *Name() { return "int64"; }
+	static const char *OpenCLOptions() { return "-DT=long"; }
+};
+
+template <>
+struct ElementTraits<float>
+{
+	static MPI_Datatype MPIType() { return MPI_FLOAT; }
+	static const char *Name() { return "float"; }
+	static const char *OpenCLOptions() { return "-DT=float"; }
+};
+
+template <>
+struct ElementTraits<double>
+{
+	static MPI_Datatype MPIType() { return MPI_DOUBLE; }
+	static const char *Name() { return "double"; }
+	// Doubles need the device's cl_khr_fp64 extension, which the kernel enables when T_FP64 is set
+	static const char *OpenCLOptions() { return "-DT=double -DT_FP64"; }
+};
+
+#if ELEMENT_TYPE == ELEMENT_INT64
+typedef int64_t Element;
+#elif ELEMENT_TYPE == ELEMENT_FLOAT
+typedef float Element;
+#elif ELEMENT_TYPE == ELEMENT_DOUBLE
+typedef double Element;
+#else
+typedef int32_t Element;
+#endif
+
+// MPI datatype of the elements the program is compiled for
+#define MPI_ELEMENT (ElementTraits<Element>::MPIType())
+
+// This function sets row3 = row1 x matrix2 for one row of a product (row1 and row3 have size elements, matrix2 is size x size). The loops
+// run k-j, so the inner loop walks along a row of matrix2 and row3 and is vectorised for whichever element type it is built for
+template <typename T>
+inline void MultiplyRow(const T *row1, T **matrix2, T *row3, int size)
+{
+	for (int j = 0; j < size; j++)
+		row3[j] = 0;
+	for (int k = 0; k < size; k++)
+	{
+		const T a = row1[k];
+		const T *row2 = matrix2[k];
+		for (int j = 0; j < size; j++)
+			row3[j] += a * row2[j];
+	}
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef FREIVALDS_H
+#define FREIVALDS_H
+
+#include <mpi.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+// | ------------------------------------------------------ |
+// | Freivalds Verification									|
+// | ------------------------------------------------------ |
+// Shared helpers used by the MPI programs to check a product C = A x B without multiplying again. For a random vector r, A (B r) is
+// computed with two matrix-vector products (O(n^2) work instead of O(n^3)) and compared with C r. A correct C always matches, and a C
+// with any wrong entry matches for at most half of the possible r, so each extra round at least halves the chance of missing an error.
+//
+// The check is split the same way as the multiply: every node holds its rows of A and C plus all of B, so it checks its own rows and the
+// number of rows that failed is summed over the nodes. All nodes build the same r from a seed broadcast by the master. Integer products
+// are checked in unsigned arithmetic of the same width, which wraps around exactly as the multiply does, so a product that overflows is
+// still checked exactly. Floating-point products are checked in double, allowing for the rounding error the multiply can build up.
+
+// This function returns the next value of a 64-bit SplitMix sequence (so every node generates the same vector from the same seed)
+inline uint64_t SplitMix64(uint64_t &state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// Arithmetic the check is done in for integer elements
+template <typename T, bool Floating = std::is_floating_point<T>::value>
+struct FreivaldsArithmetic
+{
+	typedef typename std::make_unsigned<T>::type Value;
+
+	static Value Random(uint64_t &state) { return (Value)SplitMix64(state); }
+	static Value Magnitude(Value) { return 0; }
+	static bool Matches(Value product, Value expected, Value, int) { return product == expected; }
+};
+
+// Arithmetic the check is done in for floating-point elements (r is drawn from [0, 1), and a row matches when the two sides differ by no
+// more than the rounding error of size multiply-adds at T's precision, scaled by the magnitudes involved)
+template <typename T>
+struct FreivaldsArithmetic<T, true>
+{
+	typedef double Value;
+
+	static Value Random(uint64_t &state) { return (double)(SplitMix64(state) >> 11) / 9007199254740992.0; }
+	static Value Magnitude(Value value) { return fabs(value); }
+	static bool Matches(Value product, Value expected, Value scale, int size)
+	{
+		return fabs(product - expected) <= size * std::numeric_limits<T>::epsilon() * scale;
+	}
+};
+
+// This function checks rows x size matrix C against A x B for the rows held by this node (A is rows x size and B is size x size, both
+// row-major) over the given number of rounds, and returns how many of those rows failed any round
+template <typename T>
+int FreivaldsCheckRows(const T *A, const T *B, const T *C, int rows, int size, int rounds, uint64_t seed)
+{
+	typedef FreivaldsArithmetic<T> Arithmetic;
+	typedef typename Arithmetic::Value Value;
+	// Br and |B| r (the magnitudes only matter for floating point, and are always zero for integers)
+	std::vector<Value> r(size), Br(size), absBr(size);
+	std::vector<bool> failed(rows, false);
+
+	for (int round = 0; round < rounds; round++)
+	{
+		for (int j = 0; j < size; j++)
+			r[j] = Arithmetic::Random(seed);
+
+		// Br = B r (every node holds all of B)
+		for (int i = 0; i < size; i++)
+		{
+			Value sum = 0, absSum = 0;
+			for (int j = 0; j < size; j++)
+			{
+				Value b = (Value)B[((size_t)i * size) + j];
+				sum += b * r[j];
+				absSum += Arithmetic::Magnitude(b) * r[j];
+			}
+			Br[i] = sum;
+			absBr[i] = absSum;
+		}
+
+		// Compare A (B r) with C r one row at a time
+		for (int i = 0; i < rows; i++)
+		{
+			Value ABr = 0, Cr = 0, scale = 0;
+			for (int j = 0; j < size; j++)
+			{
+				Value a = (Value)A[((size_t)i * size) + j];
+				ABr += a * Br[j];
+				Cr += (Value)C[((size_t)i * size) + j] * r[j];
+				scale += Arithmetic::Magnitude(a) * absBr[j];
+			}
+			if (!Arithmetic::Matches(ABr, Cr, scale, size))
+				failed[i] = true;
+		}
+	}
+
+	int count = 0;
+	for (int i = 0; i < rows; i++)
+		count += failed[i];
+	return count;
+}
+
+// This function checks every node's rows of C (before they are gathered) and returns the total number of rows that failed, on every
+// node. It must be called by all nodes in the communicator
+template <typename T>
+int FreivaldsVerify(const T *A, const T *B, const T *C, int rows, int size, int rounds, int root, MPI_Comm comm)
+{
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+
+	unsigned long long seed = 0;
+	if (rank == root)
+		seed = ((unsigned long long)time(NULL) << 32) ^ (unsigned long long)clock();
+	MPI_Bcast(&seed, 1, MPI_UNSIGNED_LONG_LONG, root, comm);
+
+	int localFailed = FreivaldsCheckRows(A, B, C, rows, size, rounds, seed);
+	int totalFailed = 0;
+	MPI_Allreduce(&localFailed, &totalFailed, 1, MPI_INT, MPI_SUM, comm);
+	return totalFailed;
+}
+
+#endif
@@ -1,11 +1,14 @@
 #include <iostream>
 #include <cstdlib>
 #include <cmath>
+#include <cstddef>
 #include <time.h>
 #include <chrono>
 #include <stdlib.h>
 #include <mpi.h>
 #include <algorithm>
+#include "Partition.h"
+#include "DataPoint.h"
 #include <cmath>
 
 using namespace std::chrono;
@@ -14,22 +17,8 @@ using namespace std;
 // Set rank of master node to 0
 #define masterRank 0
 
-// Define struct to hold coordinates of each data point
-struct DataPoint
-{
-	int x;
-	int y;
-	float curDistance;
-	int clusterId;
-};
-
-// Define struct to hold coordinates of each centroid point
-struct CentroidPoint
-{
-	float x;
-	float y;
-	int clusterId;
-};
+// Toggle balancing the data points sent to each node by their measured throughput (1) or splitting them evenly (0)
+#define WEIGHTED_PARTITION 0
 
 // Initialises vectors with random values in preparation for clustering algorithm
 void InitialiseDataPoints(DataPoint *vectors, int size, int maxRange)
@@ -168,10 +157,16 @@ int main(int argc, char** argv)
 	MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
 	// Get the rank
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	// Build the MPI datatypes for the data point and centroid structs
+	CreateDataPointTypes();
 		
 	// Define range of sizes to test (i.e how many data points)
 	int n_sizes[] = { 1, 1, 10, 10, 100, 1000, 10000, 100000, 1000000 };
 
+	// Start with every node weighted equally (only used when WEIGHTED_PARTITION is on)
+	double weights[numtasks];
+	fill_n(weights, numtasks, 1.0);
+
 	for (int size : n_sizes)
 	{
 		// Define count of k-means centroids
@@ -179,14 +174,17 @@ int main(int argc, char** argv)
 		// Define max range of coordinates
 		int range = 1000;
 
-		// Calculate how many rows to send to each node
-		int scatter_vals = size / numtasks;
 		// Create an array to store how much data to send across to each node
 		int sendcounts[numtasks];
 		// Create an array to store the displacement values used for keeping track of data sent for each node
 		int displs[numtasks];
-		// Increment variable to store the most recent displacement value
-		int increment = 0;
+		// Determine the sendcounts and displacement values (in data points) for each task
+		CalculatePartition(sendcounts, displs, size, 1, numtasks, WEIGHTED_PARTITION ? weights : NULL);
+		// Get how many data points this node will process
+		int scatter_vals = sendcounts[rank];
+		// Variables to store how long this node spends assigning its data points and how many passes it made
+		double computeSeconds = 0;
+		int iterations = 0;
 
 		// Set random seed based on current time
 		srand(time(0));
@@ -211,46 +209,11 @@ int main(int argc, char** argv)
 			InitialiseDataPoints(vectors, size, range);
 			InitialiseCentroidPoints(centroids, k, range);
 
-			// Determine the sendcounts and displacement values for each task
-			for (int p_id = 0; p_id < numtasks; p_id++)
-			{
-				displs[p_id] = increment;
-				if (size % numtasks != 0 && p_id == masterRank)
-				{
-					// If the size is not divisible by the amount of nodes, the master node will manage the remaining row(s)
-					sendcounts[p_id] = (scatter_vals + (size % numtasks)) * sizeof(DataPoint);
-				}
-				else
-				{
-					sendcounts[p_id] = scatter_vals * sizeof(DataPoint);
-				}
-				increment += sendcounts[p_id];
-			}
-
-			// Since we are the master node, we will need to update the scatter rows to reflect additional work
-			scatter_vals += (size % numtasks);
-
 			// Allocate memory for the sub data point vector
 			vectors_sub = new DataPoint[scatter_vals];
 		}
 		else
 		{
-			// Determine the sendcounts and displacement values for each task
-			for (int p_id = 0; p_id < numtasks; p_id++)
-			{
-				displs[p_id] = increment;
-				if (size % numtasks != 0 && p_id == masterRank)
-				{
-					// If the size is not divisible by the amount of nodes, the master node will manage the remaining row(s)
-					sendcounts[p_id] = (scatter_vals + (size % numtasks)) * sizeof(DataPoint);
-				}
-				else
-				{
-					sendcounts[p_id] = scatter_vals * sizeof(DataPoint);
-				}
-				increment += sendcounts[p_id];
-			}
-
 			// Allocate memory for the sub data point vector
 			vectors_sub = new DataPoint[scatter_vals];
 
@@ -258,29 +221,32 @@ int main(int argc, char** argv)
 			centroids = new CentroidPoint[k];
 		}
 
+		// Distribute only the coordinates of the data points to worker nodes, once (they never change between iterations)
+		MPI_Scatterv(&vectors[0], sendcounts, displs, CoordinatesType, &vectors_sub[0], sendcounts[rank], CoordinatesType, masterRank, MPI_COMM_WORLD);
+
 		// Run clustering algorithm until convergence is reached
 		int convergence = false;
 
 		while (!convergence)
 		{
 			// Broadcast array of centroids to all nodes
-			MPI_Bcast(&centroids[0], k * sizeof(CentroidPoint), MPI_BYTE, masterRank, MPI_COMM_WORLD);
-
-			// Distribute data points vector to worker nodes
-			MPI_Scatterv(&vectors[0], sendcounts, displs, MPI_BYTE, &vectors_sub[0], sendcounts[rank], MPI_BYTE, masterRank, MPI_COMM_WORLD);
+			MPI_Bcast(&centroids[0], k, CentroidPointType, masterRank, MPI_COMM_WORLD);
 
 			// Assign data points to centroids
+			auto computeStart = high_resolution_clock::now();
 			AssignCentroids(vectors_sub, centroids, scatter_vals, k, range);
+			computeSeconds += duration_cast<duration<double>>(high_resolution_clock::now() - computeStart).count();
+			iterations++;
 		   
 			if (rank == masterRank)
 			{
-				// Send results of all sub vectors back to original vectors array
-				MPI_Gatherv(&vectors_sub[0], sendcounts[rank], MPI_BYTE, &vectors[0], sendcounts, displs, MPI_BYTE, masterRank, MPI_COMM_WORLD);
+				// Collect only the cluster labels of all sub vectors back into the original vectors array
+				MPI_Gatherv(&vectors_sub[0], sendcounts[rank], LabelType, &vectors[0], sendcounts, displs, LabelType, masterRank, MPI_COMM_WORLD);
 			}
 			else
 			{
-				// Send back results of sub vector to master
-				MPI_Gatherv(&vectors_sub[0], sendcounts[rank], MPI_BYTE, NULL, sendcounts, displs, MPI_BYTE, masterRank, MPI_COMM_WORLD);
+				// Send back only the cluster labels of the sub vector to master
+				MPI_Gatherv(&vectors_sub[0], sendcounts[rank], LabelType, NULL, sendcounts, displs, LabelType, masterRank, MPI_COMM_WORLD);
 			}
 
 			// Recalculate cluster centroids provided we haven't converged
@@ -299,12 +265,17 @@ int main(int argc, char** argv)
 		// Obtain the difference between start and stop times, then cast to microseconds format
 		auto duration = duration_cast<microseconds>(stop - start);
 
+		// Record this node's throughput (distance calculations per second) so the next size can be balanced on it
+		if (WEIGHTED_PARTITION)
+			UpdateWeights((double)scatter_vals * k * iterations, computeSeconds, weights, numtasks, MPI_COMM_WORLD);
+
 		if (rank == masterRank)
 		{
 			cout << "Size " << size << " execution time: "
 				<< duration.count() << " microseconds" << endl;
 		}
 	}
-	// Finalize the MPI environment
+	// Release the MPI datatypes and finalize the MPI environment
+	FreeDataPointTypes();
 	MPI_Finalize();
 }
\ No newline at end of file
@@ -15,66 +15,200 @@ struct CentroidPoint
 	int clusterId;
 };
 
-float CalculateDistance(struct DataPoint p1, struct CentroidPoint p2)
+// This function returns the squared distance between a data point and a centroid (the square root is only needed for the closest one)
+float SquaredDistance(const float2 p1, const float2 p2)
 {
-	float result = sqrt(pow(p2.x - p1.x, 2) + pow(p2.y - p1.y, 2));
-	return result;
+	float dx = p2.x - p1.x;
+	float dy = p2.y - p1.y;
+	return (dx * dx) + (dy * dy);
 }
 
-__kernel void k_means_assignment(const __global int* range, __global struct DataPoint* vectors, __global struct CentroidPoint* centroids)
+// Each work-item owns one data point and compares it against every centroid, so the label and distance are written once with no races.
+// The centroids are copied into local memory once per work-group (centroid ids match their index, so only x and y are kept).
+__kernel void k_means_assignment(const int size, __global struct DataPoint* vectors, const __global struct CentroidPoint* centroids)
 {
-	// Get index and j values from global array
+	__local float2 localCentroids[K];
+
 	const int i = get_global_id(0);
-	const int j = get_global_id(1); 
 
-    // Set current minimum distance to centroid to maxrange
-    vectors[i].curDistance = (float)*range + 1.0f;
+	// Copy the x, y pair of each centroid into local memory as a single float2 load
+	for (int c = get_local_id(0); c < K; c += get_local_size(0))
+		localCentroids[c] = vload2(0, (const __global float*)&centroids[c]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The global size is rounded up to a whole number of work-groups, so skip the padding work-items
+	if (i >= size)
+		return;
+
+	// Load the point's x, y pair as a single int2 and convert it once
+	const float2 point = convert_float2(vload2(0, (const __global int*)&vectors[i]));
+
+	// Find the closest centroid, keeping the first one found on ties
+	int bestId = 0;
+	float bestDistance = SquaredDistance(point, localCentroids[0]);
+	for (int c = 1; c < K; c++)
+	{
+		float newDistance = SquaredDistance(point, localCentroids[c]);
+		if (newDistance < bestDistance)
+		{
+			bestId = c;
+			bestDistance = newDistance;
+		}
+	}
+
+	vectors[i].clusterId = bestId;
+	vectors[i].curDistance = sqrt(bestDistance);
+}
+
+// The centroid update is split into two stages so every data point is read in parallel rather than by one work-item per centroid.
+// K (the number of centroids) and WG (the work-group size, a power of two) are passed in by the host as build options (-DK=.. -DWG=..).
+
+// This function sums the x, y and count held by each work-item in local memory with a tree reduction (the totals end up in index 0)
+void ReduceLocal(__local int* xLocal, __local int* yLocal, __local int* countLocal, const int lid)
+{
+    for (int stride = WG / 2; stride > 0; stride >>= 1)
+    {
+        if (lid < stride)
+        {
+            xLocal[lid] += xLocal[lid + stride];
+            yLocal[lid] += yLocal[lid + stride];
+            countLocal[lid] += countLocal[lid + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Stage 1: each work-item sums the x, y and count of a strided set of points per cluster in registers, then each work-group reduces these
+// in local memory and writes one (xSum, ySum, count) partial per cluster to partials[group][cluster]
+__kernel void k_means_partial_sums(const int size, const __global struct DataPoint* vectors, __global int* partials)
+{
+    __local int xLocal[WG];
+    __local int yLocal[WG];
+    __local int countLocal[WG];
+
+    const int lid = get_local_id(0);
+    const int group = get_group_id(0);
 
-    // Get distance between current vector and current centroid
-    float newDistance = CalculateDistance(vectors[i], centroids[j]);
+    int xSum[K];
+    int ySum[K];
+    int count[K];
+    for (int c = 0; c < K; c++)
+    {
+        xSum[c] = 0;
+        ySum[c] = 0;
+        count[c] = 0;
+    }
+
+    // Stride through the data points by the total number of work-items so neighbouring work-items read neighbouring points
+    for (int i = get_global_id(0); i < size; i += get_global_size(0))
+    {
+        const int c = vectors[i].clusterId;
+        if (c >= 0 && c < K)
+        {
+            xSum[c] += vectors[i].x;
+            ySum[c] += vectors[i].y;
+            count[c]++;
+        }
+    }
 
-    // If new distance is smaller than current distance, assign clusterId
-    if (newDistance < vectors[i].curDistance)
+    // Reduce each cluster across the work-group and store the result for stage 2
+    for (int c = 0; c < K; c++)
     {
-        vectors[i].clusterId = centroids[j].clusterId;
-        vectors[i].curDistance = newDistance;
+        xLocal[lid] = xSum[c];
+        yLocal[lid] = ySum[c];
+        countLocal[lid] = count[c];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        ReduceLocal(xLocal, yLocal, countLocal, lid);
+
+        if (lid == 0)
+        {
+            partials[((group * K) + c) * 3] = xLocal[0];
+            partials[((group * K) + c) * 3 + 1] = yLocal[0];
+            partials[((group * K) + c) * 3 + 2] = countLocal[0];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 }
 
-__kernel void k_means_centroid_update(const __global int* size, const __global struct DataPoint* vectors, __global struct CentroidPoint* centroids, __global int* centroidChanges)
+// This function sums the stage 1 partials of one cluster across a single work-group (the totals end up in index 0 of the local arrays)
+void CombinePartials(const int numGroups, const __global int* partials, const int c, __local int* xLocal, __local int* yLocal, __local int* countLocal, const int lid)
 {
-	// Get cluster id from global array
-	const int j = get_global_id(0);
- 
-	// Loop through all points in current cluster and sum their x and y
+    // Sum a strided set of the stage 1 partials for this cluster
     int xSum = 0;
-	int ySum = 0;
-	int count = 0;
+    int ySum = 0;
+    int count = 0;
+    for (int g = lid; g < numGroups; g += WG)
+    {
+        xSum += partials[((g * K) + c) * 3];
+        ySum += partials[((g * K) + c) * 3 + 1];
+        count += partials[((g * K) + c) * 3 + 2];
+    }
+    xLocal[lid] = xSum;
+    yLocal[lid] = ySum;
+    countLocal[lid] = count;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    ReduceLocal(xLocal, yLocal, countLocal, lid);
+}
+
+// Stage 2 (device resident mode only): a single work-group combines the partials into one (xSum, ySum, count) total per cluster, laid out
+// like a single group of partials. Only these totals are read back so they can be summed across nodes
+__kernel void k_means_combine_partials(const int numGroups, const __global int* partials, __global int* totals)
+{
+    __local int xLocal[WG];
+    __local int yLocal[WG];
+    __local int countLocal[WG];
+
+    const int lid = get_local_id(0);
 
-    for (int i = 0; i < size; i++)
+    for (int c = 0; c < K; c++)
     {
-        // If data point belongs to current cluster, add their positions to sum vars
-        if (vectors[i].clusterId == centroids[j].clusterId)
+        CombinePartials(numGroups, partials, c, xLocal, yLocal, countLocal, lid);
+
+        if (lid == 0)
         {
-            xSum += vectors[i].x;
-            ySum += vectors[i].y;
-            count++;
+            totals[c * 3] = xLocal[0];
+            totals[c * 3 + 1] = yLocal[0];
+            totals[c * 3 + 2] = countLocal[0];
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    // Only recalculate position if count > 0)
-    if (count > 0)
+}
+
+// Stage 2: a single work-group combines the partials of every stage 1 work-group, then recalculates each centroid and checks it for
+// convergence on the device
+__kernel void k_means_centroid_update(const int numGroups, const __global int* partials, __global struct CentroidPoint* centroids, __global int* centroidChanges)
+{
+    __local int xLocal[WG];
+    __local int yLocal[WG];
+    __local int countLocal[WG];
+
+    const int lid = get_local_id(0);
+
+    for (int c = 0; c < K; c++)
     {
-        // Get existing x and y values
-        float oldX = centroids[j].x;
-        float oldY = centroids[j].y;
+        CombinePartials(numGroups, partials, c, xLocal, yLocal, countLocal, lid);
 
-        // Calculate new x and y values based on mean sum
-        centroids[j].x = (float)xSum / count;
-        centroids[j].y = (float)ySum / count;
+        if (lid == 0)
+        {
+            // Only recalculate position if count > 0 (otherwise the centroid has not moved)
+            centroidChanges[c] = 0;
+            if (countLocal[0] > 0)
+            {
+                // Get existing x and y values
+                float oldX = centroids[c].x;
+                float oldY = centroids[c].y;
 
-        // Check if they changed by epsilon value and if so record that change
-        float e = 0.005f;
-        centroidChanges[j] = ((fabs(oldX - centroids[j].x) > e) || (fabs(oldY - centroids[j].y) > e));
+                // Calculate new x and y values based on mean sum
+                centroids[c].x = (float)xLocal[0] / countLocal[0];
+                centroids[c].y = (float)yLocal[0] / countLocal[0];
+
+                // Check if they changed by epsilon value and if so record that change
+                float e = 0.005f;
+                centroidChanges[c] = ((fabs(oldX - centroids[c].x) > e) || (fabs(oldY - centroids[c].y) > e));
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 }
- 
\ No newline at end of file
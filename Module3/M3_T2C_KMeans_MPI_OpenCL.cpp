@@ -2,11 +2,16 @@
 #include <cstdlib>
 #include <stdio.h>
 #include <cmath>
+#include <cstddef>
 #include <time.h>
 #include <chrono>
 #include <stdlib.h>
 #include <mpi.h>
 #include <algorithm>
+#include <string>
+#include "Partition.h"
+#include "DataPoint.h"
+#include "OpenCLRuntime.h"
 #include <cmath>
 #include <CL/cl.h>
 
@@ -16,45 +21,68 @@ using namespace std;
 // Set rank of master node to 0
 #define masterRank 0
 
-// Define struct to hold coordinates of each data point
-struct DataPoint
-{
-	int x;
-	int y;
-	float curDistance;
-	int clusterId;
-};
+// Toggle balancing the data points sent to each node by their measured throughput (1) or splitting them evenly (0) (useful when nodes mix GPU and CPU devices)
+#define WEIGHTED_PARTITION 1
 
-// Define struct to hold coordinates of each centroid point
-struct CentroidPoint
-{
-	float x;
-	float y;
-	int clusterId;
-};
+// Define the file the per-size timings (total and device write/kernel/read) are exported to
+#define PROFILE_CSV "results_kmeans_opencl.csv"
+
+// Toggle splitting each node's point assignment across every OpenCL device it has (1) or only using the default device (0), and how many
+// equal sub-devices to partition the device into when there is only one (0 or 1 to leave it whole)
+#define MULTI_DEVICE 1
+#define SUB_DEVICES 0
 
 // | ------------------------------------------------------ |
 // | Variable Declaration									|
 // | ------------------------------------------------------ |
 // Delcare memory buffers for data point vector and centroids
-cl_mem bufV1, bufV1_sub, bufC1, bufCC;
+cl_mem bufV1, bufV1_sub, bufC1, bufCC, bufPartials, bufTotals;
 // Declare variable to store the unique ID of the computational device (GPU, CPU) by a kernel in the program
 cl_device_id device_id;
 // Declare variable to store the environment configuration (devices, memory properties, queues etc.)
 cl_context context;
-// Declare variable to store the set of kernels used for the program
-cl_program program;
-// Declare variable to store the centroid assignment and centroid updates functions which will be executed on a device
-cl_kernel kernelAssign, kernelUpdate;
+// Declare variable to store the centroid assignment and the two stage centroid update (partial sums, then combine) functions which will be executed on a device
+cl_kernel kernelAssign, kernelPartial, kernelCombine, kernelUpdate;
 // Declare variable to store the queue of commands to be executed on a specific device
 cl_command_queue queue;
-// Declare variable to store event results
-cl_event event = NULL;
+// Declare the profile that times the device commands of each size
+QueueProfile profile;
+
+// Declare the state kept for each device the point assignment is split across (every device has its own runtime, since devices from
+// different platforms cannot share a context). The first device also runs the centroid update and the resident mode, through the
+// variables above
+struct AssignDevice
+{
+	OpenCLRuntime *runtime;
+	cl_command_queue queue;
+	cl_kernel kernel;
+	// Buffers for the device's share of the data points and for the centroids
+	cl_mem bufPoints, bufCentroids;
+	// The device's share of this node's points (first to first + count - 1), and its measured throughput used to size that share
+	int first;
+	int count;
+	double weight;
+	size_t global[1];
+	size_t local[1];
+	QueueProfile profile;
+};
+AssignDevice *devices;
+int numDevices;
 // Declare variable to keep track of any errors that occur during program execution
 int err;
+// Declare the runtime that owns the device, context, queue, program, kernels and buffers across every size (the first device's runtime)
+OpenCLRuntime *runtime;
 // Declare global var array for assign and update kernels
-size_t globalAssign[2];
-size_t globalUpdate[1];
+size_t globalAssign[1];
+size_t globalPartial[1], globalUpdate[1];
+// Declare local work-group size shared by all kernels
+size_t localSize[1];
+// Work-group size used by the kernels, and how many work-groups produce partial sums for the current size
+int workGroupSize;
+int numGroups;
+
+// Cap on the work-groups used for the partial sums, so the single work-group combining them only loops a few times
+#define MAX_PARTIAL_GROUPS 64
 
 // Declare pointer for data point and centroids vector
 DataPoint *vectors;
@@ -74,17 +102,26 @@ bool convergence = false;
 // | Function Declaration									|
 // | ------------------------------------------------------ |
 // OpenCL functions are declared here but defined below, otherwise too messy
-cl_device_id create_device();
-cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename);
-void setup_openCL_device_context_queue_kernel(char *filename, char *kernelnameAssign, char *kernelnameUpdate);
+int choose_work_group_size(cl_device_id dev);
+void CreateDevices();
+void DeleteDevices();
+void setup_assign_devices(char *filename, char *kernelname, int k);
+void setup_openCL_device_context_queue_kernel(char *filename, char *kernelnameAssign, char *kernelnamePartial, char *kernelnameCombine, char *kernelnameUpdate, int k);
 void setup_assign_kernel_memory(int size, int k);
 void setup_update_kernel_memory(int size, int k);
-void copy_assign_kernel_args(int range);
+void setup_resident_kernel_memory(int size, int k);
+void copy_assign_kernel_args();
 void copy_update_kernel_args(int k);
-void CopyAssignKernelData(int size, int k, int range);
+void copy_resident_kernel_args(int size);
+void choose_partial_groups(int size);
+void CopyAssignKernelData(int size, int k);
 void CopyUpdateKernelData(int size, int k);
-void RunOpenCLAssign(int size);
+void CopyResidentKernelData(int size, int k);
+void RunOpenCLAssign();
 bool RunOpenCLUpdate(int k);
+void RunOpenCLResidentSums(int k, int *totals);
+bool RunOpenCLResidentUpdate(int k, int *totals);
+void ReadResidentResults(int size, int k);
 void SetupOpenCL(int size, int k);
 void PostExecutionCleanup();
 
@@ -139,6 +176,10 @@ void Print(CentroidPoint* centroids, int size)
 // | ------------------------------------------------------ |
 // | Main													|
 // | ------------------------------------------------------ |
+// Usage: M3_T2C_KMeans_MPI_OpenCL [mode]
+//   (default) - every iteration gathers the labels to the master, which uploads all points again to recalculate the centroids
+//   resident  - every node uploads its points once and keeps them on its device; each iteration only reads the per-cluster sums back
+//               (summed across nodes with MPI_Allreduce), and every node recalculates the centroids and uploads them to its own device
 int main(int argc, char** argv)
 {
 	// Initalise MPI variables 
@@ -149,10 +190,25 @@ int main(int argc, char** argv)
 	MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
 	// Get the rank
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	// Build the MPI datatypes for the data point and centroid structs
+	CreateDataPointTypes();
+	// Set up OpenCL (a runtime for every device) once for every size
+	CreateDevices();
+
+	// Delete any existing results file
+	if (rank == masterRank)
+		remove(PROFILE_CSV);
+
+	// Read which mode to run in
+	bool resident = (argc > 1) && (string(argv[1]) == "resident");
 		
 	// Define range of sizes to test (i.e how many data points)
 	int n_sizes[] = { 1, 1, 10, 10, 100, 1000, 10000, 100000, 1000000 };
 
+	// Start with every node weighted equally (only used when WEIGHTED_PARTITION is on)
+	double weights[numtasks];
+	fill_n(weights, numtasks, 1.0);
+
 	for (int size : n_sizes)
 	{
 		// Define count of k-means centroids
@@ -160,14 +216,21 @@ int main(int argc, char** argv)
 		// Define max range of coordinates
 		int range = 1000;
 
-		// Calculate how many rows to send to each node
-		int scatter_vals = size / numtasks;
 		// Create an array to store how much data to send across to each node
 		int sendcounts[numtasks];
 		// Create an array to store the displacement values used for keeping track of data sent for each node
 		int displs[numtasks];
-		// Increment variable to store the most recent displacement value
-		int increment = 0;
+		// Determine the sendcounts and displacement values (in data points) for each task
+		CalculatePartition(sendcounts, displs, size, 1, numtasks, WEIGHTED_PARTITION ? weights : NULL);
+		// Get how many data points this node will process
+		int scatter_vals = sendcounts[rank];
+		// Variables to store how long this node spends assigning its data points and how many passes it made
+		double computeSeconds = 0;
+		int iterations = 0;
+		// Start timing this size's device commands from zero
+		profile.Reset();
+		for (int d = 0; d < numDevices; d++)
+			devices[d].profile.Reset();
 
 		// Set random seed based on current time
 		srand(time(0));
@@ -189,86 +252,99 @@ int main(int argc, char** argv)
 			InitialiseDataPoints(vectors, size, range);
 			InitialiseCentroidPoints(centroids, k, range);
 
-			// Determine the sendcounts and displacement values for each task
-			for (int p_id = 0; p_id < numtasks; p_id++)
-			{
-				displs[p_id] = increment;
-				if (size % numtasks != 0 && p_id == masterRank)
-				{
-					// If the size is not divisible by the amount of nodes, the master node will manage the remaining row(s)
-					sendcounts[p_id] = (scatter_vals + (size % numtasks)) * sizeof(DataPoint);
-				}
-				else
-				{
-					sendcounts[p_id] = scatter_vals * sizeof(DataPoint);
-				}
-				increment += sendcounts[p_id];
-			}
-
-			// Since we are the master node, we will need to update the scatter rows to reflect additional work
-			scatter_vals += (size % numtasks);
-
 			// Allocate memory for the sub data point vector
 			vectors_sub = new DataPoint[scatter_vals];
 		}
 		else
 		{
-			// Determine the sendcounts and displacement values for each task
-			for (int p_id = 0; p_id < numtasks; p_id++)
-			{
-				displs[p_id] = increment;
-				if (size % numtasks != 0 && p_id == masterRank)
-				{
-					// If the size is not divisible by the amount of nodes, the master node will manage the remaining row(s)
-					sendcounts[p_id] = (scatter_vals + (size % numtasks)) * sizeof(DataPoint);
-				}
-				else
-				{
-					sendcounts[p_id] = scatter_vals * sizeof(DataPoint);
-				}
-				increment += sendcounts[p_id];
-			}
-
 			// Allocate memory for the sub data point vector
 			vectors_sub = new DataPoint[scatter_vals];
 
 			// Allocate memory for centroids to be broadcasted into
 			centroids = new CentroidPoint[k];
+
+			// Every node checks convergence itself in resident mode
+			if (resident)
+				centroidChanges = new int[k];
 		}
 
         // Setup the OpenCL program, devices, queues etc
         SetupOpenCL(scatter_vals, k);
 
-        while (!convergence)
+        // Distribute only the coordinates of the data points to worker nodes, once (they never change between iterations)
+        MPI_Scatterv(&vectors[0], sendcounts, displs, CoordinatesType, &vectors_sub[0], sendcounts[rank], CoordinatesType, masterRank, MPI_COMM_WORLD);
+
+        if (resident)
         {
-            // Broadcast array of centroids to all nodes
-			MPI_Bcast(&centroids[0], k * sizeof(CentroidPoint), MPI_BYTE, masterRank, MPI_COMM_WORLD);
-            MPI_Scatterv(&vectors[0], sendcounts, displs, MPI_BYTE, &vectors_sub[0], sendcounts[rank], MPI_BYTE, masterRank, MPI_COMM_WORLD);
+            // Every node starts from the master's centroids, then uploads its points and the centroids once
+            MPI_Bcast(&centroids[0], k, CentroidPointType, masterRank, MPI_COMM_WORLD);
+            CopyResidentKernelData(scatter_vals, k);
 
-            // Copy across updated data to buffers
-            CopyAssignKernelData(scatter_vals, k, range);
+            // Per-cluster (xSum, ySum, count) totals, the only data that leaves the device each iteration
+            int totals[k * 3];
 
-            // Run the kernel, wait for all to finish, then copy buffers to original memory locations
-            RunOpenCLAssign(scatter_vals);
+            while (!convergence)
+            {
+                // Assign this node's points and sum them per cluster on the device
+                auto computeStart = high_resolution_clock::now();
+                RunOpenCLResidentSums(k, totals);
+                computeSeconds += duration_cast<duration<double>>(high_resolution_clock::now() - computeStart).count();
+                iterations++;
+
+                // Sum the totals of every node so each node can recalculate the same centroids itself
+                MPI_Allreduce(MPI_IN_PLACE, totals, k * 3, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+                convergence = RunOpenCLResidentUpdate(k, totals);
+
+                // Only stop once every node agrees, so no node can leave the loop while the others wait in the next MPI_Allreduce
+                MPI_Allreduce(MPI_IN_PLACE, &convergence, 1, MPI_CXX_BOOL, MPI_LAND, MPI_COMM_WORLD);
+            }
 
-            // Gather all results back to master node for centroid calculation
+            // Collect the final labels and centroids once
+            ReadResidentResults(scatter_vals, k);
             if (rank == masterRank)
             {
-                MPI_Gatherv(&vectors_sub[0], sendcounts[rank], MPI_BYTE, &vectors[0], sendcounts, displs, MPI_BYTE, masterRank, MPI_COMM_WORLD);
+                MPI_Gatherv(&vectors_sub[0], sendcounts[rank], LabelType, &vectors[0], sendcounts, displs, LabelType, masterRank, MPI_COMM_WORLD);
             }
             else
             {
-                MPI_Gatherv(&vectors_sub[0], sendcounts[rank], MPI_BYTE, NULL, sendcounts, displs, MPI_BYTE, masterRank, MPI_COMM_WORLD);
+                MPI_Gatherv(&vectors_sub[0], sendcounts[rank], LabelType, NULL, sendcounts, displs, LabelType, masterRank, MPI_COMM_WORLD);
             }
-			// Recalculate cluster and check for convergence
-			if (rank == masterRank)
-			{
-                CopyUpdateKernelData(size, k);
-                convergence = RunOpenCLUpdate(k);
-			}
+        }
+        else
+        {
+            while (!convergence)
+            {
+                // Broadcast array of centroids to all nodes
+				MPI_Bcast(&centroids[0], k, CentroidPointType, masterRank, MPI_COMM_WORLD);
+
+                // Copy across updated data to buffers
+                CopyAssignKernelData(scatter_vals, k);
+
+                // Run the kernel, wait for all to finish, then copy buffers to original memory locations
+                auto computeStart = high_resolution_clock::now();
+                RunOpenCLAssign();
+                computeSeconds += duration_cast<duration<double>>(high_resolution_clock::now() - computeStart).count();
+                iterations++;
+
+                // Gather only the cluster labels back to master node for centroid calculation
+                if (rank == masterRank)
+                {
+                    MPI_Gatherv(&vectors_sub[0], sendcounts[rank], LabelType, &vectors[0], sendcounts, displs, LabelType, masterRank, MPI_COMM_WORLD);
+                }
+                else
+                {
+                    MPI_Gatherv(&vectors_sub[0], sendcounts[rank], LabelType, NULL, sendcounts, displs, LabelType, masterRank, MPI_COMM_WORLD);
+                }
+				// Recalculate cluster and check for convergence
+				if (rank == masterRank)
+				{
+                    CopyUpdateKernelData(size, k);
+                    convergence = RunOpenCLUpdate(k);
+				}
             
-			// Broadcast convergence result back to worker nodes (to stop their loops)
-			MPI_Bcast(&convergence, 1, MPI_CXX_BOOL, masterRank, MPI_COMM_WORLD);  
+				// Broadcast convergence result back to worker nodes (to stop their loops)
+				MPI_Bcast(&convergence, 1, MPI_CXX_BOOL, masterRank, MPI_COMM_WORLD);  
+            }
         }
 
         if (rank == masterRank)
@@ -277,6 +353,9 @@ int main(int argc, char** argv)
             //Print(centroids, k);
         }
 
+        // Time every device command of this size before its buffers go back to the pool
+        profile.Collect();
+
         // Release buffer and array memory
         PostExecutionCleanup();
 		
@@ -286,166 +365,192 @@ int main(int argc, char** argv)
 		// Obtain the difference between start and stop times, then cast to microseconds format
 		auto duration = duration_cast<microseconds>(stop - start);
 
+		// Record this node's throughput (distance calculations per second) so the next size can be balanced on it
+		if (WEIGHTED_PARTITION)
+			UpdateWeights((double)scatter_vals * k * iterations, computeSeconds, weights, numtasks, MPI_COMM_WORLD);
+
+		// Keep the slowest node's device times (the master also includes the centroid updates)
+		double nodeSeconds[PROFILE_STAGES];
+		for (int stage = 0; stage < PROFILE_STAGES; stage++)
+		{
+			nodeSeconds[stage] = profile.seconds[stage];
+			for (int d = 0; d < numDevices; d++)
+				nodeSeconds[stage] += devices[d].profile.seconds[stage];
+		}
+		double deviceSeconds[PROFILE_STAGES];
+		MPI_Reduce(nodeSeconds, deviceSeconds, PROFILE_STAGES, MPI_DOUBLE, MPI_MAX, masterRank, MPI_COMM_WORLD);
+
 		if (rank == masterRank)
 		{
 			cout << "Size " << size << " execution time: "
 				<< duration.count() << " microseconds" << endl;
+			PrintProfile(deviceSeconds);
+			AppendProfileCsv(PROFILE_CSV, size, (double)duration.count(), deviceSeconds);
 		}
 	}
-	// Finalize the MPI environment
+	// Release OpenCL and the MPI datatypes and finalize the MPI environment
+	DeleteDevices();
+	FreeDataPointTypes();
 	MPI_Finalize();
 }
 
 // | ------------------------------------------------------ |
 // | OpenCL Function Definition								|
 // | ------------------------------------------------------ |
-cl_device_id create_device()
+// This function returns the work-group size for the kernels on a device: the largest power of two up to 256 that the device allows
+int choose_work_group_size(cl_device_id dev)
 {
-	cl_platform_id platform;
-	cl_device_id dev;
-	int err;
+	size_t maxWorkGroupSize;
+	clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
 
-	/* Identify a platform */
-	err = clGetPlatformIDs(1, &platform, NULL);
-	if(err < 0) 
-	{
-		perror("Couldn't identify a platform");
-		exit(1);
-	} 
-	// Access a device
-	// GPU
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
-	if(err == CL_DEVICE_NOT_FOUND) 
-	{
-		// CPU
-		//printf("GPU not found\n");
-		err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
-	}
-	if(err < 0) 
-	{
-		perror("Couldn't access any devices");
-		exit(1);   
-	}
-	return dev;
+	int size = 256;
+	while (size > 1 && (size_t)size > maxWorkGroupSize)
+		size /= 2;
+	return size;
 }
 
-cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename)
+// This function creates a runtime for every device on this node (or just the default device when MULTI_DEVICE is off), all weighted
+// equally. The first device's runtime is also the one used for everything other than the assignment
+void CreateDevices()
 {
-
-	cl_program program;
-	FILE *program_handle;
-	char *program_buffer, *program_log;
-	size_t program_size, log_size;
-
-	/* Read program file and place content into buffer */
-	program_handle = fopen(filename, "r");
-	if (program_handle == NULL)
+	vector<cl_device_id> ids;
+	if (MULTI_DEVICE)
+		ids = AllDevices(SUB_DEVICES);
+	else
+		ids.push_back(DefaultDevice());
+
+	numDevices = (int)ids.size();
+	devices = new AssignDevice[numDevices];
+	for (int d = 0; d < numDevices; d++)
 	{
-		perror("Couldn't find the program file");
-		exit(1);
+		devices[d].runtime = new OpenCLRuntime(ids[d]);
+		devices[d].bufPoints = NULL;
+		devices[d].bufCentroids = NULL;
+		devices[d].weight = 1.0;
 	}
-	fseek(program_handle, 0, SEEK_END);
-	program_size = ftell(program_handle);
-	rewind(program_handle);
-	program_buffer = (char *)malloc(program_size + 1);
-	program_buffer[program_size] = '\0';
-	fread(program_buffer, sizeof(char), program_size, program_handle);
-	fclose(program_handle);
-
-	program = clCreateProgramWithSource(ctx, 1, (const char **)&program_buffer, &program_size, &err);
-	if (err < 0)
+	runtime = devices[0].runtime;
+}
+
+// This function releases every device's runtime
+void DeleteDevices()
+{
+	for (int d = 0; d < numDevices; d++)
 	{
-		perror("Couldn't create the program");
-		exit(1);
+		devices[d].profile.Collect();
+		delete devices[d].runtime;
 	}
-	free(program_buffer);
+	delete[] devices;
+	runtime = NULL;
+}
 
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-	if (err < 0)
+// This function builds the assignment kernel on every device (each with its own work-group size)
+void setup_assign_devices(char *filename, char *kernelname, int k)
+{
+	for (int d = 0; d < numDevices; d++)
 	{
-
-		/* Find size of log and print to std output */
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-		program_log = (char *)malloc(log_size + 1);
-		program_log[log_size] = '\0';
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, log_size + 1, program_log, NULL);
-		printf("%s\n", program_log);
-		free(program_log);
-		exit(1);
+		AssignDevice &dev = devices[d];
+		dev.queue = dev.runtime->Queue();
+		int groupSize = choose_work_group_size(dev.runtime->Device());
+		char options[64];
+		snprintf(options, sizeof(options), "-DK=%d -DWG=%d", k, groupSize);
+		dev.kernel = dev.runtime->Kernel(filename, options, kernelname);
+		dev.local[0] = (size_t)groupSize;
 	}
-	return program;
 }
 
-void setup_openCL_device_context_queue_kernel(char *filename, char *kernelnameAssign, char *kernelnameUpdate)
+void setup_openCL_device_context_queue_kernel(char *filename, char *kernelnameAssign, char *kernelnamePartial, char *kernelnameCombine, char *kernelnameUpdate, int k)
 {
-    device_id = create_device();
-    cl_int err;
-
-    //ToDo: Add comment (what is the purpose of clCreateBuffer function?)
-    context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &err);
-    if (err < 0)
-    {
-        perror("Couldn't create a context");
-        exit(1);
-    }
-
-    program = build_program(context, device_id, filename);
-
-    //ToDo: Add comment (what is the purpose of clCreateCommandQueueWithProperties function?)
-    queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
-    if (err < 0)
-    {
-        perror("Couldn't create a command queue");
-        exit(1);
-    };
-
-    kernelAssign = clCreateKernel(program, kernelnameAssign, &err);
-    if (err < 0)
-    {
-        perror("Couldn't create a kernel");
-        printf("error =%d", err);
-        exit(1);
-    };
-
-    kernelUpdate = clCreateKernel(program, kernelnameUpdate, &err);
-    if (err < 0)
-    {
-        perror("Couldn't create a kernel");
-        printf("error =%d", err);
-        exit(1);
-    };
+    // Reuse the device, context and queue owned by the runtime
+    device_id = runtime->Device();
+    context = runtime->Context();
+    queue = runtime->Queue();
+
+    // Pass the centroid count and work-group size to the kernels at build time (the runtime only builds the program for the first size)
+    workGroupSize = choose_work_group_size(device_id);
+    char options[64];
+    snprintf(options, sizeof(options), "-DK=%d -DWG=%d", k, workGroupSize);
+    kernelAssign = runtime->Kernel(filename, options, kernelnameAssign);
+    kernelPartial = runtime->Kernel(filename, options, kernelnamePartial);
+    kernelCombine = runtime->Kernel(filename, options, kernelnameCombine);
+    kernelUpdate = runtime->Kernel(filename, options, kernelnameUpdate);
+
+    // Space for one (xSum, ySum, count) partial per cluster per work-group, only ever used on the device
+    bufPartials = runtime->AcquireBuffer(CL_MEM_READ_WRITE, MAX_PARTIAL_GROUPS * k * 3 * sizeof(int));
+    bufTotals = runtime->AcquireBuffer(CL_MEM_READ_WRITE, k * 3 * sizeof(int));
 }
 
 void setup_assign_kernel_memory(int size, int k)
 {
-	// Create a space in memory for the buffer variables equal to the total size of the sub data point vector and centroid vector
-	bufV1_sub = clCreateBuffer(context, CL_MEM_READ_WRITE, size * sizeof(DataPoint), NULL, NULL);
-	bufC1 = clCreateBuffer(context, CL_MEM_READ_ONLY, k * sizeof(CentroidPoint), NULL, NULL);
-	
-	// Copy vectors to the devices
-	clEnqueueWriteBuffer(queue, bufV1_sub, CL_TRUE, 0, size * sizeof(DataPoint), &vectors_sub[0], 0, NULL, NULL);
-	clEnqueueWriteBuffer(queue, bufC1, CL_TRUE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, NULL);
+	// Split the points across the devices by their weights
+	int firsts[numDevices], counts[numDevices];
+	double weights[numDevices];
+	for (int d = 0; d < numDevices; d++)
+		weights[d] = devices[d].weight;
+	SplitWork(firsts, counts, size, numDevices, weights);
+
+	for (int d = 0; d < numDevices; d++)
+	{
+		AssignDevice &dev = devices[d];
+		dev.first = firsts[d];
+		dev.count = counts[d];
+
+		// Swap the buffers from the last iteration for ones at least the size of the device's share of the points and the centroid
+		// vector (the runtime's pool hands the same buffers straight back)
+		dev.runtime->ReleaseBuffer(dev.bufPoints);
+		dev.runtime->ReleaseBuffer(dev.bufCentroids);
+		dev.bufPoints = dev.runtime->AcquireBuffer(CL_MEM_READ_WRITE, max(dev.count, 1) * sizeof(DataPoint));
+		dev.bufCentroids = dev.runtime->AcquireBuffer(CL_MEM_READ_ONLY, k * sizeof(CentroidPoint));
+
+		// Copy the device's points and the centroids to it (without blocking, the in-order queue runs the kernel after them)
+		if (dev.count > 0)
+			clEnqueueWriteBuffer(dev.queue, dev.bufPoints, CL_FALSE, 0, dev.count * sizeof(DataPoint), &vectors_sub[dev.first], 0, NULL, dev.profile.Track());
+		clEnqueueWriteBuffer(dev.queue, dev.bufCentroids, CL_FALSE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, dev.profile.Track());
+	}
 }
 
 void setup_update_kernel_memory(int size, int k)
 {
-	// Create a space in memory for the buffer variables equal to the total size of the sub data point vector and centroid vector
-	bufV1 = clCreateBuffer(context, CL_MEM_READ_ONLY, size * sizeof(DataPoint), NULL, NULL);
-	bufC1 = clCreateBuffer(context, CL_MEM_READ_WRITE, k * sizeof(CentroidPoint), NULL, NULL);
-    bufCC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, k * sizeof(int), NULL, NULL);
+	// Swap the buffers from the last iteration for ones at least the total size of the data point vector and centroid vector
+	runtime->ReleaseBuffer(bufV1);
+	runtime->ReleaseBuffer(bufC1);
+	runtime->ReleaseBuffer(bufCC);
+	bufV1 = runtime->AcquireBuffer(CL_MEM_READ_ONLY, size * sizeof(DataPoint));
+	bufC1 = runtime->AcquireBuffer(CL_MEM_READ_WRITE, k * sizeof(CentroidPoint));
+	bufCC = runtime->AcquireBuffer(CL_MEM_WRITE_ONLY, k * sizeof(int));
 	
 	// Copy vectors to the devices
-	clEnqueueWriteBuffer(queue, bufV1, CL_TRUE, 0, size * sizeof(DataPoint), &vectors[0], 0, NULL, NULL);
-	clEnqueueWriteBuffer(queue, bufC1, CL_TRUE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, NULL);
-    clEnqueueWriteBuffer(queue, bufCC, CL_TRUE, 0, k * sizeof(int), &centroidChanges[0], 0, NULL, NULL);
+	clEnqueueWriteBuffer(queue, bufV1, CL_TRUE, 0, size * sizeof(DataPoint), &vectors[0], 0, NULL, profile.Track());
+	clEnqueueWriteBuffer(queue, bufC1, CL_TRUE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, profile.Track());
+    clEnqueueWriteBuffer(queue, bufCC, CL_TRUE, 0, k * sizeof(int), &centroidChanges[0], 0, NULL, profile.Track());
 }
 
-void copy_assign_kernel_args(int range)
+void setup_resident_kernel_memory(int size, int k)
 {
-    // Pass the addresses of the structures needs for the vector assignment kernel
-    clSetKernelArg(kernelAssign, 0, sizeof(int), (void *)&range);
-    clSetKernelArg(kernelAssign, 1, sizeof(cl_mem), (void *)&bufV1_sub);
-    clSetKernelArg(kernelAssign, 2, sizeof(cl_mem), (void *)&bufC1);
+	// Create the buffers once for the whole run (a node with no points still gets a one point buffer so the kernels have something to bind)
+	bufV1_sub = runtime->AcquireBuffer(CL_MEM_READ_WRITE, max(size, 1) * sizeof(DataPoint));
+	bufC1 = runtime->AcquireBuffer(CL_MEM_READ_WRITE, k * sizeof(CentroidPoint));
+	bufCC = runtime->AcquireBuffer(CL_MEM_WRITE_ONLY, k * sizeof(int));
+
+	// Copy this node's points and the starting centroids to the device, where they stay until the clustering converges
+	if (size > 0)
+		clEnqueueWriteBuffer(queue, bufV1_sub, CL_TRUE, 0, size * sizeof(DataPoint), &vectors_sub[0], 0, NULL, profile.Track());
+	clEnqueueWriteBuffer(queue, bufC1, CL_TRUE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, profile.Track());
+}
+
+void copy_assign_kernel_args()
+{
+    for (int d = 0; d < numDevices; d++)
+    {
+        // Pass the addresses of the structures needs for the vector assignment kernel (each device only sees its own share of the points)
+        AssignDevice &dev = devices[d];
+        clSetKernelArg(dev.kernel, 0, sizeof(int), (void *)&dev.count);
+        clSetKernelArg(dev.kernel, 1, sizeof(cl_mem), (void *)&dev.bufPoints);
+        err = clSetKernelArg(dev.kernel, 2, sizeof(cl_mem), (void *)&dev.bufCentroids);
+
+        // One work-item per data point, rounded up to a whole number of work-groups
+        size_t groups = max(((size_t)dev.count + dev.local[0] - 1) / dev.local[0], (size_t)1);
+        dev.global[0] = groups * dev.local[0];
+    }
 
     if (err < 0)
     {
@@ -457,9 +562,14 @@ void copy_assign_kernel_args(int range)
 
 void copy_update_kernel_args(int size)
 {
+    // Pass the addresses of the structures needs for the partial sums kernel
+    clSetKernelArg(kernelPartial, 0, sizeof(int), (void *)&size);
+    clSetKernelArg(kernelPartial, 1, sizeof(cl_mem), (void *)&bufV1);
+    clSetKernelArg(kernelPartial, 2, sizeof(cl_mem), (void *)&bufPartials);
+
     // Pass the addresses of the structures needs for the centroid update kernel
-    clSetKernelArg(kernelUpdate, 0, sizeof(int), (void *)&size);
-    clSetKernelArg(kernelUpdate, 1, sizeof(cl_mem), (void *)&bufV1);
+    clSetKernelArg(kernelUpdate, 0, sizeof(int), (void *)&numGroups);
+    clSetKernelArg(kernelUpdate, 1, sizeof(cl_mem), (void *)&bufPartials);
     clSetKernelArg(kernelUpdate, 2, sizeof(cl_mem), (void *)&bufC1);
     clSetKernelArg(kernelUpdate, 3, sizeof(cl_mem), (void *)&bufCC);
 
@@ -471,20 +581,46 @@ void copy_update_kernel_args(int size)
         
 }
 
-void PostExecutionCleanup()
+void copy_resident_kernel_args(int size)
 {
-	// Free the buffers
-    clReleaseMemObject(bufV1);
-    clReleaseMemObject(bufV1_sub);
-	clReleaseMemObject(bufC1);
-    clReleaseMemObject(bufCC);
+    // The assignment and partial sums kernels both work on this node's resident points
+    clSetKernelArg(kernelAssign, 0, sizeof(int), (void *)&size);
+    clSetKernelArg(kernelAssign, 1, sizeof(cl_mem), (void *)&bufV1_sub);
+    clSetKernelArg(kernelAssign, 2, sizeof(cl_mem), (void *)&bufC1);
 
-	// Free OpenCL objects
-	clReleaseKernel(kernelAssign);
-    clReleaseKernel(kernelUpdate);
-	clReleaseCommandQueue(queue);
-	clReleaseProgram(program);
-	clReleaseContext(context);
+    clSetKernelArg(kernelPartial, 0, sizeof(int), (void *)&size);
+    clSetKernelArg(kernelPartial, 1, sizeof(cl_mem), (void *)&bufV1_sub);
+    clSetKernelArg(kernelPartial, 2, sizeof(cl_mem), (void *)&bufPartials);
+
+    clSetKernelArg(kernelCombine, 0, sizeof(int), (void *)&numGroups);
+    clSetKernelArg(kernelCombine, 1, sizeof(cl_mem), (void *)&bufPartials);
+    err = clSetKernelArg(kernelCombine, 2, sizeof(cl_mem), (void *)&bufTotals);
+
+    if (err < 0)
+    {
+        perror("Couldn't create a kernel argument");
+        printf("error = %d", err);
+        exit(1);
+    }
+}
+
+void PostExecutionCleanup()
+{
+	// Hand the buffers back to the runtime's pool so the next size can reuse them (the device, context, queue and kernels are kept by the
+	// runtime until the end of the program)
+    cl_mem *buffers[] = { &bufV1, &bufV1_sub, &bufC1, &bufCC, &bufPartials, &bufTotals };
+    for (cl_mem *buffer : buffers)
+    {
+        runtime->ReleaseBuffer(*buffer);
+        *buffer = NULL;
+    }
+    for (int d = 0; d < numDevices; d++)
+    {
+        devices[d].runtime->ReleaseBuffer(devices[d].bufPoints);
+        devices[d].runtime->ReleaseBuffer(devices[d].bufCentroids);
+        devices[d].bufPoints = NULL;
+        devices[d].bufCentroids = NULL;
+    }
 
     // Delete array data
     delete[] vectors;
@@ -499,21 +635,31 @@ void PostExecutionCleanup()
 // This function sets up the OpenCL environment before enqueueing
 void SetupOpenCL(int size, int k)
 {
-	// Store work item counts in global assign array   
-    globalAssign[0] = (size_t)size;
-    globalAssign[1] = (size_t)k;
+	//Setup the OpenGL environment using the handler functions declared above
+    setup_openCL_device_context_queue_kernel((char *)"./M3_T2C_KMeans_MPI_OpenCL.cl", (char *)"k_means_assignment", (char *)"k_means_partial_sums", (char *)"k_means_combine_partials", (char *)"k_means_centroid_update", k);
+    setup_assign_devices((char *)"./M3_T2C_KMeans_MPI_OpenCL.cl", (char *)"k_means_assignment", k);
 
-    // Store work item counts for the global update array
-    globalUpdate[0] = (size_t)k;
+    // One work-item per data point for the assignment, rounded up to a whole number of work-groups
+    localSize[0] = (size_t)workGroupSize;
+    globalAssign[0] = (size_t)(max((size + workGroupSize - 1) / workGroupSize, 1) * workGroupSize);
 
-	//Setup the OpenGL environment using the handler functions declared above
-    setup_openCL_device_context_queue_kernel((char *)"./M3_T2C_KMeans_MPI_OpenCL.cl", (char *)"k_means_assignment", (char *)"k_means_centroid_update");
+    // The combine stage runs as a single work-group
+    globalUpdate[0] = (size_t)workGroupSize;
 }
 
-void CopyAssignKernelData(int size, int k, int range)
+// This function uses one work-group per workGroupSize points for the partial sums, up to MAX_PARTIAL_GROUPS (each work-item then strides
+// over the rest)
+void choose_partial_groups(int size)
+{
+    numGroups = min((size + workGroupSize - 1) / workGroupSize, MAX_PARTIAL_GROUPS);
+    numGroups = max(numGroups, 1);
+    globalPartial[0] = (size_t)(numGroups * workGroupSize);
+}
+
+void CopyAssignKernelData(int size, int k)
 {
     setup_assign_kernel_memory(size, k);
-    copy_assign_kernel_args(range);
+    copy_assign_kernel_args();
 }
 
 void CopyUpdateKernelData(int size, int k)
@@ -521,35 +667,65 @@ void CopyUpdateKernelData(int size, int k)
     // Fill changes array with false (0) every iteration
     fill_n(centroidChanges, k, 0);
 
+    choose_partial_groups(size);
     setup_update_kernel_memory(size, k);
     copy_update_kernel_args(size);
 }
 
-// This function manages the execution of the OpenCL framework with the cofnigured kernel
-void RunOpenCLAssign(int size)
+void CopyResidentKernelData(int size, int k)
 {
-	// Enqueues the kernel to start executing the commands detailed in the program's queue
-    clEnqueueNDRangeKernel(queue, kernelAssign, 2, NULL, globalAssign, NULL, 0, NULL, &event);
+    choose_partial_groups(size);
+    setup_resident_kernel_memory(size, k);
+    copy_resident_kernel_args(size);
+}
 
-	// Wait for all work-items to finish
-	clWaitForEvents(2, &event);
+// This function manages the execution of the OpenCL framework with the cofnigured kernel, assigning every device's share of the points at
+// once and then rebalancing the split by each device's measured throughput (points per second of device time) for the next iteration
+void RunOpenCLAssign()
+{
+    for (int d = 0; d < numDevices; d++)
+    {
+        AssignDevice &dev = devices[d];
+        if (dev.count == 0)
+            continue;
+
+        // Enqueues the kernel, then reads the device's points back to host memory once it has finished (neither blocks, so every device
+        // runs at the same time)
+        clEnqueueNDRangeKernel(dev.queue, dev.kernel, 1, NULL, dev.global, dev.local, 0, NULL, dev.profile.Track());
+        clEnqueueReadBuffer(dev.queue, dev.bufPoints, CL_FALSE, 0, dev.count * sizeof(DataPoint), &vectors_sub[dev.first], 0, NULL, dev.profile.Track());
+        clFlush(dev.queue);
+    }
 
-	//Reads memory from buffer objects back to host memory once the program has finished execution
-	clEnqueueReadBuffer(queue, bufV1_sub, CL_TRUE, 0, size * sizeof(DataPoint), &vectors_sub[0], 0, NULL, NULL);
+    // Wait for every device, then weight it by its throughput this iteration
+    double work[numDevices], seconds[numDevices], weights[numDevices];
+    for (int d = 0; d < numDevices; d++)
+    {
+        clFinish(devices[d].queue);
+        double before = devices[d].profile.Total();
+        devices[d].profile.Collect();
+        work[d] = devices[d].count;
+        seconds[d] = devices[d].profile.Total() - before;
+        weights[d] = devices[d].weight;
+    }
+    UpdateDeviceWeights(work, seconds, weights, numDevices);
+    for (int d = 0; d < numDevices; d++)
+        devices[d].weight = weights[d];
 }
 
 // This function manages the execution of the OpenCL framework with the cofnigured kernel
 bool RunOpenCLUpdate(int k)
 {
-	// Enqueues the kernel to start executing the commands detailed in the program's queue
-    clEnqueueNDRangeKernel(queue, kernelUpdate, 1, NULL, globalUpdate, NULL, 0, NULL, &event);
+	// Enqueues the partial sums then the combine kernel (the in-order queue runs them one after the other)
+    clEnqueueNDRangeKernel(queue, kernelPartial, 1, NULL, globalPartial, localSize, 0, NULL, profile.Track());
+    cl_event *updated = profile.Track();
+    clEnqueueNDRangeKernel(queue, kernelUpdate, 1, NULL, globalUpdate, localSize, 0, NULL, updated);
 
 	// Wait for all work-items to finish
-	clWaitForEvents(1, &event);
+	clWaitForEvents(1, updated);
 
 	//Reads memory from buffer objects back to host memory once the program has finished execution
-    clEnqueueReadBuffer(queue, bufC1, CL_TRUE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, NULL);
-	clEnqueueReadBuffer(queue, bufCC, CL_TRUE, 0, k * sizeof(int), &centroidChanges[0], 0, NULL, NULL);
+    clEnqueueReadBuffer(queue, bufC1, CL_TRUE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, profile.Track());
+	clEnqueueReadBuffer(queue, bufCC, CL_TRUE, 0, k * sizeof(int), &centroidChanges[0], 0, NULL, profile.Track());
 
     for (int i = 0; i < k; i++)
     {
@@ -562,6 +738,52 @@ bool RunOpenCLUpdate(int k)
     return true;
 }
 
+// This function assigns this node's resident points, sums them per cluster and reads back only the k (xSum, ySum, count) totals
+void RunOpenCLResidentSums(int k, int *totals)
+{
+	// The in-order queue runs the kernels one after the other, so only the final read needs to block
+    clEnqueueNDRangeKernel(queue, kernelAssign, 1, NULL, globalAssign, localSize, 0, NULL, profile.Track());
+    clEnqueueNDRangeKernel(queue, kernelPartial, 1, NULL, globalPartial, localSize, 0, NULL, profile.Track());
+    clEnqueueNDRangeKernel(queue, kernelCombine, 1, NULL, globalUpdate, localSize, 0, NULL, profile.Track());
+    clEnqueueReadBuffer(queue, bufTotals, CL_TRUE, 0, k * 3 * sizeof(int), &totals[0], 0, NULL, profile.Track());
+}
+
+// This function recalculates the centroids from the totals summed across every node, uploads them to the resident centroid buffer and
+// returns true if none changed. The division is done on the host rather than by the update kernel: OpenCL's single precision divide
+// isn't correctly rounded, so different devices could disagree on the centroids, while the host's is and every node gets the same result
+bool RunOpenCLResidentUpdate(int k, int *totals)
+{
+    bool unchanged = true;
+    for (int c = 0; c < k; c++)
+    {
+        // Only recalculate position if count > 0 (otherwise the centroid has not moved)
+        int count = totals[c * 3 + 2];
+        if (count > 0)
+        {
+            float oldX = centroids[c].x;
+            float oldY = centroids[c].y;
+            centroids[c].x = (float)totals[c * 3] / count;
+            centroids[c].y = (float)totals[c * 3 + 1] / count;
+
+            // Check if they changed by the same epsilon value the update kernel uses
+            float e = 0.005f;
+            if ((fabs(oldX - centroids[c].x) > e) || (fabs(oldY - centroids[c].y) > e))
+                unchanged = false;
+        }
+    }
+
+    clEnqueueWriteBuffer(queue, bufC1, CL_TRUE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, profile.Track());
+    return unchanged;
+}
+
+// This function reads the final labels and centroids off the device once the clustering has converged
+void ReadResidentResults(int size, int k)
+{
+    if (size > 0)
+        clEnqueueReadBuffer(queue, bufV1_sub, CL_TRUE, 0, size * sizeof(DataPoint), &vectors_sub[0], 0, NULL, profile.Track());
+    clEnqueueReadBuffer(queue, bufC1, CL_TRUE, 0, k * sizeof(CentroidPoint), &centroids[0], 0, NULL, profile.Track());
+}
+
 /* .cl file contents:
 
 // Define struct to hold coordinates of each data point
@@ -581,66 +803,201 @@ struct CentroidPoint
 	int clusterId;
 };
 
-float CalculateDistance(struct DataPoint p1, struct CentroidPoint p2)
+// This function returns the squared distance between a data point and a centroid (the square root is only needed for the closest one)
+float SquaredDistance(const float2 p1, const float2 p2)
 {
-	float result = sqrt(pow(p2.x - p1.x, 2) + pow(p2.y - p1.y, 2));
-	return result;
+	float dx = p2.x - p1.x;
+	float dy = p2.y - p1.y;
+	return (dx * dx) + (dy * dy);
 }
 
-__kernel void k_means_assignment(const __global int* range, __global struct DataPoint* vectors, __global struct CentroidPoint* centroids)
+// Each work-item owns one data point and compares it against every centroid, so the label and distance are written once with no races.
+// The centroids are copied into local memory once per work-group (centroid ids match their index, so only x and y are kept).
+__kernel void k_means_assignment(const int size, __global struct DataPoint* vectors, const __global struct CentroidPoint* centroids)
 {
-	// Get index and j values from global array
+	__local float2 localCentroids[K];
+
 	const int i = get_global_id(0);
-	const int j = get_global_id(1); 
 
-    // Set current minimum distance to centroid to maxrange
-    vectors[i].curDistance = (float)*range + 1.0f;
+	// Copy the x, y pair of each centroid into local memory as a single float2 load
+	for (int c = get_local_id(0); c < K; c += get_local_size(0))
+		localCentroids[c] = vload2(0, (const __global float*)&centroids[c]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The global size is rounded up to a whole number of work-groups, so skip the padding work-items
+	if (i >= size)
+		return;
+
+	// Load the point's x, y pair as a single int2 and convert it once
+	const float2 point = convert_float2(vload2(0, (const __global int*)&vectors[i]));
 
-    // Get distance between current vector and current centroid
-    float newDistance = CalculateDistance(vectors[i], centroids[j]);
+	// Find the closest centroid, keeping the first one found on ties
+	int bestId = 0;
+	float bestDistance = SquaredDistance(point, localCentroids[0]);
+	for (int c = 1; c < K; c++)
+	{
+		float newDistance = SquaredDistance(point, localCentroids[c]);
+		if (newDistance < bestDistance)
+		{
+			bestId = c;
+			bestDistance = newDistance;
+		}
+	}
+
+	vectors[i].clusterId = bestId;
+	vectors[i].curDistance = sqrt(bestDistance);
+}
 
-    // If new distance is smaller than current distance, assign clusterId
-    if (newDistance < vectors[i].curDistance)
+// The centroid update is split into two stages so every data point is read in parallel rather than by one work-item per centroid.
+// K (the number of centroids) and WG (the work-group size, a power of two) are passed in by the host as build options (-DK=.. -DWG=..).
+
+// This function sums the x, y and count held by each work-item in local memory with a tree reduction (the totals end up in index 0)
+void ReduceLocal(__local int* xLocal, __local int* yLocal, __local int* countLocal, const int lid)
+{
+    for (int stride = WG / 2; stride > 0; stride >>= 1)
     {
-        vectors[i].clusterId = centroids[j].clusterId;
-        vectors[i].curDistance = newDistance;
+        if (lid < stride)
+        {
+            xLocal[lid] += xLocal[lid + stride];
+            yLocal[lid] += yLocal[lid + stride];
+            countLocal[lid] += countLocal[lid + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 }
 
-__kernel void k_means_centroid_update(const __global int* size, const __global struct DataPoint* vectors, __global struct CentroidPoint* centroids, __global int* centroidChanges)
+// Stage 1: each work-item sums the x, y and count of a strided set of points per cluster in registers, then each work-group reduces these
+// in local memory and writes one (xSum, ySum, count) partial per cluster to partials[group][cluster]
+__kernel void k_means_partial_sums(const int size, const __global struct DataPoint* vectors, __global int* partials)
 {
-	// Get cluster id from global array
-	const int j = get_global_id(0);
- 
-	// Loop through all points in current cluster and sum their x and y
+    __local int xLocal[WG];
+    __local int yLocal[WG];
+    __local int countLocal[WG];
+
+    const int lid = get_local_id(0);
+    const int group = get_group_id(0);
+
+    int xSum[K];
+    int ySum[K];
+    int count[K];
+    for (int c = 0; c < K; c++)
+    {
+        xSum[c] = 0;
+        ySum[c] = 0;
+        count[c] = 0;
+    }
+
+    // Stride through the data points by the total number of work-items so neighbouring work-items read neighbouring points
+    for (int i = get_global_id(0); i < size; i += get_global_size(0))
+    {
+        const int c = vectors[i].clusterId;
+        if (c >= 0 && c < K)
+        {
+            xSum[c] += vectors[i].x;
+            ySum[c] += vectors[i].y;
+            count[c]++;
+        }
+    }
+
+    // Reduce each cluster across the work-group and store the result for stage 2
+    for (int c = 0; c < K; c++)
+    {
+        xLocal[lid] = xSum[c];
+        yLocal[lid] = ySum[c];
+        countLocal[lid] = count[c];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        ReduceLocal(xLocal, yLocal, countLocal, lid);
+
+        if (lid == 0)
+        {
+            partials[((group * K) + c) * 3] = xLocal[0];
+            partials[((group * K) + c) * 3 + 1] = yLocal[0];
+            partials[((group * K) + c) * 3 + 2] = countLocal[0];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// This function sums the stage 1 partials of one cluster across a single work-group (the totals end up in index 0 of the local arrays)
+void CombinePartials(const int numGroups, const __global int* partials, const int c, __local int* xLocal, __local int* yLocal, __local int* countLocal, const int lid)
+{
+    // Sum a strided set of the stage 1 partials for this cluster
     int xSum = 0;
-	int ySum = 0;
-	int count = 0;
+    int ySum = 0;
+    int count = 0;
+    for (int g = lid; g < numGroups; g += WG)
+    {
+        xSum += partials[((g * K) + c) * 3];
+        ySum += partials[((g * K) + c) * 3 + 1];
+        count += partials[((g * K) + c) * 3 + 2];
+    }
+    xLocal[lid] = xSum;
+    yLocal[lid] = ySum;
+    countLocal[lid] = count;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    ReduceLocal(xLocal, yLocal, countLocal, lid);
+}
+
+// Stage 2 (device resident mode only): a single work-group combines the partials into one (xSum, ySum, count) total per cluster, laid out
+// like a single group of partials. Only these totals are read back so they can be summed across nodes
+__kernel void k_means_combine_partials(const int numGroups, const __global int* partials, __global int* totals)
+{
+    __local int xLocal[WG];
+    __local int yLocal[WG];
+    __local int countLocal[WG];
+
+    const int lid = get_local_id(0);
 
-    for (int i = 0; i < size; i++)
+    for (int c = 0; c < K; c++)
     {
-        // If data point belongs to current cluster, add their positions to sum vars
-        if (vectors[i].clusterId == centroids[j].clusterId)
+        CombinePartials(numGroups, partials, c, xLocal, yLocal, countLocal, lid);
+
+        if (lid == 0)
         {
-            xSum += vectors[i].x;
-            ySum += vectors[i].y;
-            count++;
+            totals[c * 3] = xLocal[0];
+            totals[c * 3 + 1] = yLocal[0];
+            totals[c * 3 + 2] = countLocal[0];
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    // Only recalculate position if count > 0)
-    if (count > 0)
+}
+
+// Stage 2: a single work-group combines the partials of every stage 1 work-group, then recalculates each centroid and checks it for
+// convergence on the device
+__kernel void k_means_centroid_update(const int numGroups, const __global int* partials, __global struct CentroidPoint* centroids, __global int* centroidChanges)
+{
+    __local int xLocal[WG];
+    __local int yLocal[WG];
+    __local int countLocal[WG];
+
+    const int lid = get_local_id(0);
+
+    for (int c = 0; c < K; c++)
     {
-        // Get existing x and y values
-        float oldX = centroids[j].x;
-        float oldY = centroids[j].y;
+        CombinePartials(numGroups, partials, c, xLocal, yLocal, countLocal, lid);
 
-        // Calculate new x and y values based on mean sum
-        centroids[j].x = (float)xSum / count;
-        centroids[j].y = (float)ySum / count;
+        if (lid == 0)
+        {
+            // Only recalculate position if count > 0 (otherwise the centroid has not moved)
+            centroidChanges[c] = 0;
+            if (countLocal[0] > 0)
+            {
+                // Get existing x and y values
+                float oldX = centroids[c].x;
+                float oldY = centroids[c].y;
+
+                // Calculate new x and y values based on mean sum
+                centroids[c].x = (float)xLocal[0] / countLocal[0];
+                centroids[c].y = (float)yLocal[0] / countLocal[0];
 
-        // Check if they changed by epsilon value and if so record that change
-        float e = 0.005f;
-        centroidChanges[j] = ((fabs(oldX - centroids[j].x) > e) || (fabs(oldY - centroids[j].y) > e));
+                // Check if they changed by epsilon value and if so record that change
+                float e = 0.005f;
+                centroidChanges[c] = ((fabs(oldX - centroids[c].x) > e) || (fabs(oldY - centroids[c].y) > e));
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 }
 */
\ No newline at end of file
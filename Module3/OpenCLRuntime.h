@@ -0,0 +1,546 @@
+#ifndef OPENCL_RUNTIME_H
+#define OPENCL_RUNTIME_H
+
+#include <CL/cl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "ProgramCache.h"
+
+// | ------------------------------------------------------ |
+// | OpenCL Runtime											|
+// | ------------------------------------------------------ |
+// Shared object used by the OpenCL programs that run several problem sizes. It is created once (outside the n_sizes loop) and owns the
+// device, context and command queues, every program and kernel built so far (keyed by file, build options and kernel name), and a pool of
+// buffers. Buffers are handed out in power of two size classes, so releasing a buffer back to the pool and acquiring one of a similar size
+// (e.g. the same matrix strip for the next size, or the same centroids on the next iteration) reuses the allocation instead of creating a
+// new one. Everything is released when the runtime is deleted. A runtime drives a single device, so programs splitting work across several
+// devices create one for each. On devices that work directly on host memory (see ZeroCopy) callers can skip the copies altogether by
+// wrapping their own arrays.
+
+// Smallest size class handed out by the buffer pool, in bytes
+#define BUFFER_POOL_MIN_BYTES 256
+// Most bytes the pool keeps in unused buffers (anything released beyond this is freed straight away)
+#define BUFFER_POOL_LIMIT_BYTES (256 << 20)
+// Alignment (and size granularity) of host allocations that may be wrapped by zero-copy buffers (one page satisfies every vendor's rules)
+#define HOST_ALIGNMENT 4096
+
+// | ------------------------------------------------------ |
+// | Zero-Copy Host Memory									|
+// | ------------------------------------------------------ |
+// On a CPU device, or a GPU that shares memory with the host, a buffer created with CL_MEM_USE_HOST_PTR over suitably aligned host memory
+// is used by the kernel in place, so writing and reading buffers only copies the data from one part of RAM to another. These helpers are
+// free functions so programs that manage their own context can use them too.
+
+// This function returns true if the device works directly on host memory (a CPU device, or a device reporting unified host memory)
+inline bool IsZeroCopyDevice(cl_device_id dev)
+{
+	cl_device_type type = 0;
+	cl_bool unified = CL_FALSE;
+	clGetDeviceInfo(dev, CL_DEVICE_TYPE, sizeof(cl_device_type), &type, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified, NULL);
+	return (type & CL_DEVICE_TYPE_CPU) || unified == CL_TRUE;
+}
+
+// This function allocates host memory that can be wrapped by a zero-copy buffer, aligned to HOST_ALIGNMENT and padded to a whole number
+// of HOST_ALIGNMENT blocks (it is released with free)
+inline void *AllocateHostAligned(size_t size)
+{
+	size_t padded = ((size + HOST_ALIGNMENT - 1) / HOST_ALIGNMENT) * HOST_ALIGNMENT;
+	void *memory = NULL;
+	if (posix_memalign(&memory, HOST_ALIGNMENT, (padded > 0) ? padded : HOST_ALIGNMENT) != 0)
+	{
+		perror("Couldn't allocate host memory");
+		exit(1);
+	}
+	return memory;
+}
+
+// | ------------------------------------------------------ |
+// | Queue Profiling										|
+// | ------------------------------------------------------ |
+// Queues created with QUEUE_PROFILING record when each command started and finished on the device. A QueueProfile keeps the events of the
+// commands it is given and, once they have finished, adds their device time to a write, kernel or read total depending on the type of
+// command, which shows whether a run is limited by the device itself or by copying data to and from it.
+
+// Properties passed to clCreateCommandQueueWithProperties for every queue that is profiled
+static const cl_queue_properties QUEUE_PROFILING[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+
+// Indices of the totals kept by a QueueProfile
+enum ProfileStage { PROFILE_WRITE, PROFILE_KERNEL, PROFILE_READ, PROFILE_STAGES };
+
+class QueueProfile
+{
+public:
+	// Device seconds spent writing buffers, running kernels and reading (or mapping) buffers since the last Reset
+	double seconds[PROFILE_STAGES];
+
+	QueueProfile() { Reset(); }
+	~QueueProfile() { Collect(); }
+
+	// This function returns somewhere to store the event of a command about to be enqueued (pass it as the enqueue's last argument). It
+	// stays valid until the next Collect
+	cl_event *Track()
+	{
+		events.push_back(NULL);
+		return &events.back();
+	}
+
+	// This function keeps a reference to an event the caller also uses (so the caller can still release its own reference)
+	void Add(cl_event event)
+	{
+		clRetainEvent(event);
+		events.push_back(event);
+	}
+
+	// This function waits for every command handed over since the last Collect and adds its device time to the totals
+	void Collect()
+	{
+		for (cl_event event : events)
+		{
+			if (event == NULL)
+				continue;
+
+			cl_command_type type;
+			cl_ulong start, end;
+			clWaitForEvents(1, &event);
+			clGetEventInfo(event, CL_EVENT_COMMAND_TYPE, sizeof(cl_command_type), &type, NULL);
+			// Commands from a queue without profiling have no times, so they are skipped
+			bool timed = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) == CL_SUCCESS &&
+						 clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) == CL_SUCCESS;
+			clReleaseEvent(event);
+			if (!timed)
+				continue;
+
+			double elapsed = (double)(end - start) * 1e-9;
+			if (type == CL_COMMAND_WRITE_BUFFER)
+				seconds[PROFILE_WRITE] += elapsed;
+			else if (type == CL_COMMAND_NDRANGE_KERNEL || type == CL_COMMAND_TASK)
+				seconds[PROFILE_KERNEL] += elapsed;
+			else if (type == CL_COMMAND_READ_BUFFER || type == CL_COMMAND_MAP_BUFFER)
+				seconds[PROFILE_READ] += elapsed;
+		}
+		events.clear();
+	}
+
+	// This function returns the device seconds of every stage added together
+	double Total() const
+	{
+		double total = 0;
+		for (int stage = 0; stage < PROFILE_STAGES; stage++)
+			total += seconds[stage];
+		return total;
+	}
+
+	// This function collects anything outstanding and then starts the totals again from zero
+	void Reset()
+	{
+		Collect();
+		for (int stage = 0; stage < PROFILE_STAGES; stage++)
+			seconds[stage] = 0;
+	}
+
+private:
+	// A deque so the pointers handed out by Track stay valid as more events are added
+	std::deque<cl_event> events;
+};
+
+// This function prints the device time breakdown in microseconds (to go under a program's own timing line)
+inline void PrintProfile(const double *seconds)
+{
+	printf("    Device time: write %.0f, kernel %.0f, read %.0f microseconds\n", seconds[PROFILE_WRITE] * 1e6, seconds[PROFILE_KERNEL] * 1e6,
+		   seconds[PROFILE_READ] * 1e6);
+}
+
+// This function appends one row (the problem size, then the total and device times in microseconds) to a CSV file, writing the header first
+// if the file is empty
+inline void AppendProfileCsv(const char *path, int size, double totalMicroseconds, const double *seconds)
+{
+	FILE *csv = fopen(path, "a");
+	if (csv == NULL)
+		return;
+	fseek(csv, 0, SEEK_END);
+	if (ftell(csv) == 0)
+		fprintf(csv, "size,total_us,write_us,kernel_us,read_us\n");
+	fprintf(csv, "%d,%.0f,%.0f,%.0f,%.0f\n", size, totalMicroseconds, seconds[PROFILE_WRITE] * 1e6, seconds[PROFILE_KERNEL] * 1e6,
+			seconds[PROFILE_READ] * 1e6);
+	fclose(csv);
+}
+
+// | ------------------------------------------------------ |
+// | Multi-Device Splitting									|
+// | ------------------------------------------------------ |
+// A program can create one runtime per device returned by AllDevices and split its work across them. Each device is handed a share of
+// the items in proportion to a weight (its measured throughput), and the weights are updated after every run so a slower device is given
+// less work next time.
+
+// Most devices a program will split its work across
+#define MAX_DEVICES 8
+// Only trust a device's measured throughput once it has spent at least this long on its share of the work
+#define MIN_DEVICE_MEASURE_SECONDS 0.0001
+
+// This function returns the default device: the GPU of the first platform if there is one, otherwise its CPU
+inline cl_device_id DefaultDevice()
+{
+	cl_platform_id platform;
+	cl_device_id dev;
+	cl_int err = clGetPlatformIDs(1, &platform, NULL);
+	if (err < 0)
+	{
+		perror("Couldn't identify a platform");
+		exit(1);
+	}
+
+	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
+	if (err == CL_DEVICE_NOT_FOUND)
+		err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
+	if (err < 0)
+	{
+		perror("Couldn't access any devices");
+		exit(1);
+	}
+	return dev;
+}
+
+// This function returns every device of every platform (up to MAX_DEVICES). If there is only one device and subDevices is more than one,
+// that device is partitioned into subDevices equal sub-devices instead (if it supports it), so the work can still be split
+inline std::vector<cl_device_id> AllDevices(int subDevices = 0)
+{
+	std::vector<cl_device_id> found;
+	cl_platform_id platforms[MAX_DEVICES];
+	cl_uint numPlatforms = 0;
+	clGetPlatformIDs(MAX_DEVICES, platforms, &numPlatforms);
+
+	for (cl_uint p = 0; p < numPlatforms && p < MAX_DEVICES; p++)
+	{
+		cl_device_id devices[MAX_DEVICES];
+		cl_uint numDevices = 0;
+		if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, MAX_DEVICES, devices, &numDevices) < 0)
+			continue;
+		for (cl_uint d = 0; d < numDevices && d < MAX_DEVICES && found.size() < MAX_DEVICES; d++)
+			found.push_back(devices[d]);
+	}
+
+	if (found.empty())
+	{
+		perror("Couldn't access any devices");
+		exit(1);
+	}
+
+	if (found.size() == 1 && subDevices > 1)
+	{
+		cl_uint computeUnits = 0;
+		clGetDeviceInfo(found[0], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, NULL);
+		int parts = std::min(subDevices, MAX_DEVICES);
+		if ((int)computeUnits >= parts)
+		{
+			cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(computeUnits / parts), 0 };
+			cl_device_id devices[MAX_DEVICES];
+			cl_uint numDevices = 0;
+			if (clCreateSubDevices(found[0], properties, MAX_DEVICES, devices, &numDevices) == CL_SUCCESS && numDevices > 1)
+				found.assign(devices, devices + std::min(numDevices, (cl_uint)MAX_DEVICES));
+		}
+	}
+	return found;
+}
+
+// This function fills firsts and counts with each device's share of 'items' items (in proportion to weights), as contiguous ranges in
+// device order. Any leftover items go one each to the first devices
+inline void SplitWork(int *firsts, int *counts, int items, int numDevices, const double *weights)
+{
+	double totalWeight = 0;
+	for (int d = 0; d < numDevices; d++)
+		totalWeight += weights[d];
+
+	int assigned = 0;
+	for (int d = 0; d < numDevices; d++)
+	{
+		counts[d] = (int)((double)items * weights[d] / totalWeight);
+		assigned += counts[d];
+	}
+	for (int d = 0; assigned < items; d = (d + 1) % numDevices)
+	{
+		counts[d]++;
+		assigned++;
+	}
+
+	int first = 0;
+	for (int d = 0; d < numDevices; d++)
+	{
+		firsts[d] = first;
+		first += counts[d];
+	}
+}
+
+// This function sets each device's weight to its measured throughput (work / seconds) so the next SplitWork can balance on it. The weights
+// are left untouched if any device did no work or finished too quickly to measure
+inline void UpdateDeviceWeights(const double *work, const double *seconds, double *weights, int numDevices)
+{
+	for (int d = 0; d < numDevices; d++)
+	{
+		if (work[d] <= 0 || seconds[d] < MIN_DEVICE_MEASURE_SECONDS)
+			return;
+	}
+	for (int d = 0; d < numDevices; d++)
+		weights[d] = work[d] / seconds[d];
+}
+
+class OpenCLRuntime
+{
+public:
+	// This constructor picks the default device (the GPU if there is one, otherwise the CPU) and creates the context and first queue for it
+	OpenCLRuntime() : OpenCLRuntime(DefaultDevice()) {}
+
+	// This constructor creates the context and first queue for the given device (e.g. one of those returned by AllDevices)
+	explicit OpenCLRuntime(cl_device_id dev)
+	{
+		cl_int err;
+		device = dev;
+		context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+		if (err < 0)
+		{
+			perror("Couldn't create a context");
+			exit(1);
+		}
+
+		Queue(0);
+		pooledBytes = 0;
+		zeroCopy = IsZeroCopyDevice(device);
+	}
+
+	~OpenCLRuntime()
+	{
+		for (auto &entry : kernels)
+			clReleaseKernel(entry.second);
+		for (auto &entry : programs)
+			clReleaseProgram(entry.second);
+		for (auto &entry : usedBuffers)
+			clReleaseMemObject(entry.first);
+		for (PooledBuffer &pooled : freeBuffers)
+			clReleaseMemObject(pooled.buffer);
+		for (cl_command_queue queue : queues)
+			clReleaseCommandQueue(queue);
+		clReleaseContext(context);
+		// Only sub-devices are actually released (this does nothing for a whole device)
+		clReleaseDevice(device);
+	}
+
+	// The runtime owns OpenCL handles, so it cannot be copied
+	OpenCLRuntime(const OpenCLRuntime &) = delete;
+	OpenCLRuntime &operator=(const OpenCLRuntime &) = delete;
+
+	cl_device_id Device() const { return device; }
+	cl_context Context() const { return context; }
+
+	// True if the device works directly on host memory, so callers should wrap their (AllocateHostAligned) arrays with WrapHostBuffer and
+	// map the results instead of copying buffers in and out
+	bool ZeroCopy() const { return zeroCopy; }
+
+	// This function returns a buffer that uses the given host memory in place (CL_MEM_USE_HOST_PTR). It is tied to that memory so it is not
+	// pooled, and is released with clReleaseMemObject before the memory is freed
+	cl_mem WrapHostBuffer(cl_mem_flags flags, size_t size, void *host)
+	{
+		cl_int err;
+		cl_mem buffer = clCreateBuffer(context, flags | CL_MEM_USE_HOST_PTR, size, host, &err);
+		if (err < 0)
+		{
+			perror("Couldn't create a buffer");
+			printf("error = %d", err);
+			exit(1);
+		}
+		return buffer;
+	}
+
+	// This function returns the in-order queue with the given index, creating it (and any before it) the first time it is asked for. Every
+	// queue is profiled so its commands can be timed with a QueueProfile
+	cl_command_queue Queue(int index = 0)
+	{
+		while ((int)queues.size() <= index)
+		{
+			cl_int err;
+			cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, QUEUE_PROFILING, &err);
+			if (err < 0)
+			{
+				perror("Couldn't create a command queue");
+				exit(1);
+			}
+			queues.push_back(queue);
+		}
+		return queues[index];
+	}
+
+	// This function returns the program built from a .cl file with the given options, building it (or loading its cached binary) only the
+	// first time it is asked for
+	cl_program Program(const char *filename, const char *options)
+	{
+		std::string key = std::string(filename) + '\n' + ((options != NULL) ? options : "");
+		auto found = programs.find(key);
+		if (found != programs.end())
+			return found->second;
+
+		cl_program program = BuildProgram(filename, options);
+		programs[key] = program;
+		return program;
+	}
+
+	// This function returns a kernel from a program, creating it only the first time it is asked for (its arguments are left as they were
+	// last set, so callers set every argument before each launch)
+	cl_kernel Kernel(const char *filename, const char *options, const char *kernelname)
+	{
+		std::string key = std::string(filename) + '\n' + ((options != NULL) ? options : "") + '\n' + kernelname;
+		auto found = kernels.find(key);
+		if (found != kernels.end())
+			return found->second;
+
+		cl_int err;
+		cl_kernel kernel = clCreateKernel(Program(filename, options), kernelname, &err);
+		if (err < 0)
+		{
+			perror("Couldn't create a kernel");
+			printf("error =%d", err);
+			exit(1);
+		}
+		kernels[key] = kernel;
+		return kernel;
+	}
+
+	// This function returns a buffer with the given flags that holds at least 'size' bytes, reusing a pooled buffer of the same size class
+	// when there is one
+	cl_mem AcquireBuffer(cl_mem_flags flags, size_t size)
+	{
+		size_t capacity = SizeClass(size);
+		for (size_t i = 0; i < freeBuffers.size(); i++)
+		{
+			if (freeBuffers[i].flags == flags && freeBuffers[i].capacity == capacity)
+			{
+				PooledBuffer pooled = freeBuffers[i];
+				freeBuffers.erase(freeBuffers.begin() + i);
+				pooledBytes -= capacity;
+				usedBuffers[pooled.buffer] = pooled;
+				return pooled.buffer;
+			}
+		}
+
+		cl_int err;
+		cl_mem buffer = clCreateBuffer(context, flags, capacity, NULL, &err);
+		if (err < 0)
+		{
+			perror("Couldn't create a buffer");
+			printf("error = %d", err);
+			exit(1);
+		}
+		usedBuffers[buffer] = PooledBuffer{ buffer, flags, capacity };
+		return buffer;
+	}
+
+	// This function hands a buffer back to the pool so a later AcquireBuffer can reuse it (NULL is ignored so callers can release buffers
+	// that were never acquired)
+	void ReleaseBuffer(cl_mem buffer)
+	{
+		auto found = usedBuffers.find(buffer);
+		if (found == usedBuffers.end())
+			return;
+
+		PooledBuffer pooled = found->second;
+		usedBuffers.erase(found);
+		if (pooledBytes + pooled.capacity > BUFFER_POOL_LIMIT_BYTES)
+		{
+			clReleaseMemObject(pooled.buffer);
+			return;
+		}
+		freeBuffers.push_back(pooled);
+		pooledBytes += pooled.capacity;
+	}
+
+private:
+	struct PooledBuffer
+	{
+		cl_mem buffer;
+		cl_mem_flags flags;
+		size_t capacity;
+	};
+
+	cl_device_id device;
+	cl_context context;
+	std::vector<cl_command_queue> queues;
+	std::map<std::string, cl_program> programs;
+	std::map<std::string, cl_kernel> kernels;
+	std::map<cl_mem, PooledBuffer> usedBuffers;
+	std::vector<PooledBuffer> freeBuffers;
+	size_t pooledBytes;
+	bool zeroCopy;
+
+	// This function rounds a buffer size up to its size class (the next power of two, and at least BUFFER_POOL_MIN_BYTES)
+	static size_t SizeClass(size_t size)
+	{
+		size_t capacity = BUFFER_POOL_MIN_BYTES;
+		while (capacity < size)
+			capacity *= 2;
+		return capacity;
+	}
+
+	// This function reads a .cl file and builds it for the device, loading the cached binary from a previous run when there is one
+	cl_program BuildProgram(const char *filename, const char *options)
+	{
+		cl_program program;
+		FILE *program_handle;
+		char *program_buffer, *program_log;
+		size_t program_size, log_size;
+		cl_int err;
+
+		/* Read program file and place content into buffer */
+		program_handle = fopen(filename, "r");
+		if (program_handle == NULL)
+		{
+			perror("Couldn't find the program file");
+			exit(1);
+		}
+		fseek(program_handle, 0, SEEK_END);
+		program_size = ftell(program_handle);
+		rewind(program_handle);
+		program_buffer = (char *)malloc(program_size + 1);
+		program_buffer[program_size] = '\0';
+		fread(program_buffer, sizeof(char), program_size, program_handle);
+		fclose(program_handle);
+
+		// Load the binary cached by a previous run if there is one (this skips compiling the source entirely)
+		program = LoadCachedProgram(context, device, program_buffer, program_size, options);
+		if (program != NULL)
+		{
+			free(program_buffer);
+			return program;
+		}
+
+		program = clCreateProgramWithSource(context, 1, (const char **)&program_buffer, &program_size, &err);
+		if (err < 0)
+		{
+			perror("Couldn't create the program");
+			exit(1);
+		}
+
+		err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
+		if (err < 0)
+		{
+			/* Find size of log and print to std output */
+			clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+			program_log = (char *)malloc(log_size + 1);
+			program_log[log_size] = '\0';
+			clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size + 1, program_log, NULL);
+			printf("%s\n", program_log);
+			free(program_log);
+			exit(1);
+		}
+
+		// Cache the binary so the next run can skip the compile
+		SaveCachedProgram(program, device, program_buffer, program_size, options);
+		free(program_buffer);
+
+		return program;
+	}
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <mpi.h>
+
+// | ------------------------------------------------------ |
+// | Work Partitioning										|
+// | ------------------------------------------------------ |
+// Shared helpers used by every MPI program to build the sendcounts and displacement arrays for MPI_Scatterv/MPI_Gatherv. Items (rows of
+// a matrix or data points) are split as evenly as possible, or in proportion to a weight per node when the nodes run at different speeds
+// (e.g. some nodes using OpenCL and some using the CPU). Any leftover items are handed out one per node starting from the last rank, so
+// the master (which also generates the data and gathers the results) is the last to receive an extra item.
+
+// Only trust measured throughput once every node has spent at least this long on its share of the work (shorter runs are mostly overhead)
+#define MIN_MEASURE_SECONDS 0.001
+
+// This function fills sendcounts and displs for 'items' items of 'itemSize' units each (e.g. size ints per row, or sizeof(DataPoint) bytes
+// per data point). If weights is NULL the items are split evenly, otherwise each node gets a share proportional to its weight.
+inline void CalculatePartition(int *sendcounts, int *displs, int items, int itemSize, int numtasks, const double *weights = NULL)
+{
+	int counts[numtasks];
+	int assigned = 0;
+
+	if (weights == NULL)
+	{
+		// Even split, with the remainder spread one item per node
+		for (int p_id = 0; p_id < numtasks; p_id++)
+		{
+			counts[p_id] = items / numtasks;
+			assigned += counts[p_id];
+		}
+	}
+	else
+	{
+		double totalWeight = 0;
+		for (int p_id = 0; p_id < numtasks; p_id++)
+			totalWeight += weights[p_id];
+
+		// Give each node the whole part of its proportional share
+		for (int p_id = 0; p_id < numtasks; p_id++)
+		{
+			counts[p_id] = (int)((double)items * weights[p_id] / totalWeight);
+			assigned += counts[p_id];
+		}
+	}
+
+	// Hand out what is left one item at a time, starting from the last rank so the master receives an extra item last
+	for (int p_id = numtasks - 1; assigned < items; p_id = (p_id == 0) ? numtasks - 1 : p_id - 1)
+	{
+		counts[p_id]++;
+		assigned++;
+	}
+
+	// Convert item counts into sendcounts and displacements in units of the datatype being sent
+	int increment = 0;
+	for (int p_id = 0; p_id < numtasks; p_id++)
+	{
+		sendcounts[p_id] = counts[p_id] * itemSize;
+		displs[p_id] = increment;
+		increment += sendcounts[p_id];
+	}
+}
+
+// This function shares the measured throughput (work / seconds) of every node and stores it in weights so the next call to
+// CalculatePartition can balance on it. The weights are left untouched if any node did no work or finished too quickly to measure.
+inline void UpdateWeights(double work, double seconds, double *weights, int numtasks, MPI_Comm comm)
+{
+	double local[2] = { work, seconds };
+	double measured[2 * numtasks];
+	MPI_Allgather(local, 2, MPI_DOUBLE, measured, 2, MPI_DOUBLE, comm);
+
+	for (int p_id = 0; p_id < numtasks; p_id++)
+	{
+		if (measured[2 * p_id] <= 0 || measured[(2 * p_id) + 1] < MIN_MEASURE_SECONDS)
+			return;
+	}
+
+	for (int p_id = 0; p_id < numtasks; p_id++)
+		weights[p_id] = measured[2 * p_id] / measured[(2 * p_id) + 1];
+}
+
+#endif
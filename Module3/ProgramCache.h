@@ -0,0 +1,141 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <CL/cl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// | ------------------------------------------------------ |
+// | OpenCL Program Binary Cache							|
+// | ------------------------------------------------------ |
+// Shared helpers used by every OpenCL program to skip compiling the .cl source each time it starts. After a successful build the device
+// binary is written to PROGRAM_CACHE_DIR under a name hashed from everything that changes the result (the source, the build options, and
+// the device name, device version and driver version), and later runs load it with clCreateProgramWithBinary instead. Editing the kernel,
+// changing an option or updating the driver simply gives a new name, and any binary that fails to load is ignored so the caller falls
+// back to building from source.
+
+// Directory (relative to where the program is run) that holds the cached binaries
+#ifndef PROGRAM_CACHE_DIR
+#define PROGRAM_CACHE_DIR ".clcache"
+#endif
+
+// This function adds 'size' bytes to a running 64-bit FNV-1a hash
+inline unsigned long long HashBytes(unsigned long long hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// This function returns a string property of a device (e.g. its name or driver version)
+inline std::string DeviceInfoString(cl_device_id dev, cl_device_info param)
+{
+	size_t size = 0;
+	clGetDeviceInfo(dev, param, 0, NULL, &size);
+	std::string value(size, '\0');
+	clGetDeviceInfo(dev, param, size, &value[0], NULL);
+	return value;
+}
+
+// This function builds the path of the cached binary for a program source built with the given options on the given device
+inline std::string CachedProgramPath(cl_device_id dev, const char *source, size_t sourceSize, const char *options)
+{
+	std::string device = DeviceInfoString(dev, CL_DEVICE_NAME) + DeviceInfoString(dev, CL_DEVICE_VERSION) + DeviceInfoString(dev, CL_DRIVER_VERSION);
+	std::string flags = (options != NULL) ? options : "";
+
+	// Separate each part with a zero byte so moving text from one part to the next still changes the hash
+	unsigned long long hash = 14695981039346656037ULL;
+	hash = HashBytes(hash, source, sourceSize);
+	hash = HashBytes(hash, "", 1);
+	hash = HashBytes(hash, flags.c_str(), flags.size() + 1);
+	hash = HashBytes(hash, device.c_str(), device.size() + 1);
+
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.bin", hash);
+	return std::string(PROGRAM_CACHE_DIR) + name;
+}
+
+// This function returns the program loaded from its cached binary and built for the device, or NULL if there is no usable binary (in
+// which case the caller builds it from source and passes it to SaveCachedProgram)
+inline cl_program LoadCachedProgram(cl_context ctx, cl_device_id dev, const char *source, size_t sourceSize, const char *options)
+{
+	std::string path = CachedProgramPath(dev, source, sourceSize, options);
+	FILE *binary_handle = fopen(path.c_str(), "rb");
+	if (binary_handle == NULL)
+		return NULL;
+
+	fseek(binary_handle, 0, SEEK_END);
+	long binary_size = ftell(binary_handle);
+	rewind(binary_handle);
+	if (binary_size <= 0)
+	{
+		fclose(binary_handle);
+		return NULL;
+	}
+	unsigned char *binary_buffer = (unsigned char *)malloc(binary_size);
+	size_t read = fread(binary_buffer, 1, binary_size, binary_handle);
+	fclose(binary_handle);
+	if (read != (size_t)binary_size)
+	{
+		free(binary_buffer);
+		return NULL;
+	}
+
+	// A binary still needs clBuildProgram, but this only links it for the device rather than compiling the source
+	size_t size = (size_t)binary_size;
+	cl_int binary_status, err;
+	cl_program program = clCreateProgramWithBinary(ctx, 1, &dev, &size, (const unsigned char **)&binary_buffer, &binary_status, &err);
+	free(binary_buffer);
+	if (err < 0 || binary_status != CL_SUCCESS)
+	{
+		// A program can still be created for a binary the device rejects, so release it before falling back to the source
+		if (program != NULL)
+			clReleaseProgram(program);
+		return NULL;
+	}
+
+	if (clBuildProgram(program, 1, &dev, options, NULL, NULL) < 0)
+	{
+		clReleaseProgram(program);
+		return NULL;
+	}
+	return program;
+}
+
+// This function writes the binary of a program that was just built from source to the cache. The binary is written to a temporary file
+// first and then renamed, so several MPI nodes on the same machine can save the same program at once without reading a partial file
+inline void SaveCachedProgram(cl_program program, cl_device_id dev, const char *source, size_t sourceSize, const char *options)
+{
+	size_t binary_size = 0;
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL) < 0 || binary_size == 0)
+		return;
+
+	unsigned char *binary_buffer = (unsigned char *)malloc(binary_size);
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary_buffer, NULL) < 0)
+	{
+		free(binary_buffer);
+		return;
+	}
+
+	mkdir(PROGRAM_CACHE_DIR, 0755);
+	std::string path = CachedProgramPath(dev, source, sourceSize, options);
+	std::string temp = path + "." + std::to_string((long long)getpid());
+	FILE *binary_handle = fopen(temp.c_str(), "wb");
+	if (binary_handle != NULL)
+	{
+		bool written = fwrite(binary_buffer, 1, binary_size, binary_handle) == binary_size;
+		written = (fclose(binary_handle) == 0) && written;
+		if (!written || rename(temp.c_str(), path.c_str()) != 0)
+			remove(temp.c_str());
+	}
+	free(binary_buffer);
+}
+
+#endif
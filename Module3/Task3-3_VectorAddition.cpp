@@ -5,6 +5,8 @@
 #include <cstdlib>
 #include <time.h>
 #include <chrono>
+#include <algorithm>
+#include "OpenCLRuntime.h"
 
 using namespace std::chrono;
 using namespace std;
@@ -12,6 +14,17 @@ using namespace std;
 // Define printing to be on/off (1/0)
 #define PRINT 1
 
+// Define how many chunks the vectors are split into so copying one chunk overlaps with adding another
+#define PIPELINE_CHUNKS 4
+
+// Define the file each run's timings (total and device write/kernel/read) are appended to, one row per vector size
+#define PROFILE_CSV "results_vector_addition.csv"
+
+// Toggle splitting the vectors across every OpenCL device on the host (1) or only using the default device (0), and how many equal
+// sub-devices to partition the device into when there is only one (0 or 1 to leave it whole)
+#define MULTI_DEVICE 1
+#define SUB_DEVICES 0
+
 // | ------------------------------------------------------ |
 // | Variable Declaration									|
 // | ------------------------------------------------------ |
@@ -20,26 +33,29 @@ int SZ = 8;
 // Declare pointers for the three vectors
 int *v1, *v2, *v3;
 
-// Delcare memory buffers for all three vectors
-cl_mem bufV1, bufV2, bufV3;
-
-// Declare variable to store the unique ID of the computational device (GPU, CPU) by a kernel in the program
-cl_device_id device_id;
-
-// Declare variable to store the environment configuration (devices, memory properties, queues etc.)
-cl_context context;
-
-// Declare variable to store the set of kernels used for the program
-cl_program program;
+// Declare the profile that times the device commands of the run
+QueueProfile profile;
 
-// Declare variable to store the vector addition function which will be executed on a device
-cl_kernel kernel;
-
-// Declare variable to store the queue of commands to be executed on a specific device
-cl_command_queue queue;
-
-// Declare variable to store event results
-cl_event event = NULL;
+// Declare the state kept for each device the vectors are split across (each device has its own runtime, since devices from different
+// platforms cannot share a context)
+struct VectorDevice
+{
+	OpenCLRuntime *runtime;
+	cl_kernel kernel;
+	// Queues used to copy data to the device, run the kernel and copy data back, so copies of one chunk overlap with adding another
+	cl_command_queue copyInQueue, queue, copyOutQueue;
+	cl_mem bufV1, bufV2, bufV3;
+	// Whether the device works directly on host memory (CPU devices), in which case the buffers wrap the vectors instead of being copied
+	bool zeroCopy;
+	// Measured throughput (elements per second of device time), used to size the device's share of each chunk
+	double weight;
+	// The commands of the last two chunks, so one chunk can be timed while the next is still running
+	QueueProfile chunkProfiles[2];
+};
+
+// Declare the devices the vectors are split across, and how many there are
+VectorDevice *devices;
+int numDevices = 1;
 
 // Declare variable to keep track of any errors that occur during program execution
 int err;
@@ -48,22 +64,16 @@ int err;
 // | ------------------------------------------------------ |
 // | Function Declaration									|
 // | ------------------------------------------------------ |
-// Function that returns either the device ID of the GPU (if available) or the CPU
-cl_device_id create_device();
-
-// Function that handles the initial setup of the OpenCL environment by setting the device,
-// context, program, queue, and kernel variables declared above
-void setup_openCL_device_context_queue_kernel(char *filename, char *kernelname);
-
-// Function that creates and builds the OpenGL program from the accompanying .cl file, then
-// returns the program handle to the caller
-cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename);
+// Function that creates a runtime, queues, kernel and buffers for each device the vectors are split across
+void setup_devices(const vector<cl_device_id> &ids, char *filename, char *kernelname);
 
-// Function that creates a memory buffer to be used by the kernel and writes all vectors data to it
-void setup_kernel_memory();
+// Function that enqueues one device's share of a chunk: on a zero-copy device the kernel adds it in place and the result is mapped,
+// otherwise events chain its copy in, kernel and copy out across the device's three queues. None of the commands block
+void enqueue_chunk(VectorDevice &dev, size_t first, size_t count, QueueProfile &chunkProfile);
 
-// Function that sets the arguments for the kernel, specifically the vector size and buffer variables
-void copy_kernel_args();
+// Function that streams the vectors through every device in chunks, splitting each chunk across the devices in proportion to their
+// throughput on the chunks before, so transfers of one chunk overlap with the kernel of another
+void run_pipeline(size_t chunks);
 
 // Functions that releases the memory reserved for the above variables back into the available pool
 void free_memory();
@@ -83,41 +93,33 @@ int main(int argc, char **argv)
 	if (argc > 1)
 		SZ = atoi(argv[1]);
 
+	// Find every device the vectors could be split across (or just the default device)
+	vector<cl_device_id> ids;
+	if (MULTI_DEVICE)
+		ids = AllDevices(SUB_DEVICES);
+	else
+		ids.push_back(DefaultDevice());
+	numDevices = (int)ids.size();
+
 	// Populate the initial vectors
 	init(v1, SZ);
 	init(v2, SZ);
 
 	// Allocate memory for the result vector
-	v3 = (int *) malloc (sizeof(int) * SZ);
-
-	// Define variable to store the number of work items per dimension in the work-group
-	size_t global[1] = {(size_t)SZ};
+	v3 = (int *)AllocateHostAligned(sizeof(int) * SZ);
 
 	// Print the initial vectors
 	print(v1, SZ);
 	print(v2, SZ);
 
-	// Setup the OpenGL environment using the handler functions declared above
-	setup_openCL_device_context_queue_kernel((char *)"./Task3-3_VectorAddition.cl", (char *)"vector_addition");
-	setup_kernel_memory();
-	copy_kernel_args();
+	// Setup the OpenGL environment of every device (after the vectors, so they can be used in place if a device works on host memory)
+	setup_devices(ids, (char *)"./Task3-3_VectorAddition.cl", (char *)"vector_addition");
 
-	// Get the current time before vector assignment
+	// Get the current time before vector assignment (this now includes copying the inputs, since they are copied as part of the pipeline)
 	auto start = high_resolution_clock::now();
 
-	// Enqueues the kernel to start executing the commands detailed in the program's queue. It requires the queue and kernel (set up previously),
-	// the dimensions of the work-items (in this case 1), offset if applicable, the global work-size array defined above, local work-size if
-	// applicable, how many events need to finish before execution can begin (0 in this case), the events to wait on (again, NULL), and the event handler
-	clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 0, NULL, &event);
-
-	// Wait for all work-items to finish
-	clWaitForEvents(1, &event);
-
-	// Reads memory from buffer objects back to host memory once the program has finished execution. It requires a queue to store the command,
-	// the buffer of the vectors, a boolean to block other operations on the memory, offset if necessary, size of the data to be read from the buffer,
-	// memory location to read the data into, how many events need to finish before execution can begin (0 in this case), the events to wait on
-	// (again, NULL), and the event handler
-	clEnqueueReadBuffer(queue, bufV3, CL_TRUE, 0, SZ * sizeof(int), &v3[0], 0, NULL, NULL);
+	// Copy the vectors in, add them and copy the result out, one chunk at a time (or add them in place if a device works on host memory)
+	run_pipeline(PIPELINE_CHUNKS);
 
 	// Get the current time after vector assignment
 	auto stop = high_resolution_clock::now();
@@ -128,9 +130,12 @@ int main(int argc, char **argv)
 	// Obtain the difference between start and stop times, then cast to microseconds format
 	auto duration = duration_cast<microseconds>(stop - start);
 
-	// Print the time taken
+	// Print the time taken, broken down into the device's copy and kernel times, and export it
+	profile.Collect();
 	cout << "Time taken by function: "
 		 << duration.count() << " microseconds" << endl;
+	PrintProfile(profile.seconds);
+	AppendProfileCsv(PROFILE_CSV, SZ, (double)duration.count(), profile.seconds);
 
 	// Frees memory of all variables declared above
 	free_memory();
@@ -142,7 +147,8 @@ int main(int argc, char **argv)
 // | ------------------------------------------------------ |
 void init(int *&A, int size)
 {
-	A = (int *)malloc(sizeof(int) * size);
+	// Aligned so a zero-copy device can use the vector in place
+	A = (int *)AllocateHostAligned(sizeof(int) * size);
 
 	for (long i = 0; i < size; i++)
 	{
@@ -181,16 +187,19 @@ void print(int *A, int size)
 
 void free_memory()
 {
-	// Free the buffers
-	clReleaseMemObject(bufV1);
-	clReleaseMemObject(bufV2);
-	clReleaseMemObject(bufV3);
-
-	// Free OpenCL objects
-	clReleaseKernel(kernel);
-	clReleaseCommandQueue(queue);
-	clReleaseProgram(program);
-	clReleaseContext(context);
+	// Free each device's buffers back to its runtime, then the runtimes themselves (which release the kernel, queues, program and context).
+	// Buffers wrapping the vectors are tied to them, so they are released before the vectors are freed
+	for (int d = 0; d < numDevices; d++)
+	{
+		if (devices[d].zeroCopy)
+		{
+			clReleaseMemObject(devices[d].bufV1);
+			clReleaseMemObject(devices[d].bufV2);
+			clReleaseMemObject(devices[d].bufV3);
+		}
+		delete devices[d].runtime;
+	}
+	delete[] devices;
 
 	// Free the vectors
 	free(v1);
@@ -198,162 +207,150 @@ void free_memory()
 	free(v3);
 }
 
-
-void copy_kernel_args()
+void setup_devices(const vector<cl_device_id> &ids, char *filename, char *kernelname)
 {
-	// Call the set kernel argument function that stores the location of the data to be used by the kernel. It requires the kernel to
-	// store the argument int, the index position of the argument in the kernel, the size of the data, plus a pointer to the data itself
-	clSetKernelArg(kernel, 0, sizeof(int), (void *)&SZ);
-	clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&bufV1);
-	clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&bufV2);
-	clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *)&bufV3);
-
-	if (err < 0)
+	devices = new VectorDevice[numDevices];
+	for (int d = 0; d < numDevices; d++)
 	{
-		perror("Couldn't create a kernel argument");
-		printf("error = %d", err);
-		exit(1);
-	}
-}
+		VectorDevice &dev = devices[d];
+		dev.runtime = new OpenCLRuntime(ids[d]);
+		dev.kernel = dev.runtime->Kernel(filename, NULL, kernelname);
+
+		// Three queues so copies to and from the device can run alongside the kernel (each queue runs its own commands in order, and
+		// events order the commands between queues)
+		dev.copyInQueue = dev.runtime->Queue(0);
+		dev.queue = dev.runtime->Queue(1);
+		dev.copyOutQueue = dev.runtime->Queue(2);
+		dev.zeroCopy = dev.runtime->ZeroCopy();
+		dev.weight = 1.0;
+
+		// Every device gets buffers the size of the whole vectors (wrapping them if it works on host memory), so the global work offset
+		// indexes them the same way on every device, but only its share of each chunk is copied in and out
+		if (dev.zeroCopy)
+		{
+			dev.bufV1 = dev.runtime->WrapHostBuffer(CL_MEM_READ_ONLY, SZ * sizeof(int), v1);
+			dev.bufV2 = dev.runtime->WrapHostBuffer(CL_MEM_READ_ONLY, SZ * sizeof(int), v2);
+			dev.bufV3 = dev.runtime->WrapHostBuffer(CL_MEM_WRITE_ONLY, SZ * sizeof(int), v3);
+		}
+		else
+		{
+			dev.bufV1 = dev.runtime->AcquireBuffer(CL_MEM_READ_ONLY, SZ * sizeof(int));
+			dev.bufV2 = dev.runtime->AcquireBuffer(CL_MEM_READ_ONLY, SZ * sizeof(int));
+			dev.bufV3 = dev.runtime->AcquireBuffer(CL_MEM_WRITE_ONLY, SZ * sizeof(int));
+		}
 
-void setup_kernel_memory()
-{
-	// The clCreateBuffer function creates in memory a space for a collection of one-dimensional element in a context. It requires the 
-	// relevant context used to create the buffer with, a flag denoting the type of buffer, the size of the memory to allocate, as well
-	// the location of data already allocated if appicable and an variable to store an error code if necessary.
-	// Since we want the kernel to only read from the initials buffer, we specify the CL_MEM_READ_ONLY flag. However for the result buffer, 
-	// we only need to write back into it so the CL_MEM_WRITE_ONLY flag is used
-	bufV1 = clCreateBuffer(context, CL_MEM_READ_ONLY, SZ * sizeof(int), NULL, NULL);
-	bufV2 = clCreateBuffer(context, CL_MEM_READ_ONLY, SZ * sizeof(int), NULL, NULL);
-	bufV3 = clCreateBuffer(context, CL_MEM_WRITE_ONLY, SZ * sizeof(int), NULL, NULL);
-
-	// Copy matrices to the devices
-	clEnqueueWriteBuffer(queue, bufV1, CL_TRUE, 0, SZ * sizeof(int), &v1[0], 0, NULL, NULL);
-	clEnqueueWriteBuffer(queue, bufV2, CL_TRUE, 0, SZ * sizeof(int), &v2[0], 0, NULL, NULL);
-	clEnqueueWriteBuffer(queue, bufV3, CL_TRUE, 0, SZ * sizeof(int), &v3[0], 0, NULL, NULL);
+		// Call the set kernel argument function that stores the location of the data to be used by the kernel. It requires the kernel to
+		// store the argument int, the index position of the argument in the kernel, the size of the data, plus a pointer to the data itself
+		clSetKernelArg(dev.kernel, 0, sizeof(int), (void *)&SZ);
+		clSetKernelArg(dev.kernel, 1, sizeof(cl_mem), (void *)&dev.bufV1);
+		clSetKernelArg(dev.kernel, 2, sizeof(cl_mem), (void *)&dev.bufV2);
+		err = clSetKernelArg(dev.kernel, 3, sizeof(cl_mem), (void *)&dev.bufV3);
+		if (err < 0)
+		{
+			perror("Couldn't create a kernel argument");
+			printf("error = %d", err);
+			exit(1);
+		}
+	}
 }
 
-void setup_openCL_device_context_queue_kernel(char *filename, char *kernelname)
+void enqueue_chunk(VectorDevice &dev, size_t first, size_t count, QueueProfile &chunkProfile)
 {
-	device_id = create_device();
-	cl_int err;
-
-	// The clCreateContext function creates a context object that stores configuration information about the OpenGL environment, including
-	// the devices, program, and queues. It requires any special properties to be set (NULL in this case), the number of devices, a pointer
-	// to a list of unique devices, any callback functions or user data if necessary (both NULL here), and an error code handler
-	context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &err);
-	if (err < 0)
-	{
-		perror("Couldn't create a context");
-		exit(1);
-	}
+	size_t bytes = count * sizeof(int);
 
-	program = build_program(context, device_id, filename);
+	// The global work offset makes get_global_id start at this share of the chunk, so the kernel is unchanged
+	size_t globalOffset[1] = { first };
+	size_t global[1] = { count };
 
-	// The clCreateCommandQueueWithProperties function creates a queue to be used by the kernel to execute commands from on a single device. 
-	// It requires a context to be added to, a device ID to be assigned to, any special properties needed for the queue, and an error code handler
-	queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
-	if (err < 0)
+	// A zero-copy device adds the vectors in place and maps its share of the result (which only makes it visible to the host)
+	if (dev.zeroCopy)
 	{
-		perror("Couldn't create a command queue");
-		exit(1);
-	};
+		clEnqueueNDRangeKernel(dev.queue, dev.kernel, 1, globalOffset, global, NULL, 0, NULL, chunkProfile.Track());
+		void *mapped = clEnqueueMapBuffer(dev.queue, dev.bufV3, CL_FALSE, CL_MAP_READ, first * sizeof(int), bytes, 0, NULL, chunkProfile.Track(), &err);
+		clEnqueueUnmapMemObject(dev.queue, dev.bufV3, mapped, 0, NULL, NULL);
+		clFlush(dev.queue);
+		return;
+	}
 
-	kernel = clCreateKernel(program, kernelname, &err);
-	if (err < 0)
-	{
-		perror("Couldn't create a kernel");
-		printf("error =%d", err);
-		exit(1);
-	};
+	// Non-blocking (CL_FALSE) copies of this share of both inputs on the copy-in queue, each recording an event when it has finished
+	cl_event writes[2], added;
+	clEnqueueWriteBuffer(dev.copyInQueue, dev.bufV1, CL_FALSE, first * sizeof(int), bytes, &v1[first], 0, NULL, &writes[0]);
+	clEnqueueWriteBuffer(dev.copyInQueue, dev.bufV2, CL_FALSE, first * sizeof(int), bytes, &v2[first], 0, NULL, &writes[1]);
+
+	// Add the share once both copies have finished, then copy the result back once it has been added, again without blocking
+	clEnqueueNDRangeKernel(dev.queue, dev.kernel, 1, globalOffset, global, NULL, 2, writes, &added);
+	clEnqueueReadBuffer(dev.copyOutQueue, dev.bufV3, CL_FALSE, first * sizeof(int), bytes, &v3[first], 1, &added, chunkProfile.Track());
+
+	// The queues keep their own references to events they still wait on, so these can be released straight away (the profile keeps its
+	// own reference too, to time them afterwards)
+	chunkProfile.Add(writes[0]);
+	chunkProfile.Add(writes[1]);
+	chunkProfile.Add(added);
+	clReleaseEvent(writes[0]);
+	clReleaseEvent(writes[1]);
+	clReleaseEvent(added);
+
+	// Start every queue now, so this device runs while the next one is being enqueued
+	clFlush(dev.copyInQueue);
+	clFlush(dev.queue);
+	clFlush(dev.copyOutQueue);
 }
 
-cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename)
+void run_pipeline(size_t chunks)
 {
+	size_t chunkSize = ((size_t)SZ + chunks - 1) / chunks;
+	int lastCounts[numDevices];
+	fill_n(lastCounts, numDevices, 0);
+	size_t chunk = 0;
 
-	cl_program program;
-	FILE *program_handle;
-	char *program_buffer, *program_log;
-	size_t program_size, log_size;
-
-	/* Read program file and place content into buffer */
-	program_handle = fopen(filename, "r");
-	if (program_handle == NULL)
-	{
-		perror("Couldn't find the program file");
-		exit(1);
-	}
-	fseek(program_handle, 0, SEEK_END);
-	program_size = ftell(program_handle);
-	rewind(program_handle);
-	program_buffer = (char *)malloc(program_size + 1);
-	program_buffer[program_size] = '\0';
-	fread(program_buffer, sizeof(char), program_size, program_handle);
-	fclose(program_handle);
-
-	// The clCreateProgramWithSource function creates a program in a context and loads all program code into it ready to be used by the
-	// queue and kernel. In this case the program code originates from the .cl file. It requires the context to create the program in,
-	// the buffer to store the program code in (casted to a char **), the size of the buffer, and an error code handler
-	program = clCreateProgramWithSource(ctx, 1,
-										(const char **)&program_buffer, &program_size, &err);
-	if (err < 0)
+	for (size_t offset = 0; offset < (size_t)SZ; offset += chunkSize, chunk++)
 	{
-		perror("Couldn't create the program");
-		exit(1);
-	}
-	free(program_buffer);
+		size_t count = min(chunkSize, (size_t)SZ - offset);
+		int firsts[numDevices], counts[numDevices];
+		double weights[numDevices];
+		for (int d = 0; d < numDevices; d++)
+			weights[d] = devices[d].weight;
+		SplitWork(firsts, counts, (int)count, numDevices, weights);
+
+		// Enqueue every device's share of this chunk, so the devices already have it queued while the previous chunk is timed below
+		for (int d = 0; d < numDevices; d++)
+		{
+			if (counts[d] > 0)
+				enqueue_chunk(devices[d], offset + firsts[d], counts[d], devices[d].chunkProfiles[chunk % 2]);
+		}
 
-	/* Build program 
+		// Wait only for the previous chunk, then set each device's weight to its throughput on it so the next chunk is split to match
+		if (chunk > 0)
+		{
+			double work[numDevices], seconds[numDevices];
+			for (int d = 0; d < numDevices; d++)
+			{
+				QueueProfile &previous = devices[d].chunkProfiles[(chunk - 1) % 2];
+				previous.Collect();
+				work[d] = lastCounts[d];
+				seconds[d] = previous.Total();
+				for (int stage = 0; stage < PROFILE_STAGES; stage++)
+					profile.seconds[stage] += previous.seconds[stage];
+				previous.Reset();
+			}
+			UpdateDeviceWeights(work, seconds, weights, numDevices);
+			for (int d = 0; d < numDevices; d++)
+				devices[d].weight = weights[d];
+		}
+		copy(counts, counts + numDevices, lastCounts);
+	}
 
-   The fourth parameter accepts options that configure the compilation. 
-   These are similar to the flags used by gcc. For example, you can 
-   define a macro with the option -DMACRO=VALUE and turn off optimization 
-   with -cl-opt-disable.
-   */
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-	if (err < 0)
+	// Wait for the last chunk to arrive back on the host (and any zero-copy device to unmap the result)
+	for (int d = 0; d < numDevices; d++)
 	{
-
-		/* Find size of log and print to std output */
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
-							  0, NULL, &log_size);
-		program_log = (char *)malloc(log_size + 1);
-		program_log[log_size] = '\0';
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
-							  log_size + 1, program_log, NULL);
-		printf("%s\n", program_log);
-		free(program_log);
-		exit(1);
+		if (chunk > 0)
+		{
+			QueueProfile &last = devices[d].chunkProfiles[(chunk - 1) % 2];
+			last.Collect();
+			for (int stage = 0; stage < PROFILE_STAGES; stage++)
+				profile.seconds[stage] += last.seconds[stage];
+			last.Reset();
+		}
+		clFinish(devices[d].queue);
 	}
-
-	return program;
 }
-
-cl_device_id create_device() {
-
-   cl_platform_id platform;
-   cl_device_id dev;
-   int err;
-
-   /* Identify a platform */
-   err = clGetPlatformIDs(1, &platform, NULL);
-   if(err < 0) {
-	  perror("Couldn't identify a platform");
-	  exit(1);
-   } 
-
-   // Access a device
-   // GPU
-   err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
-   if(err == CL_DEVICE_NOT_FOUND) {
-	  // CPU
-	  printf("GPU not found\n");
-	  err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
-   }
-   if(err < 0) {
-	  perror("Couldn't access any devices");
-	  exit(1);   
-   }
-
-   return dev;
-}
\ No newline at end of file
@@ -3,6 +3,11 @@
 #include <cstdlib>
 #include <time.h>
 #include <chrono>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include "Partition.h"
+#include "ElementType.h"
 
 using namespace std::chrono;
 using namespace std;
@@ -10,8 +15,12 @@ using namespace std;
 // Set rank of master node to 0
 #define masterRank 0
 
+// Toggle balancing the rows sent to each node by their measured throughput (1) or splitting them evenly (0)
+#define WEIGHTED_PARTITION 0
+
 // This function prints an individual row of a matrix using appropriate spacing
-void PrintRow(int* array, int size)
+template <typename T>
+void PrintRow(T* array, int size)
 {
 	cout << "|  ";
 	for (int i = 0; i < size; i++)
@@ -30,7 +39,8 @@ void PrintRow(int* array, int size)
 }
 
 // This function prints both input matrices and the output matrix in the form of an equation (should only be called if size < 10 due to formatting issues)
-void PrintEquation(int** matrix1, int** matrix2, int** matrix3, int size, bool print)
+template <typename T>
+void PrintEquation(T** matrix1, T** matrix2, T** matrix3, int size, bool print)
 {
 	if (!print)
 		return;
@@ -56,10 +66,11 @@ void PrintEquation(int** matrix1, int** matrix2, int** matrix3, int size, bool p
 }
 
 // This function allocates contiguous memory for a single square matrix based on its rows and cols
-void InitialiseMatrix(int** &matrix, int rows, int cols, int size)
+template <typename T>
+void InitialiseMatrix(T** &matrix, int rows, int cols, int size)
 {
-	matrix = (int**)malloc(rows * cols * sizeof(int*));
-	int *tempRow = (int*)malloc(rows * cols * sizeof(int));
+	matrix = (T**)malloc(rows * cols * sizeof(T*));
+	T *tempRow = (T*)malloc(rows * cols * sizeof(T));
 
 	for (int i = 0; i < size; i++)
 	{
@@ -68,7 +79,8 @@ void InitialiseMatrix(int** &matrix, int rows, int cols, int size)
 }
 
 // This function populates an input matrix with random integers less than 10
-void PopulateMatrix(int** &matrix, int rows, int cols)
+template <typename T>
+void PopulateMatrix(T** &matrix, int rows, int cols)
 {
 	for (int i = 0; i < rows; i++)
 	{
@@ -79,23 +91,584 @@ void PopulateMatrix(int** &matrix, int rows, int cols)
 	}
 }
 
-// This function multiplies two matrices together and stores the output in a third
-void MultiplyMatrices(int** matrix1, int** matrix2, int** matrix3, int rows, int size)
+// This function multiplies two matrices together and stores the output in a third, one row at a time with the vectorised row kernel
+template <typename T>
+void MultiplyMatrices(T** matrix1, T** matrix2, T** matrix3, int rows, int size)
+{
+	for (int i = 0; i < rows; i++)
+	{
+		MultiplyRow(matrix1[i], matrix2, matrix3[i], size);
+	}
+}
+
+// | ------------------------------------------------------ |
+// | Communication Accounting								|
+// | ------------------------------------------------------ |
+// Running total of the bytes this node has sent plus received during the current multiplication. Collectives are counted as if every
+// transfer went directly between the root and each node (i.e. the root of a broadcast sends one copy to every other node)
+long long bytesCommunicated = 0;
+
+// This function broadcasts a buffer and records the bytes moved by this node
+void CountedBcast(void* buffer, int count, MPI_Datatype type, int root, MPI_Comm comm)
+{
+	int typeSize, commSize, commRank;
+	MPI_Type_size(type, &typeSize);
+	MPI_Comm_size(comm, &commSize);
+	MPI_Comm_rank(comm, &commRank);
+
+	bytesCommunicated += (long long)count * typeSize * (commRank == root ? commSize - 1 : 1);
+	MPI_Bcast(buffer, count, type, root, comm);
+}
+
+// This function scatters a buffer with distinct sendcounts and records the bytes moved by this node
+void CountedScatterv(void* sendbuf, int* sendcounts, int* displs, MPI_Datatype type, void* recvbuf, int recvcount, int root, MPI_Comm comm)
+{
+	int typeSize, commSize, commRank;
+	MPI_Type_size(type, &typeSize);
+	MPI_Comm_size(comm, &commSize);
+	MPI_Comm_rank(comm, &commRank);
+
+	if (commRank == root)
+	{
+		for (int p_id = 0; p_id < commSize; p_id++)
+		{
+			if (p_id != root)
+				bytesCommunicated += (long long)sendcounts[p_id] * typeSize;
+		}
+	}
+	else
+		bytesCommunicated += (long long)recvcount * typeSize;
+	MPI_Scatterv(sendbuf, sendcounts, displs, type, recvbuf, recvcount, type, root, comm);
+}
+
+// This function gathers buffers with distinct recvcounts and records the bytes moved by this node
+void CountedGatherv(void* sendbuf, int sendcount, MPI_Datatype type, void* recvbuf, int* recvcounts, int* displs, int root, MPI_Comm comm)
+{
+	int typeSize, commSize, commRank;
+	MPI_Type_size(type, &typeSize);
+	MPI_Comm_size(comm, &commSize);
+	MPI_Comm_rank(comm, &commRank);
+
+	if (commRank == root)
+	{
+		for (int p_id = 0; p_id < commSize; p_id++)
+		{
+			if (p_id != root)
+				bytesCommunicated += (long long)recvcounts[p_id] * typeSize;
+		}
+	}
+	else
+		bytesCommunicated += (long long)sendcount * typeSize;
+	MPI_Gatherv(sendbuf, sendcount, type, recvbuf, recvcounts, displs, type, root, comm);
+}
+
+// This function sums buffers onto the root and records the bytes moved by this node
+void CountedReduce(void* sendbuf, void* recvbuf, int count, MPI_Datatype type, int root, MPI_Comm comm)
+{
+	int typeSize, commSize, commRank;
+	MPI_Type_size(type, &typeSize);
+	MPI_Comm_size(comm, &commSize);
+	MPI_Comm_rank(comm, &commRank);
+
+	bytesCommunicated += (long long)count * typeSize * (commRank == root ? commSize - 1 : 1);
+	MPI_Reduce(sendbuf, recvbuf, count, type, MPI_SUM, root, comm);
+}
+
+// This function shifts a buffer by the given displacement along a periodic 1D communicator and records the bytes moved by this node
+void CountedShift(void* buffer, int count, MPI_Datatype type, int displacement, MPI_Comm comm)
+{
+	int typeSize, commSize, source, dest;
+	MPI_Type_size(type, &typeSize);
+	MPI_Comm_size(comm, &commSize);
+
+	// Nothing to do if the shift wraps all the way around
+	if (displacement % commSize == 0)
+		return;
+
+	MPI_Cart_shift(comm, 0, displacement, &source, &dest);
+	bytesCommunicated += 2LL * count * typeSize;
+	MPI_Sendrecv_replace(buffer, count, type, dest, 0, source, 0, comm, MPI_STATUS_IGNORE);
+}
+
+// This function releases the contiguous memory allocated for a matrix by InitialiseMatrix
+template <typename T>
+void FreeMatrix(T** &matrix)
+{
+	free(matrix[0]);
+	free(matrix);
+	matrix = NULL;
+}
+
+// This function returns the lowest common multiple of two positive integers
+int LowestCommonMultiple(int a, int b)
+{
+	int x = a, y = b;
+	while (y != 0)
+	{
+		int t = x % y;
+		x = y;
+		y = t;
+	}
+	return (a / x) * b;
+}
+
+// This function multiplies two matrices by scattering the rows of m1 and broadcasting the entire m2 matrix to every node. If weights is not
+// NULL the rows are split in proportion to it, and it is then updated with the throughput each node measured for the next call
+void RunRowPartitioned(Element** &m1, Element** &m2, Element** &m3, int size, int numtasks, int rank, double *weights)
+{
+    // Get the count of data to be broadcasted for a single matrix
+    int broadcast_size = size * size;
+    // Create an array to store how much data to send across to each node
+    int sendcounts[numtasks];
+    // Create an array to store the displacement values used for keeping track of data sent for each node
+    int displs[numtasks];
+
+    // Determine the sendcounts and displacement values for each task (each row is size ints)
+    CalculatePartition(sendcounts, displs, size, size, numtasks, weights);
+    // Get how many rows this node will process
+    int scatter_rows = sendcounts[rank] / size;
+    // Always allocate at least one row so nodes without any rows still have a valid buffer
+    int alloc_rows = max(scatter_rows, 1);
+
+    // Create two sub-matrices for internal processing of each node (m2_sub not needed since m2 will be broadcasted)
+    Element **m1_sub;
+    Element **m3_sub;
+
+    // Allocate memory for the sub matrices
+    InitialiseMatrix(m1_sub, alloc_rows, size, alloc_rows);
+    InitialiseMatrix(m3_sub, alloc_rows, size, alloc_rows);
+
+    // If running on the master...
+    if (rank == masterRank)
+    {
+        // Allocate memory to all main matrices
+        InitialiseMatrix(m1, size, size, size);
+        InitialiseMatrix(m2, size, size, size);
+        InitialiseMatrix(m3, size, size, size);
+
+        // Populate input matrices with random values
+        PopulateMatrix(m1, size, size);
+        PopulateMatrix(m2, size, size);
+
+        // Scatter data from the m1 matrix into the m1_sub matrices for all nodes using distinct sendcount values
+        CountedScatterv(&m1[0][0], sendcounts, displs, MPI_ELEMENT, &m1_sub[0][0], sendcounts[rank], masterRank, MPI_COMM_WORLD);
+        // Broadcast the entire m2 matrix to all nodes
+        CountedBcast(&m2[0][0], broadcast_size, MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
+    }
+    else
+    {
+        // Allocate memory for m2
+        InitialiseMatrix(m2, size, size, size);
+
+        // Receive data from the m1 matrix on master node and store into m1_sub matrix
+        CountedScatterv(NULL, sendcounts, displs, MPI_ELEMENT, &m1_sub[0][0], sendcounts[rank], masterRank, MPI_COMM_WORLD);
+        // Recieve broadcast from the m2 matrix on master
+        CountedBcast(&m2[0][0], broadcast_size, MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
+    }
+
+    // Multiply the m1_sub and m2 matrices and store result in m3_sub (note only need to calculate the count of rows sent to the node)
+    auto computeStart = high_resolution_clock::now();
+    MultiplyMatrices(m1_sub, m2, m3_sub, scatter_rows, size);
+    auto computeTime = duration_cast<duration<double>>(high_resolution_clock::now() - computeStart);
+
+    if (rank == masterRank)
+    {
+        // Gather the m3_sub results from all nodes (taking into account their respective sendcount value) and store in m3
+        CountedGatherv(&m3_sub[0][0], sendcounts[rank], MPI_ELEMENT, &m3[0][0], sendcounts, displs, masterRank, MPI_COMM_WORLD);
+    }
+    else
+    {
+        // Send the m3_sub results to m3 in master
+        CountedGatherv(&m3_sub[0][0], sendcounts[rank], MPI_ELEMENT, NULL, sendcounts, displs, masterRank, MPI_COMM_WORLD);
+    }
+
+    // Record this node's throughput (multiply-adds per second) so the next size can be balanced on it
+    if (weights != NULL)
+        UpdateWeights((double)scatter_rows * size * size, computeTime.count(), weights, numtasks, MPI_COMM_WORLD);
+
+    FreeMatrix(m1_sub);
+    FreeMatrix(m3_sub);
+}
+
+// | ------------------------------------------------------ |
+// | SUMMA (2D process grid)								|
+// | ------------------------------------------------------ |
+// The processes are arranged in a pr x pc grid and every matrix is split into pr x pc blocks, so each node only ever holds one block of m1,
+// m2 and m3. The matrix is padded with zeros up to a multiple of lcm(pr, pc) so that the shared inner dimension can be cut into panels that
+// line up with both the column blocks of m1 and the row blocks of m2.
+
+// Define struct to hold the layout of the process grid and the blocks owned by this node
+struct ProcessGrid
+{
+	MPI_Comm gridComm;
+	MPI_Comm rowComm;
+	MPI_Comm colComm;
+	MPI_Comm depthComm;
+	MPI_Comm cartComm;
+	int dims[2];
+	int coords[2];
+	int layers;
+	int layer;
+	int padded;
+	int blockRows;
+	int blockCols;
+};
+
+// This function creates the 2D cartesian communicator plus the row and column sub-communicators used for the panel broadcasts
+void CreateProcessGrid(ProcessGrid &grid, int size, int numtasks)
+{
+	int periods[2] = { 0, 0 };
+	int keepCols[2] = { 0, 1 };
+	int keepRows[2] = { 1, 0 };
+	int gridRank;
+
+	// Let MPI pick the most square grid for the amount of nodes available
+	grid.dims[0] = 0;
+	grid.dims[1] = 0;
+	MPI_Dims_create(numtasks, 2, grid.dims);
+
+	// Reordering is disabled so the master keeps rank 0 (and grid coordinates 0,0)
+	MPI_Cart_create(MPI_COMM_WORLD, 2, grid.dims, periods, 0, &grid.gridComm);
+	MPI_Comm_rank(grid.gridComm, &gridRank);
+	MPI_Cart_coords(grid.gridComm, gridRank, 2, grid.coords);
+
+	// Nodes in the same grid row share rowComm (ranked by column) and nodes in the same grid column share colComm (ranked by row)
+	MPI_Cart_sub(grid.gridComm, keepCols, &grid.rowComm);
+	MPI_Cart_sub(grid.gridComm, keepRows, &grid.colComm);
+
+	// Pad the matrix so it divides evenly into both grid dimensions
+	int multiple = LowestCommonMultiple(grid.dims[0], grid.dims[1]);
+	grid.padded = ((size + multiple - 1) / multiple) * multiple;
+	grid.blockRows = grid.padded / grid.dims[0];
+	grid.blockCols = grid.padded / grid.dims[1];
+
+	// SUMMA uses a single layer with no replication
+	grid.depthComm = MPI_COMM_NULL;
+	grid.cartComm = MPI_COMM_NULL;
+	grid.layers = 1;
+	grid.layer = 0;
+}
+
+// This function releases the communicators created for the process grid
+void FreeProcessGrid(ProcessGrid &grid)
+{
+	MPI_Comm_free(&grid.rowComm);
+	MPI_Comm_free(&grid.colComm);
+	MPI_Comm_free(&grid.gridComm);
+	if (grid.depthComm != MPI_COMM_NULL)
+		MPI_Comm_free(&grid.depthComm);
+	if (grid.cartComm != MPI_COMM_NULL)
+		MPI_Comm_free(&grid.cartComm);
+}
+
+// This function populates the local block of a distributed matrix with random integers less than 10, leaving the padding as zeros
+template <typename T>
+void PopulateBlock(T** block, ProcessGrid &grid, int size)
+{
+	for (int i = 0; i < grid.blockRows; i++)
+	{
+		int globalRow = grid.coords[0] * grid.blockRows + i;
+		for (int j = 0; j < grid.blockCols; j++)
+		{
+			int globalCol = grid.coords[1] * grid.blockCols + j;
+			block[i][j] = (globalRow < size && globalCol < size) ? rand() % 10 : 0;
+		}
+	}
+}
+
+// This function multiplies a panel of m1 with a panel of m2 and accumulates the result into the local block of m3
+template <typename T>
+void MultiplyAccumulate(T** panel1, T** panel2, T** block3, int rows, int cols, int inner)
 {
 	for (int i = 0; i < rows; i++)
 	{
-		for (int j = 0; j < size; j++)
+		for (int k = 0; k < inner; k++)
+		{
+			T a = panel1[i][k];
+			for (int j = 0; j < cols; j++)
+			{
+				block3[i][j] += a * panel2[k][j];
+			}
+		}
+	}
+}
+
+// This function collects the blocks of a distributed matrix onto the master so it can be printed (only the unpadded region is kept). It is
+// only used for verification output so its traffic is not included in bytesCommunicated
+template <typename T>
+void GatherBlocks(T** block, T** &matrix, ProcessGrid &grid, int size, int numtasks, int rank)
+{
+	int blockSize = grid.blockRows * grid.blockCols;
+	T *blocks = NULL;
+
+	if (rank == masterRank)
+	{
+		InitialiseMatrix(matrix, size, size, size);
+		blocks = (T*)malloc(numtasks * blockSize * sizeof(T));
+	}
+
+	MPI_Gather(&block[0][0], blockSize, MPI_ELEMENT, blocks, blockSize, MPI_ELEMENT, masterRank, grid.gridComm);
+
+	if (rank == masterRank)
+	{
+		// Place each node's block back into its position in the full matrix
+		for (int p_id = 0; p_id < numtasks; p_id++)
+		{
+			int coords[2];
+			MPI_Cart_coords(grid.gridComm, p_id, 2, coords);
+			for (int i = 0; i < grid.blockRows; i++)
+			{
+				int globalRow = coords[0] * grid.blockRows + i;
+				for (int j = 0; j < grid.blockCols; j++)
+				{
+					int globalCol = coords[1] * grid.blockCols + j;
+					if (globalRow < size && globalCol < size)
+						matrix[globalRow][globalCol] = blocks[(p_id * blockSize) + (i * grid.blockCols) + j];
+				}
+			}
+		}
+		free(blocks);
+	}
+}
+
+// This function multiplies two matrices with SUMMA, where every node generates and keeps only its own block of m1, m2 and m3. On each step
+// the owners of the current panel broadcast it along their grid row (m1) and grid column (m2), so communication per node is O(n^2 / sqrt(p))
+void RunSUMMA(Element** &m1, Element** &m2, Element** &m3, int size, int numtasks, int rank)
+{
+	ProcessGrid grid;
+	CreateProcessGrid(grid, size, numtasks);
+
+	// Width of each panel along the shared dimension (divides both blockRows and blockCols)
+	int panelWidth = grid.padded / LowestCommonMultiple(grid.dims[0], grid.dims[1]);
+	int panels = grid.padded / panelWidth;
+
+	// Allocate the local blocks and the panel buffers used for the broadcasts
+	Element **m1_block, **m2_block, **m3_block;
+	Element **m1_panel, **m2_panel;
+	InitialiseMatrix(m1_block, grid.blockRows, grid.blockCols, grid.blockRows);
+	InitialiseMatrix(m2_block, grid.blockRows, grid.blockCols, grid.blockRows);
+	InitialiseMatrix(m3_block, grid.blockRows, grid.blockCols, grid.blockRows);
+	InitialiseMatrix(m1_panel, grid.blockRows, panelWidth, grid.blockRows);
+	InitialiseMatrix(m2_panel, panelWidth, grid.blockCols, panelWidth);
+
+	// Give every node its own random sequence so the blocks differ, then populate locally (no node ever holds a full matrix)
+	srand(time(0) + rank);
+	PopulateBlock(m1_block, grid, size);
+	PopulateBlock(m2_block, grid, size);
+	for (int i = 0; i < grid.blockRows * grid.blockCols; i++)
+		m3_block[0][i] = 0;
+
+	for (int p = 0; p < panels; p++)
+	{
+		// Find the global column of m1 (and row of m2) where this panel starts, plus which grid column/row owns it
+		int panelStart = p * panelWidth;
+		int ownerCol = panelStart / grid.blockCols;
+		int ownerRow = panelStart / grid.blockRows;
+
+		// The owner copies its slice of m1 into the panel buffer, then broadcasts it across the grid row
+		if (grid.coords[1] == ownerCol)
+		{
+			int offset = panelStart % grid.blockCols;
+			for (int i = 0; i < grid.blockRows; i++)
+			{
+				for (int k = 0; k < panelWidth; k++)
+				{
+					m1_panel[i][k] = m1_block[i][offset + k];
+				}
+			}
+		}
+		CountedBcast(&m1_panel[0][0], grid.blockRows * panelWidth, MPI_ELEMENT, ownerCol, grid.rowComm);
+
+		// Rows of m2 are contiguous so the owner copies them straight into the panel buffer, then broadcasts it down the grid column
+		if (grid.coords[0] == ownerRow)
 		{
-			matrix3[i][j] = 0;
-			for (int k = 0; k < size; k++)
+			int offset = panelStart % grid.blockRows;
+			for (int k = 0; k < panelWidth * grid.blockCols; k++)
 			{
-				matrix3[i][j] += matrix1[i][k] * matrix2[k][j];
+				m2_panel[0][k] = m2_block[offset][k];
 			}
 		}
+		CountedBcast(&m2_panel[0][0], panelWidth * grid.blockCols, MPI_ELEMENT, ownerRow, grid.colComm);
+
+		// Accumulate the contribution of this panel into the local block of m3
+		MultiplyAccumulate(m1_panel, m2_panel, m3_block, grid.blockRows, grid.blockCols, panelWidth);
+	}
+
+	// Only assemble the full matrices on the master when they are small enough to be printed
+	if (size <= 9)
+	{
+		GatherBlocks(m1_block, m1, grid, size, numtasks, rank);
+		GatherBlocks(m2_block, m2, grid, size, numtasks, rank);
+		GatherBlocks(m3_block, m3, grid, size, numtasks, rank);
+	}
+
+	FreeMatrix(m1_block);
+	FreeMatrix(m2_block);
+	FreeMatrix(m3_block);
+	FreeMatrix(m1_panel);
+	FreeMatrix(m2_panel);
+	FreeProcessGrid(grid);
+}
+
+// | ------------------------------------------------------ |
+// | Cannon / 2.5D (replicated square grid)					|
+// | ------------------------------------------------------ |
+// The nodes are arranged in a q x q x c grid, where each of the c layers holds a full copy of m1 and m2 split into q x q blocks. Layer l
+// performs q / c of the q Cannon shift-multiply steps (starting l * q / c steps in), then the partial m3 blocks are summed onto layer 0.
+// Replicating the inputs c times cuts the words each node sends by a factor of sqrt(c) compared to Cannon, which is simply the c = 1 case.
+// Nodes that do not fit into the grid (when numtasks is not q * q * c) sit idle.
+
+// This function picks the amount of layers for the 2.5D algorithm that keeps the most nodes busy (preferring more replication on ties)
+int ChooseLayers(int numtasks)
+{
+	int bestLayers = 1;
+	int bestUsed = 0;
+	for (int c = 1; c * c * c <= numtasks; c++)
+	{
+		int q = (int)sqrt((double)(numtasks / c));
+		q -= q % c;
+		if (q > 0 && q * q * c >= bestUsed)
+		{
+			bestUsed = q * q * c;
+			bestLayers = c;
+		}
+	}
+	return bestLayers;
+}
+
+// This function creates the q x q x c periodic grid used by Cannon and 2.5D (returns false on nodes that are left out of the grid)
+bool CreateReplicatedGrid(ProcessGrid &grid, int size, int numtasks, int rank, int layers)
+{
+	// Find the largest square grid per layer where the amount of steps (q) divides evenly between the layers
+	int q = (int)sqrt((double)(numtasks / layers));
+	q -= q % layers;
+
+	// Split off the nodes that take part in the grid (MPI_Comm_split keeps the master as rank 0)
+	MPI_Comm activeComm;
+	bool active = rank < q * q * layers;
+	MPI_Comm_split(MPI_COMM_WORLD, active ? 0 : MPI_UNDEFINED, rank, &activeComm);
+	if (!active)
+		return false;
+
+	int dims[3] = { q, q, layers };
+	int periods[3] = { 1, 1, 0 };
+	int coords[3];
+	int cartRank;
+	int keepLayer[3] = { 1, 1, 0 };
+	int keepCols[3] = { 0, 1, 0 };
+	int keepRows[3] = { 1, 0, 0 };
+	int keepDepth[3] = { 0, 0, 1 };
+
+	MPI_Cart_create(activeComm, 3, dims, periods, 0, &grid.cartComm);
+	MPI_Comm_free(&activeComm);
+	MPI_Comm_rank(grid.cartComm, &cartRank);
+	MPI_Cart_coords(grid.cartComm, cartRank, 3, coords);
+
+	// gridComm is this node's layer, rowComm/colComm are the periodic rings used for the shifts, and depthComm links the copies of a block
+	MPI_Cart_sub(grid.cartComm, keepLayer, &grid.gridComm);
+	MPI_Cart_sub(grid.cartComm, keepCols, &grid.rowComm);
+	MPI_Cart_sub(grid.cartComm, keepRows, &grid.colComm);
+	MPI_Cart_sub(grid.cartComm, keepDepth, &grid.depthComm);
+
+	grid.dims[0] = q;
+	grid.dims[1] = q;
+	grid.coords[0] = coords[0];
+	grid.coords[1] = coords[1];
+	grid.layers = layers;
+	grid.layer = coords[2];
+
+	// Pad the matrix so it divides evenly into q x q square blocks
+	grid.padded = ((size + q - 1) / q) * q;
+	grid.blockRows = grid.padded / q;
+	grid.blockCols = grid.blockRows;
+	return true;
+}
+
+// This function multiplies two matrices with Cannon's algorithm (layers = 1) or its 2.5D replicated variant (layers > 1)
+void RunCannon25D(Element** &m1, Element** &m2, Element** &m3, int size, int numtasks, int rank, int layers)
+{
+	ProcessGrid grid;
+	if (!CreateReplicatedGrid(grid, size, numtasks, rank, layers))
+		return;
+
+	int q = grid.dims[0];
+	int blockSize = grid.blockRows * grid.blockCols;
+
+	// Allocate the local blocks (a partial m3 is accumulated on every layer)
+	Element **m1_block, **m2_block, **m3_block, **m3_sum;
+	InitialiseMatrix(m1_block, grid.blockRows, grid.blockCols, grid.blockRows);
+	InitialiseMatrix(m2_block, grid.blockRows, grid.blockCols, grid.blockRows);
+	InitialiseMatrix(m3_block, grid.blockRows, grid.blockCols, grid.blockRows);
+	InitialiseMatrix(m3_sum, grid.blockRows, grid.blockCols, grid.blockRows);
+	for (int i = 0; i < blockSize; i++)
+		m3_block[0][i] = 0;
+
+	// Only the front layer generates its blocks, which are then replicated to the layers behind it
+	unsigned int seed = time(0) + rank;
+	if (grid.layer == 0)
+	{
+		srand(seed);
+		PopulateBlock(m1_block, grid, size);
+		PopulateBlock(m2_block, grid, size);
+	}
+	if (grid.layers > 1)
+	{
+		CountedBcast(&m1_block[0][0], blockSize, MPI_ELEMENT, 0, grid.depthComm);
+		CountedBcast(&m2_block[0][0], blockSize, MPI_ELEMENT, 0, grid.depthComm);
+	}
+
+	// Each layer handles a contiguous range of the q steps
+	int steps = q / grid.layers;
+	int offset = grid.layer * steps;
+
+	// Initial alignment: block row i of m1 shifts left by i (+ layer offset) and block column j of m2 shifts up by j (+ layer offset)
+	CountedShift(&m1_block[0][0], blockSize, MPI_ELEMENT, -(grid.coords[0] + offset), grid.rowComm);
+	CountedShift(&m2_block[0][0], blockSize, MPI_ELEMENT, -(grid.coords[1] + offset), grid.colComm);
+
+	for (int step = 0; step < steps; step++)
+	{
+		// Accumulate the aligned blocks, then pass m1 one block left and m2 one block up (the last shift is not needed)
+		MultiplyAccumulate(m1_block, m2_block, m3_block, grid.blockRows, grid.blockCols, grid.blockRows);
+		if (step < steps - 1)
+		{
+			CountedShift(&m1_block[0][0], blockSize, MPI_ELEMENT, -1, grid.rowComm);
+			CountedShift(&m2_block[0][0], blockSize, MPI_ELEMENT, -1, grid.colComm);
+		}
+	}
+
+	// Sum the partial results of every layer onto the front layer
+	if (grid.layers > 1)
+		CountedReduce(&m3_block[0][0], &m3_sum[0][0], blockSize, MPI_ELEMENT, 0, grid.depthComm);
+	else
+		swap(m3_block, m3_sum);
+
+	// Only assemble the full matrices on the master when they are small enough to be printed (m1 and m2 have been shifted so they are
+	// regenerated from the same seed for display)
+	if (size <= 9 && grid.layer == 0)
+	{
+		srand(seed);
+		PopulateBlock(m1_block, grid, size);
+		PopulateBlock(m2_block, grid, size);
+		GatherBlocks(m1_block, m1, grid, size, q * q, rank);
+		GatherBlocks(m2_block, m2, grid, size, q * q, rank);
+		GatherBlocks(m3_sum, m3, grid, size, q * q, rank);
 	}
+
+	FreeMatrix(m1_block);
+	FreeMatrix(m2_block);
+	FreeMatrix(m3_block);
+	FreeMatrix(m3_sum);
+	FreeProcessGrid(grid);
 }
 
-// Main execution function that manages the sequence of execution
+// | ------------------------------------------------------ |
+// | Main													|
+// | ------------------------------------------------------ |
+// Main execution function that manages the sequence of execution. The multiplication algorithm can be selected with the first argument:
+//   rows   - scatter rows of m1 and broadcast all of m2 (default)
+//   summa  - 2D block distribution using the SUMMA algorithm
+//   cannon - Cannon's algorithm on a q x q periodic grid
+//   2.5d   - Cannon replicated over c layers (c can be given as the second argument, otherwise it is chosen from numtasks)
 int main(int argc, char** argv)
 {
 	// Initalise MPI variables 
@@ -107,110 +680,61 @@ int main(int argc, char** argv)
 	// Get the rank
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
+    // Read the algorithm to use from the command line
+    string algorithm = (argc > 1) ? argv[1] : "rows";
+    if (algorithm != "rows" && algorithm != "summa" && algorithm != "cannon" && algorithm != "2.5d")
+    {
+        if (rank == masterRank)
+            cout << "Unknown algorithm '" << algorithm << "' (expected rows, summa, cannon or 2.5d)" << endl;
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Work out how many replication layers to use (Cannon is the single layer case)
+    int layers = 1;
+    if (algorithm == "2.5d")
+    {
+        layers = (argc > 2) ? atoi(argv[2]) : ChooseLayers(numtasks);
+        if (layers < 1 || layers * layers * layers > numtasks)
+            layers = ChooseLayers(numtasks);
+        if (rank == masterRank)
+            cout << "Using " << layers << " replication layer(s)" << endl;
+    }
+
+    // Report the element type the program was compiled for
+    if (rank == masterRank)
+        cout << "Element type: " << ElementTraits<Element>::Name() << endl;
+
     // Define sizes of matrices
     int n_sizes[] = { 1, 10, 50, 100, 500, 1000 };
 
+    // Start with every node weighted equally (only used when WEIGHTED_PARTITION is on)
+    double weights[numtasks];
+    fill_n(weights, numtasks, 1.0);
+
     for (int size : n_sizes)
     {
         // Generate random seed using time
         srand(time(0)); 
-        
-        // Get the count of data to be broadcasted for a single matrix
-        int broadcast_size = size * size;
-        // Calculate how many rows to send to each node
-        int scatter_rows = size / numtasks;
-        // Create an array to store how much data to send across to each node
-        int sendcounts[numtasks];
-        // Create an array to store the displacement values used for keeping track of data sent for each node
-        int displs[numtasks];
-        // Increment variable to store the most recent displacement value
-        int increment = 0;
-
-        // Create two sub-matrices for internal processing of each node (m2_sub not needed since m2 will be broadcasted)
-        int **m1_sub;
-        int **m3_sub;
 
         // Create main matrices for the two inputs and outputs
-        int **m1;
-        int **m2;
-        int **m3;
+        Element **m1;
+        Element **m2;
+        Element **m3;
+
+        // Reset the communication counter for this size
+        bytesCommunicated = 0;
 
         // Take current time before executing multiplcation
         auto start = high_resolution_clock::now();
 
-        // If running on the master...
-        if (rank == masterRank)
-        {
-            // Allocate memory to all main matrices
-            InitialiseMatrix(m1, size, size, size);
-            InitialiseMatrix(m2, size, size, size);
-            InitialiseMatrix(m3, size, size, size);
-
-            // Populate input matrices with random values
-            PopulateMatrix(m1, size, size);
-            PopulateMatrix(m2, size, size);
-            
-            // Determine the sendcounts and displacement values for each task
-            for (int p_id = 0; p_id < numtasks; p_id++)
-            {
-                displs[p_id] = increment;
-                if (size % numtasks != 0 && p_id == 0)
-                {
-                    // If the size is not divisible by the amount of nodes, the master node will manage the remaining row(s)
-                    scatter_rows += (size % numtasks);
-                    sendcounts[p_id] = scatter_rows * size;
-                }
-                else
-                    sendcounts[p_id] = scatter_rows * size;
-                increment += sendcounts[p_id];
-            }
-
-            // Allocate memory for the sub matrices
-            InitialiseMatrix(m1_sub, scatter_rows, size, size);
-            InitialiseMatrix(m3_sub, scatter_rows, size, size);
-
-            // Scatter data from the m1 matrix into the m1_sub matrices for all nodes using distinct sendcount values
-            MPI_Scatterv(&m1[0][0], sendcounts, displs, MPI_INT, &m1_sub[0][0], sendcounts[rank], MPI_INT, masterRank, MPI_COMM_WORLD);
-            // Broadcast the entire m2 matrix to all nodes
-            MPI_Bcast(&m2[0][0], broadcast_size, MPI_INT, masterRank, MPI_COMM_WORLD);
-
-            // Multiply the m1_sub and m2 matrices and store result in m3_sub (note only need to calculate the count of rows sent to the node)
-            MultiplyMatrices(m1_sub, m2, m3_sub, scatter_rows, size);
-
-            // Gather the m3_sub results from all nodes (taking into account their respective sendcount value) and store in m3
-            MPI_Gatherv(&m3_sub[0][0], sendcounts[rank], MPI_INT, &m3[0][0], sendcounts, displs, MPI_INT, masterRank, MPI_COMM_WORLD);
-        }
+        // Multiply the matrices using the selected algorithm
+        if (algorithm == "summa")
+            RunSUMMA(m1, m2, m3, size, numtasks, rank);
+        else if (algorithm == "cannon" || algorithm == "2.5d")
+            RunCannon25D(m1, m2, m3, size, numtasks, rank, layers);
         else
-        {
-            // Determine the sendcounts and displacement values for each task
-            for (int p_id = 0; p_id < numtasks; p_id++)
-            {
-                displs[p_id] = increment;
-                if (size % numtasks != 0 && p_id == 0)
-                {
-                    scatter_rows += (size % numtasks);
-                    sendcounts[p_id] = scatter_rows * size;
-                }
-                else
-                    sendcounts[p_id] = scatter_rows * size;
-                increment += sendcounts[p_id];
-            }
-            
-            // Allocate memory for the sub matrices and for m2
-            InitialiseMatrix(m1_sub, scatter_rows, size, size);
-            InitialiseMatrix(m2, size, size, size);
-            InitialiseMatrix(m3_sub, scatter_rows, size, size);
-
-            // Receive data from the m1 matrix on master node and store into m1_sub matrix
-            MPI_Scatterv(NULL, sendcounts, displs, MPI_INT, &m1_sub[0][0], sendcounts[rank], MPI_INT, masterRank, MPI_COMM_WORLD);
-            // Recieve broadcast from the m2 matrix on master
-            MPI_Bcast(&m2[0][0], broadcast_size, MPI_INT, masterRank, MPI_COMM_WORLD);
-
-            // Multiply the m1_sub and m2 matrices and store result in m3_sub (note only need to calculate the count of rows sent to the node)
-            MultiplyMatrices(m1_sub, m2, m3_sub, scatter_rows, size);
-            // Send the m3_sub results to m3 in master
-            MPI_Gatherv(&m3_sub[0][0], sendcounts[rank], MPI_INT, NULL, sendcounts, displs, MPI_INT, masterRank, MPI_COMM_WORLD);
-        }
+            RunRowPartitioned(m1, m2, m3, size, numtasks, rank, WEIGHTED_PARTITION ? weights : NULL);
 
         // Retrieve finish time
         auto stop = high_resolution_clock::now();
@@ -218,6 +742,10 @@ int main(int argc, char** argv)
         // Calculation durations and cast to microseconds
         auto duration = duration_cast<microseconds>(stop - start);
 
+        // Collect the bytes each node communicated so the master can report them
+        long long bytesPerRank[numtasks];
+        MPI_Gather(&bytesCommunicated, 1, MPI_LONG_LONG, bytesPerRank, 1, MPI_LONG_LONG, masterRank, MPI_COMM_WORLD);
+
         // Print total time taken on head node
         if (rank == masterRank)
         {
@@ -225,7 +753,16 @@ int main(int argc, char** argv)
             if (size <= 9)
                 PrintEquation(m1, m2, m3, size, true);
 
-            cout << "Time taken to multiply matrices of size " << size << ": " << duration.count() << " microseconds" << endl;
+            cout << "Time taken to multiply matrices of size " << size << " (" << algorithm << "): " << duration.count() << " microseconds" << endl;
+
+            // Print the maximum and mean bytes communicated per rank
+            long long maxBytes = 0, totalBytes = 0;
+            for (int p_id = 0; p_id < numtasks; p_id++)
+            {
+                maxBytes = max(maxBytes, bytesPerRank[p_id]);
+                totalBytes += bytesPerRank[p_id];
+            }
+            cout << "Bytes communicated per rank: max " << maxBytes << ", mean " << (totalBytes / numtasks) << endl;
         }
     }	
 	// Finalize the MPI environment
@@ -1,14 +1,85 @@
 // This function computes the multiplication of two matrices and stores the result in a third. It is executed by a kernel that resides with in the
 // OpenGL program variable. The instructions are fed via a queue.
+//
+// matrix1 is rows x size, matrix2 is size x size and matrix3 is rows x size. Each work-group computes one TS x TS tile of matrix3 by stepping
+// along the shared dimension one tile at a time: the group first copies a TS x TS tile of matrix1 and of matrix2 into __local memory, then every
+// work-item accumulates WPT results (one column, WPT rows spaced TS / WPT apart) in registers. Each work-item writes its results exactly once,
+// so there are no races on matrix3. TS and WPT are passed in by the host as build options (-DTS=.. -DWPT=..) based on the device limits.
+//
+// The host may stream matrix1 and matrix3 through the device in strips of rows, so each launch only covers rows firstRow to rows - 1.
 
-__kernel void matrix_multiply(const __global int* matrix1, const __global int* matrix2, __global int* matrix3, const int size)
+// The element type T is also passed in by the host (-DT=int, long, float or double), and doubles need the fp64 extension
+#ifndef T
+#define T int
+#endif
+#ifdef T_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef TS
+#define TS 16
+#endif
+#ifndef WPT
+#define WPT 4
+#endif
+
+// Rows of the tile handled per pass by the work-group (the local size in dimension 1)
+#define RTS (TS / WPT)
+
+__kernel void matrix_multiply(const __global T* matrix1, const __global T* matrix2, __global T* matrix3, const int firstRow, const int rows, const int size)
 {
-	// Get row, col and size values from global array
-	const int i = get_global_id(0);
-	const int j = get_global_id(1);
-	const int k = get_global_id(2);
- 
-	// Compute and store the mulitplication result into the output matrix memory
-    matrix3[(i * size) + j] += matrix1[(i * size) + k] * matrix2[(k * size) + j];
+	// Get the position of the work-item within its tile (dimension 0 is the column so neighbouring work-items read neighbouring memory)
+	const int localCol = get_local_id(0);
+	const int localRow = get_local_id(1);
+
+	// Get the column this work-item computes and the first row of the tile handled by its work-group
+	const int globalCol = (get_group_id(0) * TS) + localCol;
+	const int groupRow = firstRow + (get_group_id(1) * TS);
+
+	// Declare the tiles of the two input matrices shared by the work-group
+	__local T tile1[TS][TS];
+	__local T tile2[TS][TS];
+
+	// Initialise the register block of results
+	T acc[WPT];
+	for (int w = 0; w < WPT; w++)
+		acc[w] = 0;
+
+	const int numTiles = (size + TS - 1) / TS;
+	for (int t = 0; t < numTiles; t++)
+	{
+		// Load one tile of each input into local memory (zero-padding anything past the edge of the matrices)
+		for (int w = 0; w < WPT; w++)
+		{
+			const int tileRow = localRow + (w * RTS);
+			const int row1 = groupRow + tileRow;
+			const int col1 = (t * TS) + localCol;
+			const int row2 = (t * TS) + tileRow;
+
+			tile1[tileRow][localCol] = (row1 < rows && col1 < size) ? matrix1[(row1 * size) + col1] : 0;
+			tile2[tileRow][localCol] = (row2 < size && globalCol < size) ? matrix2[(row2 * size) + globalCol] : 0;
+		}
+
+		// Wait until the whole tile has been loaded
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// Accumulate the products for this tile
+		for (int k = 0; k < TS; k++)
+		{
+			const T b = tile2[k][localCol];
+			for (int w = 0; w < WPT; w++)
+				acc[w] += tile1[localRow + (w * RTS)][k] * b;
+		}
+
+		// Wait until everyone is finished with the tile before it is overwritten
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	// Store the results into the output matrix memory
+	for (int w = 0; w < WPT; w++)
+	{
+		const int row = groupRow + localRow + (w * RTS);
+		if (row < rows && globalCol < size)
+			matrix3[(row * size) + globalCol] = acc[w];
+	}
 }
- 
\ No newline at end of file
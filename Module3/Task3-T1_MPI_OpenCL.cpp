@@ -3,6 +3,11 @@
 #include <cstdlib>
 #include <time.h>
 #include <chrono>
+#include <algorithm>
+#include "Partition.h"
+#include "OpenCLRuntime.h"
+#include "Freivalds.h"
+#include "ElementType.h"
 #include <CL/cl.h>
 
 using namespace std::chrono;
@@ -11,217 +16,335 @@ using namespace std;
 // Set rank of master node to 0
 #define masterRank 0
 
+// Toggle balancing the rows sent to each node by their measured throughput (1) or splitting them evenly (0) (useful when nodes mix GPU and CPU devices)
+#define WEIGHTED_PARTITION 1
+
+// Define how many strips of rows each node's share of m1 is split into, so copying one strip overlaps with multiplying another
+#define PIPELINE_CHUNKS 4
+
+// Toggle splitting each node's rows across every OpenCL device it has (1) or only using the default device (0), and how many equal
+// sub-devices to partition the device into when there is only one (0 or 1 to leave it whole)
+#define MULTI_DEVICE 1
+#define SUB_DEVICES 0
+
+// Define the file the per-size timings (total and device write/kernel/read) are exported to
+#define PROFILE_CSV "results_mpi_opencl.csv"
+
+// Define how many Freivalds rounds check each product after it is computed (0 to skip the check); a wrong product passes all of them with
+// probability at most 1 / 2^rounds
+#define VERIFY_ROUNDS 2
+
 // | ------------------------------------------------------ |
 // | Variable Declaration									|
 // | ------------------------------------------------------ |
-// Delcare memory buffers for all three vectors
-cl_mem bufM1, bufM2, bufM3;
-// Declare variable to store the unique ID of the computational device (GPU, CPU) by a kernel in the program
-cl_device_id device_id;
-// Declare variable to store the environment configuration (devices, memory properties, queues etc.)
-cl_context context;
-// Declare variable to store the set of kernels used for the program
-cl_program program;
-// Declare variable to store the vector addition function which will be executed on a device
-cl_kernel kernel;
-// Declare variable to store the queue of commands to be executed on a specific device
-cl_command_queue queue;
-// Declare variable to store event results
-cl_event event = NULL;
+// Declare the state kept for each OpenCL device this node's rows are split across (every device has its own runtime, since devices from
+// different platforms cannot share a context)
+struct DeviceWork
+{
+	// Runtime that owns the device, context, queues, program, kernel and buffers across every matrix size
+	OpenCLRuntime *runtime;
+	// Matrix multiplication function which will be executed on the device
+	cl_kernel kernel;
+	// In-order queues used to copy data to the device, run the kernel, and copy results back
+	cl_command_queue copyInQueue, queue, copyOutQueue;
+	// Memory buffers for all three matrices
+	cl_mem bufM1, bufM2, bufM3;
+	// Whether the device works directly on host memory (CPU devices), in which case the buffers wrap the host matrices instead of being copied
+	bool zeroCopy;
+	// Tile width and results computed per work-item, chosen from the device limits
+	int tileSize;
+	int workPerThread;
+	// Global and local work sizes of the 2D NDRange
+	size_t global[2];
+	size_t local[2];
+	// The device's share of this node's rows (firstRow to firstRow + rows - 1), and its measured throughput used to size that share
+	int firstRow;
+	int rows;
+	double weight;
+	// Profile that times the device commands of each matrix size
+	QueueProfile profile;
+};
+
+// Declare the devices this node uses and how many there are
+DeviceWork *devices;
+int numDevices;
 // Declare variable to keep track of any errors that occur during program execution
 int err;
 
 // Create two sub-matrices for internal processing of each node (m2_sub not needed since m2 will be broadcasted)
-int *m1_sub;
-int *m3_sub;
+Element *m1_sub;
+Element *m3_sub;
 
 // Create main matrices for the two inputs and outputs
-int *m1;
-int *m2;
-int *m3;
-
-size_t global[3];
+Element *m1;
+Element *m2;
+Element *m3;
 
-cl_device_id create_device()
+// This function creates a runtime for every device on this node (or just the default device when MULTI_DEVICE is off), all weighted equally
+void CreateDevices()
 {
-	cl_platform_id platform;
-	cl_device_id dev;
-	int err;
-
-	/* Identify a platform */
-	err = clGetPlatformIDs(1, &platform, NULL);
-	if(err < 0) 
-	{
-		perror("Couldn't identify a platform");
-		exit(1);
-	} 
-	// Access a device
-	// GPU
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
-	if(err == CL_DEVICE_NOT_FOUND) 
+	vector<cl_device_id> ids;
+	if (MULTI_DEVICE)
+		ids = AllDevices(SUB_DEVICES);
+	else
+		ids.push_back(DefaultDevice());
+
+	numDevices = (int)ids.size();
+	devices = new DeviceWork[numDevices];
+	for (int d = 0; d < numDevices; d++)
 	{
-		// CPU
-		//printf("GPU not found\n");
-		err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
+		devices[d].runtime = new OpenCLRuntime(ids[d]);
+		devices[d].weight = 1.0;
 	}
-	if(err < 0) 
+}
+
+// This function releases every device's runtime
+void DeleteDevices()
+{
+	for (int d = 0; d < numDevices; d++)
 	{
-		perror("Couldn't access any devices");
-		exit(1);   
+		devices[d].profile.Collect();
+		delete devices[d].runtime;
 	}
-	return dev;
+	delete[] devices;
 }
 
-cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename)
+// This function picks the largest tile that fits twice (one tile per input) into the device's local memory, then the register block
+// (results per work-item) needed to keep the work-group within the device's maximum work-group size
+void choose_tile_size(DeviceWork &dev)
 {
+	cl_ulong localMemSize;
+	size_t maxWorkGroupSize;
+	clGetDeviceInfo(dev.runtime->Device(), CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemSize, NULL);
+	clGetDeviceInfo(dev.runtime->Device(), CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+
+	dev.tileSize = 32;
+	while (dev.tileSize > 4 && 2 * dev.tileSize * dev.tileSize * sizeof(Element) > localMemSize)
+		dev.tileSize /= 2;
+
+	dev.workPerThread = 4;
+	while (dev.workPerThread < dev.tileSize && (size_t)(dev.tileSize * (dev.tileSize / dev.workPerThread)) > maxWorkGroupSize)
+		dev.workPerThread *= 2;
+}
 
-	cl_program program;
-	FILE *program_handle;
-	char *program_buffer, *program_log;
-	size_t program_size, log_size;
+void setup_openCL_device_context_queue_kernel(DeviceWork &dev, char *filename, char *kernelname)
+{
+	// Reuse the queues owned by the device's runtime
+	dev.copyInQueue = dev.runtime->Queue(0);
+	dev.queue = dev.runtime->Queue(1);
+	dev.copyOutQueue = dev.runtime->Queue(2);
+	dev.zeroCopy = dev.runtime->ZeroCopy();
+
+	// Choose the tile size for this device and pass it and the element type to the kernel at build time (the runtime only builds the
+	// program for the first size)
+	choose_tile_size(dev);
+	char options[96];
+	snprintf(options, sizeof(options), "-DTS=%d -DWPT=%d %s", dev.tileSize, dev.workPerThread, ElementTraits<Element>::OpenCLOptions());
+	dev.kernel = dev.runtime->Kernel(filename, options, kernelname);
+}
 
-	/* Read program file and place content into buffer */
-	program_handle = fopen(filename, "r");
-	if (program_handle == NULL)
-	{
-		perror("Couldn't find the program file");
-		exit(1);
-	}
-	fseek(program_handle, 0, SEEK_END);
-	program_size = ftell(program_handle);
-	rewind(program_handle);
-	program_buffer = (char *)malloc(program_size + 1);
-	program_buffer[program_size] = '\0';
-	fread(program_buffer, sizeof(char), program_size, program_handle);
-	fclose(program_handle);
-
-	program = clCreateProgramWithSource(ctx, 1, (const char **)&program_buffer, &program_size, &err);
-	if (err < 0)
+void setup_kernel_memory(DeviceWork &dev, int rows, int size)
+{
+	// On a zero-copy device wrap the host matrices themselves (m1_sub and m3_sub always hold at least one row), so nothing is copied
+	if (dev.zeroCopy)
 	{
-		perror("Couldn't create the program");
-		exit(1);
+		int allocRows = max(rows, 1);
+		dev.bufM1 = dev.runtime->WrapHostBuffer(CL_MEM_READ_ONLY, allocRows * size * sizeof(Element), m1_sub);
+		dev.bufM2 = dev.runtime->WrapHostBuffer(CL_MEM_READ_ONLY, size * size * sizeof(Element), m2);
+		dev.bufM3 = dev.runtime->WrapHostBuffer(CL_MEM_WRITE_ONLY, allocRows * size * sizeof(Element), m3_sub);
+		return;
 	}
-	free(program_buffer);
 
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-	if (err < 0)
-	{
+	// Take buffers at least the total size of the sub matrcies from the runtime's pool (each device only fills in its own rows, so row
+	// numbers are the same on every device)
+	dev.bufM1 = dev.runtime->AcquireBuffer(CL_MEM_READ_ONLY, rows * size * sizeof(Element));
+	dev.bufM2 = dev.runtime->AcquireBuffer(CL_MEM_READ_ONLY, size * size * sizeof(Element));
+	dev.bufM3 = dev.runtime->AcquireBuffer(CL_MEM_WRITE_ONLY, rows * size * sizeof(Element));
 
-		/* Find size of log and print to std output */
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-		program_log = (char *)malloc(log_size + 1);
-		program_log[log_size] = '\0';
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, log_size + 1, program_log, NULL);
-		printf("%s\n", program_log);
-		free(program_log);
-		exit(1);
-	}
-	return program;
+	// The inputs are copied to the device in RunOpenCL as part of the pipeline (m3 is never copied since the kernel writes every element)
 }
 
-void setup_openCL_device_context_queue_kernel(char *filename, char *kernelname)
+void copy_kernel_args(DeviceWork &dev, int size)
 {
-	device_id = create_device();
-	cl_int err;
+	// Set kernel arguments needed for the matrix multiplication function (the strip of rows, arguments 3 and 4, is set per launch)
+	clSetKernelArg(dev.kernel, 0, sizeof(cl_mem), (void *)&dev.bufM1);
+	clSetKernelArg(dev.kernel, 1, sizeof(cl_mem), (void *)&dev.bufM2);
+	clSetKernelArg(dev.kernel, 2, sizeof(cl_mem), (void *)&dev.bufM3);
+	err = clSetKernelArg(dev.kernel, 5, sizeof(int), (void *)&size);
 
-	// Create context object to store configuration details for the OpenCL environment
-	context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &err);
 	if (err < 0)
 	{
-		perror("Couldn't create a context");
+		perror("Couldn't create a kernel argument");
+		printf("error = %d", err);
 		exit(1);
 	}
+}
 
-	program = build_program(context, device_id, filename);
-
-	// Create queue and kernel for device
-	queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
-	if (err < 0)
-	{
-		perror("Couldn't create a command queue");
-		exit(1);
-	};
-	kernel = clCreateKernel(program, kernelname, &err);
-	if (err < 0)
+void FreeMemory()
+{
+	// Hand the buffers back to each runtime's pool so the next size can reuse them (the device, context, queue and kernel are kept by the
+	// runtime until the end of the program). Buffers wrapping host matrices are tied to them, so they are released instead
+	for (int d = 0; d < numDevices; d++)
 	{
-		perror("Couldn't create a kernel");
-		printf("error =%d", err);
-		exit(1);
-	};
+		DeviceWork &dev = devices[d];
+		if (dev.zeroCopy)
+		{
+			clReleaseMemObject(dev.bufM1);
+			clReleaseMemObject(dev.bufM2);
+			clReleaseMemObject(dev.bufM3);
+			continue;
+		}
+		dev.runtime->ReleaseBuffer(dev.bufM1);
+		dev.runtime->ReleaseBuffer(dev.bufM2);
+		dev.runtime->ReleaseBuffer(dev.bufM3);
+	}
 }
 
-void setup_kernel_memory(int rows, int size)
+// This function checks this node's rows of the product with Freivalds' algorithm before they are gathered, and returns how many rows
+// failed across every node. The nodes first wait for each other to finish multiplying, so the time taken only covers the check
+int VerifyProduct(int rows, int size, microseconds &elapsed)
 {
-	// Create a space in memory for the buffer variables equal to the total size of the sub matrcies
-	bufM1 = clCreateBuffer(context, CL_MEM_READ_ONLY, rows * size * sizeof(int), NULL, NULL);
-	bufM2 = clCreateBuffer(context, CL_MEM_READ_ONLY, size * size * sizeof(int), NULL, NULL);
-	bufM3 = clCreateBuffer(context, CL_MEM_WRITE_ONLY, rows * size * sizeof(int), NULL, NULL);
-
-	// Copy matrices to the devices
-	clEnqueueWriteBuffer(queue, bufM1, CL_TRUE, 0, rows * size * sizeof(int), &m1_sub[0], 0, NULL, NULL);
-	clEnqueueWriteBuffer(queue, bufM2, CL_TRUE, 0, size * size * sizeof(int), &m2[0], 0, NULL, NULL);
-	clEnqueueWriteBuffer(queue, bufM3, CL_TRUE, 0, rows * size * sizeof(int), &m3_sub[0], 0, NULL, NULL);
+	MPI_Barrier(MPI_COMM_WORLD);
+	auto verifyStart = high_resolution_clock::now();
+	int failedRows = FreivaldsVerify(m1_sub, m2, m3_sub, rows, size, VERIFY_ROUNDS, masterRank, MPI_COMM_WORLD);
+	elapsed = duration_cast<microseconds>(high_resolution_clock::now() - verifyStart);
+	return failedRows;
 }
 
-void copy_kernel_args(int size)
+// This function sets up the OpenCL environment of every device before enqueueing, and splits the rows across them by their weights
+void SetupOpenCL(int rows, int cols, int size)
 {
-	// Set kernel arguments needed for the matrix multiplication function
-	clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&bufM1);
-	clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&bufM2);
-	clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&bufM3);
-	clSetKernelArg(kernel, 3, sizeof(int), (void *)&size);
+	int firsts[numDevices], counts[numDevices];
+	double weights[numDevices];
+	for (int d = 0; d < numDevices; d++)
+		weights[d] = devices[d].weight;
+	SplitWork(firsts, counts, rows, numDevices, weights);
 
-	if (err < 0)
+	for (int d = 0; d < numDevices; d++)
 	{
-		perror("Couldn't create a kernel argument");
-		printf("error = %d", err);
-		exit(1);
+		DeviceWork &dev = devices[d];
+		dev.firstRow = firsts[d];
+		dev.rows = counts[d];
+
+		//Setup the OpenGL environment using the handler functions declared above
+		setup_openCL_device_context_queue_kernel(dev, (char *)"./Task3-T1_MPI_OpenCL.cl", (char *)"matrix_multiply");
+		setup_kernel_memory(dev, rows, size);
+		copy_kernel_args(dev, size);
+
+		// Define the 2D NDRange: one work-group per tile of m3, each work-item covering one column and workPerThread rows of its tile
+		// (the global size is rounded up to whole tiles, the kernel skips anything outside the matrix). The rows covered (global[1]) are
+		// set for each strip in RunOpenCL
+		dev.local[0] = (size_t)dev.tileSize;
+		dev.local[1] = (size_t)(dev.tileSize / dev.workPerThread);
+		dev.global[0] = (size_t)(((cols + dev.tileSize - 1) / dev.tileSize) * dev.tileSize);
 	}
 }
 
-void FreeMemory()
+// This function launches the kernel over a strip of rows (firstRow to lastRow - 1) on one device
+void EnqueueStrip(DeviceWork &dev, int firstRow, int lastRow, cl_uint numWaits, const cl_event *waits, cl_event *multiplied)
 {
-	// Free the buffers
-	clReleaseMemObject(bufM1);
-	clReleaseMemObject(bufM2);
-	clReleaseMemObject(bufM3);
-
-	// Free OpenCL objects
-	clReleaseKernel(kernel);
-	clReleaseCommandQueue(queue);
-	clReleaseProgram(program);
-	clReleaseContext(context);
+	// The kernel keeps the arguments it was enqueued with, so the strip can be changed for the next launch straight away
+	clSetKernelArg(dev.kernel, 3, sizeof(int), (void *)&firstRow);
+	clSetKernelArg(dev.kernel, 4, sizeof(int), (void *)&lastRow);
+	dev.global[1] = (size_t)(((lastRow - firstRow + dev.tileSize - 1) / dev.tileSize) * dev.local[1]);
+	clEnqueueNDRangeKernel(dev.queue, dev.kernel, 2, NULL, dev.global, dev.local, numWaits, waits, multiplied);
 }
 
-// This function sets up the OpenCL environment before enqueueing
-void SetupOpenCL(int rows, int cols, int size)
+// This function enqueues one device's share of the rows, streamed through the device in strips. Each strip of m1 is copied in on one
+// queue, multiplied on a second and its strip of m3 copied out on a third, with events ordering the three steps, so the copies of one strip
+// overlap with the kernel of another. None of the commands block
+void EnqueueDevice(DeviceWork &dev, int cols)
 {
-	// Define variable to store the number of work items per dimension in the work-group
-	global[0] = (size_t)rows;
-    global[1] = (size_t)cols;
-    global[2] = (size_t)size;
-
-	//Setup the OpenGL environment using the handler functions declared above
-	setup_openCL_device_context_queue_kernel((char *)"./Task3-T1_MPI_OpenCL.cl", (char *)"matrix_multiply");
-	setup_kernel_memory(rows, size);
-	copy_kernel_args(size);
+	int endRow = dev.firstRow + dev.rows;
+
+	// On a zero-copy device the kernel already reads and writes the host matrices, so there is nothing to stream: launch it over every row
+	// and map this device's rows of m3 (which only makes the results visible to the host rather than copying them)
+	if (dev.zeroCopy)
+	{
+		if (dev.rows == 0)
+			return;
+
+		EnqueueStrip(dev, dev.firstRow, endRow, 0, NULL, dev.profile.Track());
+		size_t offset = (size_t)dev.firstRow * cols * sizeof(Element);
+		size_t bytes = (size_t)dev.rows * cols * sizeof(Element);
+		cl_event mapped;
+		void *results = clEnqueueMapBuffer(dev.queue, dev.bufM3, CL_FALSE, CL_MAP_READ, offset, bytes, 0, NULL, &mapped, &err);
+		clEnqueueUnmapMemObject(dev.queue, dev.bufM3, results, 1, &mapped, NULL);
+		dev.profile.Add(mapped);
+		clReleaseEvent(mapped);
+		clFlush(dev.queue);
+		return;
+	}
+
+	// Copy m2 first, every strip's kernel waits for it
+	cl_event m2Written;
+	clEnqueueWriteBuffer(dev.copyInQueue, dev.bufM2, CL_FALSE, 0, cols * cols * sizeof(Element), &m2[0], 0, NULL, &m2Written);
+
+	// Split the rows into strips of whole tiles
+	int stripRows = (dev.rows + PIPELINE_CHUNKS - 1) / PIPELINE_CHUNKS;
+	stripRows = max(((stripRows + dev.tileSize - 1) / dev.tileSize) * dev.tileSize, dev.tileSize);
+
+	for (int firstRow = dev.firstRow; firstRow < endRow; firstRow += stripRows)
+	{
+		int lastRow = min(firstRow + stripRows, endRow);
+		size_t offset = (size_t)firstRow * cols * sizeof(Element);
+		size_t bytes = (size_t)(lastRow - firstRow) * cols * sizeof(Element);
+		cl_event waits[2] = { m2Written, NULL };
+		cl_event multiplied;
+
+		clEnqueueWriteBuffer(dev.copyInQueue, dev.bufM1, CL_FALSE, offset, bytes, &m1_sub[firstRow * cols], 0, NULL, &waits[1]);
+		EnqueueStrip(dev, firstRow, lastRow, 2, waits, &multiplied);
+		clEnqueueReadBuffer(dev.copyOutQueue, dev.bufM3, CL_FALSE, offset, bytes, &m3_sub[firstRow * cols], 1, &multiplied, dev.profile.Track());
+
+		// The queues keep their own references to events they still wait on, so these can be released straight away (the profile keeps
+		// its own reference too, to time them afterwards)
+		dev.profile.Add(waits[1]);
+		dev.profile.Add(multiplied);
+		clReleaseEvent(waits[1]);
+		clReleaseEvent(multiplied);
+	}
+
+	dev.profile.Add(m2Written);
+	clReleaseEvent(m2Written);
+
+	// Start every queue now, so this device runs while the next one is being enqueued
+	clFlush(dev.copyInQueue);
+	clFlush(dev.queue);
+	clFlush(dev.copyOutQueue);
 }
 
-// This function manages the execution of the OpenCL framework with the cofnigured kernel
-void RunOpenCL(int rows, int cols)
+// This function runs this node's rows on every device at once, waits for all of them, and then rebalances the split by each device's
+// measured throughput (rows per second of device time) for the next size
+void RunOpenCL(int cols)
 {
-	// Enqueues the kernel to start executing the commands detailed in the program's queue
-	clEnqueueNDRangeKernel(queue, kernel, 3, NULL, global, NULL, 0, NULL, &event);
+	for (int d = 0; d < numDevices; d++)
+		EnqueueDevice(devices[d], cols);
 
-	// Wait for all work-items to finish
-	clWaitForEvents(1, &event);
+	// Wait for every device to finish its rows of m3
+	for (int d = 0; d < numDevices; d++)
+	{
+		clFinish(devices[d].copyInQueue);
+		clFinish(devices[d].queue);
+		clFinish(devices[d].copyOutQueue);
+	}
 
-	// Reads memory from buffer objects back to host memory once the program has finished execution
-	clEnqueueReadBuffer(queue, bufM3, CL_TRUE, 0, rows * cols * sizeof(int), &m3_sub[0], 0, NULL, NULL);
+	double work[numDevices], seconds[numDevices], weights[numDevices];
+	for (int d = 0; d < numDevices; d++)
+	{
+		double before = devices[d].profile.Total();
+		devices[d].profile.Collect();
+		work[d] = devices[d].rows;
+		seconds[d] = devices[d].profile.Total() - before;
+		weights[d] = devices[d].weight;
+	}
+	UpdateDeviceWeights(work, seconds, weights, numDevices);
+	for (int d = 0; d < numDevices; d++)
+		devices[d].weight = weights[d];
 }
 
 // This function prints an individual row of a matrix using appropriate spacing
-void PrintRow(int* array, int size)
+template <typename T>
+void PrintRow(T* array, int size)
 {
 	cout << "|  ";
 	for (int i = 0; i < size; i++)
@@ -240,7 +363,8 @@ void PrintRow(int* array, int size)
 }
 
 // This function prints both input matrices and the output matrix in the form of an equation (should only be called if size < 10 due to formatting issues)
-void PrintEquation(int** matrix1, int** matrix2, int** matrix3, int size, bool print)
+template <typename T>
+void PrintEquation(T** matrix1, T** matrix2, T** matrix3, int size, bool print)
 {
 	if (!print)
 		return;
@@ -265,10 +389,12 @@ void PrintEquation(int** matrix1, int** matrix2, int** matrix3, int size, bool p
 	cout << endl;
 }
 
-// This function allocates contiguous memory for a single square matrix based on its rows and cols
-void InitialiseMatrix(int* &matrix, int rows, int cols)
+// This function allocates contiguous memory for a single square matrix based on its rows and cols (aligned so a zero-copy device can use it
+// in place)
+template <typename T>
+void InitialiseMatrix(T* &matrix, int rows, int cols)
 {
-	matrix = (int*)malloc(rows * cols * sizeof(int*));
+	matrix = (T*)AllocateHostAligned(rows * cols * sizeof(T));
 
     for (int i = 0; i < rows * cols; i++)
     {
@@ -277,7 +403,8 @@ void InitialiseMatrix(int* &matrix, int rows, int cols)
 }
 
 // This function populates an input matrix with random integers less than 10
-void PopulateMatrix(int* &matrix, int rows, int cols)
+template <typename T>
+void PopulateMatrix(T* &matrix, int rows, int cols)
 {
 	for (int i = 0; i < rows * cols; i++)
 	{
@@ -285,11 +412,12 @@ void PopulateMatrix(int* &matrix, int rows, int cols)
 	}
 }
 
-void print(int* A, int rows, int cols) {
+template <typename T>
+void print(T* A, int rows, int cols) {
   for(long i = 0 ; i < rows; i++) { //rows
         for(long j = 0 ; j < cols; j++) {  //cols
             int val = (i * cols) + j;
-            printf("%d ",  A[val]); // print the cell value
+            cout << A[val] << " "; // print the cell value
 
         }
         printf("\n"); //at the end of the row, print a new line
@@ -311,10 +439,24 @@ int main(int argc, char** argv)
 	MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
 	// Get the rank
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	// Set up OpenCL (a runtime for every device) once for every matrix size
+	CreateDevices();
+
+	// Delete any existing results file
+	if (rank == masterRank)
+		remove(PROFILE_CSV);
+
+	// Report the element type the program was compiled for
+	if (rank == masterRank)
+		cout << "Element type: " << ElementTraits<Element>::Name() << endl;
 
 	// Define sizes of matrices
 	int n_sizes[] = { 1, 10, 50, 100, 500, 1000 };
 
+	// Start with every node weighted equally (only used when WEIGHTED_PARTITION is on)
+	double weights[numtasks];
+	fill_n(weights, numtasks, 1.0);
+
 	for (int size : n_sizes)
 	{
 		// Generate random seed using time
@@ -322,14 +464,24 @@ int main(int argc, char** argv)
 		
 		// Get the count of data to be broadcasted for a single matrix
 		int broadcast_size = size * size;
-		// Calculate how many rows to send to each node
-		int scatter_rows = size / numtasks;
 		// Create an array to store how much data to send across to each node
 		int sendcounts[numtasks];
 		// Create an array to store the displacement values used for keeping track of data sent for each node
 		int displs[numtasks];
-		// Increment variable to store the most recent displacement value
-		int increment = 0;
+		// Determine the sendcounts and displacement values for each task (each row is size ints)
+		CalculatePartition(sendcounts, displs, size, size, numtasks, WEIGHTED_PARTITION ? weights : NULL);
+		// Get how many rows this node will process
+		int scatter_rows = sendcounts[rank] / size;
+		// Always allocate at least one row so nodes without any rows still have a valid buffer
+		int alloc_rows = max(scatter_rows, 1);
+		// Variable to store how long this node spends multiplying its rows
+		double computeSeconds = 0;
+		// Start timing this size's device commands from zero
+		for (int d = 0; d < numDevices; d++)
+			devices[d].profile.Reset();
+		// Variables to store how many rows of the product failed verification and how long the check took
+		int failedRows = 0;
+		microseconds verifyDuration(0);
 
 		// Take current time before executing multiplcation
 		auto start = high_resolution_clock::now();
@@ -346,75 +498,60 @@ int main(int argc, char** argv)
 			PopulateMatrix(m1, size, size);
 			PopulateMatrix(m2, size, size);
 			
-			// Determine the sendcounts and displacement values for each task
-			for (int p_id = 0; p_id < numtasks; p_id++)
-			{
-				displs[p_id] = increment;
-				if (size % numtasks != 0 && p_id == 0)
-				{
-					// If the size is not divisible by the amount of nodes, the master node will manage the remaining row(s)
-					scatter_rows += (size % numtasks);
-					sendcounts[p_id] = scatter_rows * size;
-				}
-				else
-					sendcounts[p_id] = scatter_rows * size;
-				increment += sendcounts[p_id];
-			}
             
 			// Allocate memory for the sub matrices
-			InitialiseMatrix(m1_sub, scatter_rows, size);
-			InitialiseMatrix(m3_sub, scatter_rows, size);
+			InitialiseMatrix(m1_sub, alloc_rows, size);
+			InitialiseMatrix(m3_sub, alloc_rows, size);
             
             
 			// Scatter data from the m1 matrix into the m1_sub matrices for all nodes using distinct sendcount values
-			MPI_Scatterv(&m1[0], sendcounts, displs, MPI_INT, &m1_sub[0], sendcounts[rank], MPI_INT, masterRank, MPI_COMM_WORLD);
+			MPI_Scatterv(&m1[0], sendcounts, displs, MPI_ELEMENT, &m1_sub[0], sendcounts[rank], MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
 			// Broadcast the entire m2 matrix to all nodes
-			MPI_Bcast(&m2[0], broadcast_size, MPI_INT, masterRank, MPI_COMM_WORLD);
+			MPI_Bcast(&m2[0], broadcast_size, MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
 
+			auto computeStart = high_resolution_clock::now();
 			SetupOpenCL(scatter_rows, size, size);
-            RunOpenCL(scatter_rows, size);
+            RunOpenCL(size);
+			computeSeconds = duration_cast<duration<double>>(high_resolution_clock::now() - computeStart).count();
 
             //print(m3_sub, size, size);
 
+			// Check every node's rows of the product in O(n^2) before they are gathered (timed separately from the multiply)
+			if (VERIFY_ROUNDS > 0)
+				failedRows = VerifyProduct(scatter_rows, size, verifyDuration);
+
             // Gather the m3_sub results from all nodes (taking into account their respective sendcount value) and store in m3
-			MPI_Gatherv(&m3_sub[0], sendcounts[rank], MPI_INT, &m3[0], sendcounts, displs, MPI_INT, masterRank, MPI_COMM_WORLD);
+			MPI_Gatherv(&m3_sub[0], sendcounts[rank], MPI_ELEMENT, &m3[0], sendcounts, displs, MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
 
 			// Free the memory from buffers
 			FreeMemory();            
 		}
 		else
 		{
-			// Determine the sendcounts and displacement values for each task
-			for (int p_id = 0; p_id < numtasks; p_id++)
-			{
-				displs[p_id] = increment;
-				if (size % numtasks != 0 && p_id == 0)
-				{
-					scatter_rows += (size % numtasks);
-					sendcounts[p_id] = scatter_rows * size;
-				}
-				else
-					sendcounts[p_id] = scatter_rows * size;
-				increment += sendcounts[p_id];
-			}
 			
 			// Allocate memory for the sub matrices and for m2
-			InitialiseMatrix(m1_sub, scatter_rows, size);
+			InitialiseMatrix(m1_sub, alloc_rows, size);
 			InitialiseMatrix(m2, size, size);
-			InitialiseMatrix(m3_sub, scatter_rows, size);
+			InitialiseMatrix(m3_sub, alloc_rows, size);
 
 			// Receive data from the m1 matrix on master node and store into m1_sub matrix
-			MPI_Scatterv(NULL, sendcounts, displs, MPI_INT, &m1_sub[0], sendcounts[rank], MPI_INT, masterRank, MPI_COMM_WORLD);
+			MPI_Scatterv(NULL, sendcounts, displs, MPI_ELEMENT, &m1_sub[0], sendcounts[rank], MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
 			// Recieve broadcast from the m2 matrix on master
-			MPI_Bcast(&m2[0], broadcast_size, MPI_INT, masterRank, MPI_COMM_WORLD);
+			MPI_Bcast(&m2[0], broadcast_size, MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
 
             //print(m1_sub, size, size);
 
+			auto computeStart = high_resolution_clock::now();
 			SetupOpenCL(scatter_rows, size, size);
-            RunOpenCL(scatter_rows, size);
+            RunOpenCL(size);
+			computeSeconds = duration_cast<duration<double>>(high_resolution_clock::now() - computeStart).count();
+
+			// Check this node's rows of the product before they are sent
+			if (VERIFY_ROUNDS > 0)
+				failedRows = VerifyProduct(scatter_rows, size, verifyDuration);
 
 			// Send the m3_sub results to m3 in master
-			MPI_Gatherv(&m3_sub[0], sendcounts[rank], MPI_INT, NULL, sendcounts, displs, MPI_INT, masterRank, MPI_COMM_WORLD);
+			MPI_Gatherv(&m3_sub[0], sendcounts[rank], MPI_ELEMENT, NULL, sendcounts, displs, MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
 
 			// Free the memory from buffers
 			FreeMemory();
@@ -423,16 +560,40 @@ int main(int argc, char** argv)
 		// Retrieve finish time
 		auto stop = high_resolution_clock::now();
 
-		// Calculation durations and cast to microseconds
-		auto duration = duration_cast<microseconds>(stop - start);
+		// Calculation durations (leaving out the check) and cast to microseconds
+		auto duration = duration_cast<microseconds>(stop - start) - verifyDuration;
+
+		// Record this node's throughput (multiply-adds per second) so the next size can be balanced on it
+		if (WEIGHTED_PARTITION)
+			UpdateWeights((double)scatter_rows * size * size, computeSeconds, weights, numtasks, MPI_COMM_WORLD);
 
-		// Print total time taken on head node
+		// Add up the time of every device command of this size and keep the slowest node's times (the one the master waits for)
+		double nodeSeconds[PROFILE_STAGES] = { 0 };
+		for (int d = 0; d < numDevices; d++)
+		{
+			for (int stage = 0; stage < PROFILE_STAGES; stage++)
+				nodeSeconds[stage] += devices[d].profile.seconds[stage];
+		}
+		double deviceSeconds[PROFILE_STAGES];
+		MPI_Reduce(nodeSeconds, deviceSeconds, PROFILE_STAGES, MPI_DOUBLE, MPI_MAX, masterRank, MPI_COMM_WORLD);
+
+		// Print total time taken on head node, broken down into the device's copy and kernel times, and export them
 		if (rank == masterRank)
 		{
 			cout << "Time taken to multiply matrices of size " << size << ": " << duration.count() << " microseconds" << endl;
+			PrintProfile(deviceSeconds);
+			if (VERIFY_ROUNDS > 0)
+			{
+				if (failedRows == 0)
+					cout << "    Verified: passed " << VERIFY_ROUNDS << " Freivalds rounds in " << verifyDuration.count() << " microseconds" << endl;
+				else
+					cout << "    Verified: FAILED, " << failedRows << " incorrect rows" << endl;
+			}
+			AppendProfileCsv(PROFILE_CSV, size, (double)duration.count(), deviceSeconds);
 		}
 	}	
-	// Finalize the MPI environment
+	// Release OpenCL and finalize the MPI environment
+	DeleteDevices();
 	MPI_Finalize();
 }
 
@@ -440,16 +601,88 @@ int main(int argc, char** argv)
 
 // This function computes the multiplication of two matrices and stores the result in a third. It is executed by a kernel that resides with in the
 // OpenGL program variable. The instructions are fed via a queue.
-
-__kernel void matrix_multiply(const __global int* matrix1, const __global int* matrix2, __global int* matrix3, const int size)
+//
+// matrix1 is rows x size, matrix2 is size x size and matrix3 is rows x size. Each work-group computes one TS x TS tile of matrix3 by stepping
+// along the shared dimension one tile at a time: the group first copies a TS x TS tile of matrix1 and of matrix2 into __local memory, then every
+// work-item accumulates WPT results (one column, WPT rows spaced TS / WPT apart) in registers. Each work-item writes its results exactly once,
+// so there are no races on matrix3. TS and WPT are passed in by the host as build options (-DTS=.. -DWPT=..) based on the device limits.
+//
+// The host may stream matrix1 and matrix3 through the device in strips of rows, so each launch only covers rows firstRow to rows - 1.
+
+// The element type T is also passed in by the host (-DT=int, long, float or double), and doubles need the fp64 extension
+#ifndef T
+#define T int
+#endif
+#ifdef T_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef TS
+#define TS 16
+#endif
+#ifndef WPT
+#define WPT 4
+#endif
+
+// Rows of the tile handled per pass by the work-group (the local size in dimension 1)
+#define RTS (TS / WPT)
+
+__kernel void matrix_multiply(const __global T* matrix1, const __global T* matrix2, __global T* matrix3, const int firstRow, const int rows, const int size)
 {
-	// Get row, col and size values from global array
-	const int i = get_global_id(0);
-	const int j = get_global_id(1);
-	const int k = get_global_id(2);
- 
-	// Compute and store the mulitplication result into the output matrix memory
-    matrix3[(i * size) + j] += matrix1[(i * size) + k] * matrix2[(k * size) + j];
+	// Get the position of the work-item within its tile (dimension 0 is the column so neighbouring work-items read neighbouring memory)
+	const int localCol = get_local_id(0);
+	const int localRow = get_local_id(1);
+
+	// Get the column this work-item computes and the first row of the tile handled by its work-group
+	const int globalCol = (get_group_id(0) * TS) + localCol;
+	const int groupRow = firstRow + (get_group_id(1) * TS);
+
+	// Declare the tiles of the two input matrices shared by the work-group
+	__local T tile1[TS][TS];
+	__local T tile2[TS][TS];
+
+	// Initialise the register block of results
+	T acc[WPT];
+	for (int w = 0; w < WPT; w++)
+		acc[w] = 0;
+
+	const int numTiles = (size + TS - 1) / TS;
+	for (int t = 0; t < numTiles; t++)
+	{
+		// Load one tile of each input into local memory (zero-padding anything past the edge of the matrices)
+		for (int w = 0; w < WPT; w++)
+		{
+			const int tileRow = localRow + (w * RTS);
+			const int row1 = groupRow + tileRow;
+			const int col1 = (t * TS) + localCol;
+			const int row2 = (t * TS) + tileRow;
+
+			tile1[tileRow][localCol] = (row1 < rows && col1 < size) ? matrix1[(row1 * size) + col1] : 0;
+			tile2[tileRow][localCol] = (row2 < size && globalCol < size) ? matrix2[(row2 * size) + globalCol] : 0;
+		}
+
+		// Wait until the whole tile has been loaded
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// Accumulate the products for this tile
+		for (int k = 0; k < TS; k++)
+		{
+			const T b = tile2[k][localCol];
+			for (int w = 0; w < WPT; w++)
+				acc[w] += tile1[localRow + (w * RTS)][k] * b;
+		}
+
+		// Wait until everyone is finished with the tile before it is overwritten
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	// Store the results into the output matrix memory
+	for (int w = 0; w < WPT; w++)
+	{
+		const int row = groupRow + localRow + (w * RTS);
+		if (row < rows && globalCol < size)
+			matrix3[(row * size) + globalCol] = acc[w];
+	}
 }
 
  */
\ No newline at end of file
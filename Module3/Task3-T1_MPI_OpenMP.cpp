@@ -1,9 +1,16 @@
 #include <mpi.h>
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
 #include <time.h>
 #include <chrono>
+#include <algorithm>
+#include "Partition.h"
+#include "ElementType.h"
 #include <omp.h>
+#include <sched.h>
+#include <unistd.h>
+#include <vector>
 
 using namespace std::chrono;
 using namespace std;
@@ -11,8 +18,12 @@ using namespace std;
 // Set rank of master node to 0
 #define masterRank 0
 
+// Toggle balancing the rows sent to each node by their measured throughput (1) or splitting them evenly (0)
+#define WEIGHTED_PARTITION 0
+
 // This function prints an individual row of a matrix using appropriate spacing
-void PrintRow(int* array, int size)
+template <typename T>
+void PrintRow(T* array, int size)
 {
 	cout << "|  ";
 	for (int i = 0; i < size; i++)
@@ -31,7 +42,8 @@ void PrintRow(int* array, int size)
 }
 
 // This function prints both input matrices and the output matrix in the form of an equation (should only be called if size < 10 due to formatting issues)
-void PrintEquation(int** matrix1, int** matrix2, int** matrix3, int size, bool print)
+template <typename T>
+void PrintEquation(T** matrix1, T** matrix2, T** matrix3, int size, bool print)
 {
 	if (!print)
 		return;
@@ -57,10 +69,11 @@ void PrintEquation(int** matrix1, int** matrix2, int** matrix3, int size, bool p
 }
 
 // This function allocates contiguous memory for a single square matrix based on its rows and cols
-void InitialiseMatrix(int** &matrix, int rows, int cols, int size)
+template <typename T>
+void InitialiseMatrix(T** &matrix, int rows, int cols, int size)
 {
-	matrix = (int**)malloc(rows * cols * sizeof(int*));
-	int *tempRow = (int*)malloc(rows * cols * sizeof(int));
+	matrix = (T**)malloc(rows * cols * sizeof(T*));
+	T *tempRow = (T*)malloc(rows * cols * sizeof(T));
 
 	#pragma omp parallel default(none) shared(matrix, tempRow, rows, cols, size)
 	{
@@ -73,7 +86,8 @@ void InitialiseMatrix(int** &matrix, int rows, int cols, int size)
 }
 
 // This function populates an input matrix with random integers less than 10
-void PopulateMatrix(int** &matrix, int rows, int cols)
+template <typename T>
+void PopulateMatrix(T** &matrix, int rows, int cols)
 {
 	#pragma omp parallel default(none) shared(matrix, rows, cols)
 	{
@@ -88,26 +102,154 @@ void PopulateMatrix(int** &matrix, int rows, int cols)
 	}
 }
 
-// This function multiplies two matrices together and stores the output in a third
-void MultiplyMatrices(int** matrix1, int** matrix2, int** matrix3, int rows, int size)
+// This function multiplies two matrices together and stores the output in a third, splitting the rows between the threads and computing
+// each one with the vectorised row kernel
+template <typename T>
+void MultiplyMatrices(T** matrix1, T** matrix2, T** matrix3, int rows, int size)
 {
 	#pragma omp parallel default(none) shared(matrix1, matrix2, matrix3, rows, size)
 	{
-		#pragma omp for collapse(2)
+		#pragma omp for
 		for (int i = 0; i < rows; i++)
 		{
-			for (int j = 0; j < size; j++)
-			{
-				matrix3[i][j] = 0;
-				for (int k = 0; k < size; k++)
-				{
-					matrix3[i][j] += matrix1[i][k] * matrix2[k][j];
-				}
-			}
+			MultiplyRow(matrix1[i], matrix2, matrix3[i], size);
 		}
 	}
 }
 
+// | ------------------------------------------------------ |
+// | Hybrid MPI + OpenMP Runtime							|
+// | ------------------------------------------------------ |
+// Ranks that share a node are detected with MPI_Comm_split_type so each rank can size its OpenMP thread pool to its share of the node's
+// cores and pin those threads to distinct cores. The broadcast m2 matrix is held in a shared memory window owned by the first rank on
+// each node, so it is only sent once per node (between node leaders) and every rank on that node reads the same copy.
+// Note: only the cores the ranks are allowed to run on are used (a cgroup or cpuset may allow fewer than the node has). When the launcher
+// already binds each rank to its own cores they are kept as they are, so launch with "mpirun --bind-to none" to let the ranks share out
+// the whole node instead.
+
+// Define struct to hold the node layout of this rank
+struct HybridRuntime
+{
+	MPI_Comm nodeComm;
+	MPI_Comm leaderComm;
+	int localRank;
+	int ranksPerNode;
+	int threads;
+	// Index of this rank's first core in the list of cores it may use
+	int firstCore;
+};
+
+// This function detects the ranks sharing this node, then sizes and pins this rank's OpenMP thread pool
+void SetupHybridRuntime(HybridRuntime &runtime, int rank)
+{
+	// Group the ranks that can share memory (i.e. are on the same node), ordered by world rank so the master is a node leader
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &runtime.nodeComm);
+	MPI_Comm_rank(runtime.nodeComm, &runtime.localRank);
+	MPI_Comm_size(runtime.nodeComm, &runtime.ranksPerNode);
+
+	// The first rank on every node joins the leader communicator used to move m2 between nodes
+	MPI_Comm_split(MPI_COMM_WORLD, runtime.localRank == 0 ? 0 : MPI_UNDEFINED, rank, &runtime.leaderComm);
+
+	// Find the cores this rank is allowed to run on (without them, fall back to sizing the pool by the online cores and not pinning)
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+	{
+		perror("sched_getaffinity");
+		int cores = max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+		runtime.threads = max(cores / runtime.ranksPerNode, 1);
+		runtime.firstCore = 0;
+		omp_set_num_threads(runtime.threads);
+		return;
+	}
+
+	// If every rank on the node was given the same cores, split them between the ranks (lower local ranks take any leftover cores).
+	// Otherwise the launcher has already bound each rank to its own cores, so use all of them
+	cpu_set_t common = allowed, combined = allowed;
+	MPI_Allreduce(MPI_IN_PLACE, &common, sizeof(cpu_set_t), MPI_UNSIGNED_CHAR, MPI_BAND, runtime.nodeComm);
+	MPI_Allreduce(MPI_IN_PLACE, &combined, sizeof(cpu_set_t), MPI_UNSIGNED_CHAR, MPI_BOR, runtime.nodeComm);
+	bool shared = CPU_EQUAL(&common, &combined);
+
+	vector<int> cpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &allowed))
+			cpus.push_back(cpu);
+	}
+	int cores = (int)cpus.size();
+	int ranks = shared ? runtime.ranksPerNode : 1;
+	int index = shared ? runtime.localRank : 0;
+	int share = cores / ranks;
+	int leftover = cores % ranks;
+	runtime.threads = max(share + (index < leftover ? 1 : 0), 1);
+	runtime.firstCore = (index * share + min(index, leftover)) % cores;
+	omp_set_num_threads(runtime.threads);
+
+	// Pin each thread to its own core within this rank's share, and report any thread that couldn't be pinned
+	int failures = 0;
+	#pragma omp parallel default(none) shared(runtime, cpus, cores) reduction(+ : failures)
+	{
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpus[(runtime.firstCore + omp_get_thread_num()) % cores], &cpuset);
+		if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) != 0)
+			failures++;
+	}
+	if (failures > 0)
+		fprintf(stderr, "Rank %d: could not pin %d of %d threads to their cores\n", rank, failures, runtime.threads);
+}
+
+// This function releases the communicators created by SetupHybridRuntime
+void FreeHybridRuntime(HybridRuntime &runtime)
+{
+	if (runtime.leaderComm != MPI_COMM_NULL)
+		MPI_Comm_free(&runtime.leaderComm);
+	MPI_Comm_free(&runtime.nodeComm);
+}
+
+// This function allocates a size x size matrix in a shared memory window owned by the node leader, and points the rows of matrix into it
+template <typename T>
+void AllocateSharedMatrix(HybridRuntime &runtime, T** &matrix, MPI_Win &win, int size)
+{
+	T *base;
+	MPI_Aint segmentSize;
+	int dispUnit;
+
+	// Only the node leader contributes memory, the other ranks query the leader's segment
+	MPI_Aint bytes = (runtime.localRank == 0) ? (MPI_Aint)size * size * sizeof(T) : 0;
+	MPI_Win_allocate_shared(bytes, sizeof(T), MPI_INFO_NULL, runtime.nodeComm, &base, &win);
+	MPI_Win_shared_query(win, 0, &segmentSize, &dispUnit, &base);
+
+	matrix = (T**)malloc(size * sizeof(T*));
+	for (int i = 0; i < size; i++)
+	{
+		matrix[i] = &base[i * size];
+	}
+
+	// Open the first access epoch so the leader can write into the window
+	MPI_Win_fence(0, win);
+}
+
+// This function broadcasts a shared matrix from the master to the node leaders only, then makes it visible to every rank on each node
+template <typename T>
+void ShareMatrix(HybridRuntime &runtime, T** matrix, MPI_Win win, int size)
+{
+	if (runtime.leaderComm != MPI_COMM_NULL)
+		MPI_Bcast(&matrix[0][0], size * size, MPI_ELEMENT, masterRank, runtime.leaderComm);
+
+	// Close the epoch so the leader's writes are visible to the other ranks on the node
+	MPI_Win_fence(0, win);
+}
+
+// This function releases a matrix allocated by AllocateSharedMatrix
+template <typename T>
+void FreeSharedMatrix(T** &matrix, MPI_Win &win)
+{
+	MPI_Win_free(&win);
+	free(matrix);
+	matrix = NULL;
+}
+
 // Main execution function that manages the sequence of execution
 int main(int argc, char** argv)
 {
@@ -120,36 +262,51 @@ int main(int argc, char** argv)
     // Get the rank
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
+    // Detect the ranks on this node and size/pin the OpenMP thread pool accordingly
+    HybridRuntime runtime;
+    SetupHybridRuntime(runtime, rank);
+    if (rank == masterRank)
+        cout << "Ranks on master node: " << runtime.ranksPerNode << ", threads per rank: " << runtime.threads << endl;
+
+    // Report the element type the program was compiled for
+    if (rank == masterRank)
+        cout << "Element type: " << ElementTraits<Element>::Name() << endl;
+
     // Define sizes of matrices
     int n_sizes[] = { 1, 10, 50, 100, 500, 1000 };
 
+    // Start with every node weighted equally (only used when WEIGHTED_PARTITION is on)
+    double weights[numtasks];
+    fill_n(weights, numtasks, 1.0);
+
     for (int size : n_sizes)
     {
         // Generate random seed using time
         srand(time(0)); 
 
-        // Set number of available threads for OpenMP
-        omp_set_num_threads(4);
-        
-        // Get the count of data to be broadcasted for a single matrix
-        int broadcast_size = size * size;
-        // Calculate how many rows to send to each node
-        int scatter_rows = size / numtasks;
         // Create an array to store how much data to send across to each node
         int sendcounts[numtasks];
         // Create an array to store the displacement values used for keeping track of data sent for each node
         int displs[numtasks];
-        // Increment variable to store the most recent displacement value
-        int increment = 0;
+        // Determine the sendcounts and displacement values for each task (each row is size ints)
+        CalculatePartition(sendcounts, displs, size, size, numtasks, WEIGHTED_PARTITION ? weights : NULL);
+        // Get how many rows this node will process
+        int scatter_rows = sendcounts[rank] / size;
+        // Always allocate at least one row so nodes without any rows still have a valid buffer
+        int alloc_rows = max(scatter_rows, 1);
+        // Variable to store how long this node spends multiplying its rows
+        double computeSeconds = 0;
 
         // Create two sub-matrices for internal processing of each node (m2_sub not needed since m2 will be broadcasted)
-        int **m1_sub;
-        int **m3_sub;
+        Element **m1_sub;
+        Element **m3_sub;
 
         // Create main matrices for the two inputs and outputs
-        int **m1;
-        int **m2;
-        int **m3;
+        Element **m1;
+        Element **m2;
+        Element **m3;
+        // Declare the shared memory window holding m2 on this node
+        MPI_Win m2_win;
 
         // Take current time before executing multiplcation
         auto start = high_resolution_clock::now();
@@ -159,73 +316,50 @@ int main(int argc, char** argv)
         {
             // Allocate memory to all main matrices
             InitialiseMatrix(m1, size, size, size);
-            InitialiseMatrix(m2, size, size, size);
+            AllocateSharedMatrix(runtime, m2, m2_win, size);
             InitialiseMatrix(m3, size, size, size);
 
             // Populate input matrices with random values
             PopulateMatrix(m1, size, size);
             PopulateMatrix(m2, size, size);  
             
-            // Determine the sendcounts and displacement values for each task
-            for (int p_id = 0; p_id < numtasks; p_id++)
-            {
-                displs[p_id] = increment;
-                if (size % numtasks != 0 && p_id == 0)
-                {
-                    // If the size is not divisible by the amount of nodes, the master node will manage the remaining row(s)
-                    scatter_rows += (size % numtasks);
-                    sendcounts[p_id] = scatter_rows * size;
-                }
-                else
-                    sendcounts[p_id] = scatter_rows * size;
-                increment += sendcounts[p_id];
-            }
 
             // Allocate memory for the sub matrices
-            InitialiseMatrix(m1_sub, scatter_rows, size, size);
-            InitialiseMatrix(m3_sub, scatter_rows, size, size);
+            InitialiseMatrix(m1_sub, alloc_rows, size, alloc_rows);
+            InitialiseMatrix(m3_sub, alloc_rows, size, alloc_rows);
 
             // Scatter data from the m1 matrix into the m1_sub matrices for all nodes using distinct sendcount values
-            MPI_Scatterv(&m1[0][0], sendcounts, displs, MPI_INT, &m1_sub[0][0], sendcounts[rank], MPI_INT, masterRank, MPI_COMM_WORLD);
-            // Broadcast the entire m2 matrix to all nodes
-            MPI_Bcast(&m2[0][0], broadcast_size, MPI_INT, masterRank, MPI_COMM_WORLD);
+            MPI_Scatterv(&m1[0][0], sendcounts, displs, MPI_ELEMENT, &m1_sub[0][0], sendcounts[rank], MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
+            // Broadcast the entire m2 matrix to the other nodes (ranks on the same node read the shared copy)
+            ShareMatrix(runtime, m2, m2_win, size);
 
             // Multiply the m1_sub and m2 matrices and store result in m3_sub (note only need to calculate the count of rows sent to the node)
+            auto computeStart = high_resolution_clock::now();
             MultiplyMatrices(m1_sub, m2, m3_sub, scatter_rows, size);
+            computeSeconds = duration_cast<duration<double>>(high_resolution_clock::now() - computeStart).count();
 
             // Gather the m3_sub results from all nodes (taking into account their respective sendcount value) and store in m3
-            MPI_Gatherv(&m3_sub[0][0], sendcounts[rank], MPI_INT, &m3[0][0], sendcounts, displs, MPI_INT, masterRank, MPI_COMM_WORLD);
+            MPI_Gatherv(&m3_sub[0][0], sendcounts[rank], MPI_ELEMENT, &m3[0][0], sendcounts, displs, MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
         }
         else
         {
-            // Determine the sendcounts and displacement values for each task
-            for (int p_id = 0; p_id < numtasks; p_id++)
-            {
-                displs[p_id] = increment;
-                if (size % numtasks != 0 && p_id == 0)
-                {
-                    scatter_rows += (size % numtasks);
-                    sendcounts[p_id] = scatter_rows * size;
-                }
-                else
-                    sendcounts[p_id] = scatter_rows * size;
-                increment += sendcounts[p_id];
-            }
             
-            // Allocate memory for the sub matrices and for m2
-            InitialiseMatrix(m1_sub, scatter_rows, size, size);
-            InitialiseMatrix(m2, size, size, size);
-            InitialiseMatrix(m3_sub, scatter_rows, size, size);
+            // Allocate memory for the sub matrices and map this node's shared copy of m2
+            InitialiseMatrix(m1_sub, alloc_rows, size, alloc_rows);
+            AllocateSharedMatrix(runtime, m2, m2_win, size);
+            InitialiseMatrix(m3_sub, alloc_rows, size, alloc_rows);
 
             // Receive data from the m1 matrix on master node and store into m1_sub matrix
-            MPI_Scatterv(NULL, sendcounts, displs, MPI_INT, &m1_sub[0][0], sendcounts[rank], MPI_INT, masterRank, MPI_COMM_WORLD);
-            // Recieve broadcast from the m2 matrix on master
-            MPI_Bcast(&m2[0][0], broadcast_size, MPI_INT, masterRank, MPI_COMM_WORLD);
+            MPI_Scatterv(NULL, sendcounts, displs, MPI_ELEMENT, &m1_sub[0][0], sendcounts[rank], MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
+            // Recieve broadcast from the m2 matrix on master (only node leaders take part, the rest wait for the shared copy)
+            ShareMatrix(runtime, m2, m2_win, size);
 
             // Multiply the m1_sub and m2 matrices and store result in m3_sub (note only need to calculate the count of rows sent to the node)
+            auto computeStart = high_resolution_clock::now();
             MultiplyMatrices(m1_sub, m2, m3_sub, scatter_rows, size);
+            computeSeconds = duration_cast<duration<double>>(high_resolution_clock::now() - computeStart).count();
             // Send the m3_sub results to m3 in master
-            MPI_Gatherv(&m3_sub[0][0], sendcounts[rank], MPI_INT, NULL, sendcounts, displs, MPI_INT, masterRank, MPI_COMM_WORLD);
+            MPI_Gatherv(&m3_sub[0][0], sendcounts[rank], MPI_ELEMENT, NULL, sendcounts, displs, MPI_ELEMENT, masterRank, MPI_COMM_WORLD);
         }
 
         // Retrieve finish time
@@ -234,6 +368,10 @@ int main(int argc, char** argv)
         // Calculation durations and cast to microseconds
         auto duration = duration_cast<microseconds>(stop - start);
 
+        // Record this node's throughput (multiply-adds per second) so the next size can be balanced on it
+        if (WEIGHTED_PARTITION)
+            UpdateWeights((double)scatter_rows * size * size, computeSeconds, weights, numtasks, MPI_COMM_WORLD);
+
         // Print total time taken on head node
         if (rank == masterRank)
         {
@@ -243,7 +381,11 @@ int main(int argc, char** argv)
 
             cout << "Time taken to multiply matrices of size " << size << ": " << duration.count() << " microseconds" << endl;
         }
+
+        // Release this node's shared copy of m2
+        FreeSharedMatrix(m2, m2_win);
     }
-    // Finalize the MPI environment
+    // Release the node communicators and finalize the MPI environment
+    FreeHybridRuntime(runtime);
     MPI_Finalize();
 }